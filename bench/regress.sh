@@ -0,0 +1,347 @@
+#!/bin/sh
+#
+# bench/regress.sh
+#
+# End-to-end regression runs of vmpt over a corpus of traces.
+#
+# The corpus is snapshot.pt plus traces generated with vmpt-bench: a dense
+# one with many bundles, a sparse one with far apart PSBs on which the
+# prefilter skips most segments, and a noisy one with many stray PADs and
+# TSCs.  Two small handcrafted traces cover corner cases: one with a PSB
+# that straddles the end of the first 4k window, and one that ends in PSB
+# segments with only a TSC.  Every configuration below runs over every
+# trace.  The first
+# configuration of each output format is its reference; the digest of every
+# other configuration's output must match it, which proves the fast paths
+# equivalent to the reference path.
+#
+# For every run we record the output digest, the wall time, the peak RSS as
+# reported by --stats=json and the throughput.  Given the results of an
+# earlier run with -r, a digest that changed or a time or RSS that grew by
+# more than the -t threshold is flagged as a regression.
+#
+# The script exits non-zero if any output did not match or regressed.
+
+usage() {
+	cat <<EOF
+usage: $0 [<options>]
+
+options:
+  -h          this text.
+  -b <dir>    the build directory with vmpt and vmpt-bench (default: build).
+  -w <dir>    where to keep the generated traces and the outputs (default:
+              \$TMPDIR/vmpt-regress).
+  -s <size>   the size of the generated traces (default: 2g).
+  -n <n>      run each configuration <n> times and keep the fastest run
+              (default: 1).
+  -o <file>   write the results to <file> (default: <dir>/results.txt).
+  -r <file>   compare against the results in <file>.
+  -t <pct>    flag times and RSS that grew by more than <pct> percent (default:
+              10).
+  -m <sec>    do not compare times below <sec> seconds (default: 0.5).
+EOF
+}
+
+src=$(cd "$(dirname "$0")/.." && pwd)
+build=build
+work=${TMPDIR:-/tmp}/vmpt-regress
+size=2g
+runs=1
+results=
+baseline=
+threshold=10
+min_time=0.5
+
+while getopts hb:w:s:n:o:r:t:m: opt; do
+	case $opt in
+	h) usage; exit 0 ;;
+	b) build=$OPTARG ;;
+	w) work=$OPTARG ;;
+	s) size=$OPTARG ;;
+	n) runs=$OPTARG ;;
+	o) results=$OPTARG ;;
+	r) baseline=$OPTARG ;;
+	t) threshold=$OPTARG ;;
+	m) min_time=$OPTARG ;;
+	*) usage >&2; exit 2 ;;
+	esac
+done
+
+vmpt=$build/vmpt
+bench=$build/vmpt-bench
+for tool in "$vmpt" "$bench"; do
+	if [ ! -x "$tool" ]; then
+		echo "$0: $tool not found; use -b." >&2
+		exit 2
+	fi
+done
+
+if [ -n "$baseline" ] && [ ! -r "$baseline" ]; then
+	echo "$0: cannot read $baseline." >&2
+	exit 2
+fi
+
+mkdir -p "$work" || exit 2
+rm -rf "$work/cache"
+mkdir "$work/cache" || exit 2
+results=${results:-$work/results.txt}
+
+# The configurations: <name> <vmpt options>.  The first configuration of
+# each output format - json, compact, bin, packed, perfetto and aggregate -
+# is its reference.  json-cache fills the --cache, which the other -cache
+# configurations are then served from.
+configs() {
+	cat <<EOF
+json
+json-j4 -j 4
+json-prefilter --prefilter
+json-scalar --prefilter=scalar
+json-avx2 --prefilter=avx2
+json-avx512 --prefilter=avx512
+json-sample --sample 1
+json-window --window 64m
+json-window4k --window 4k
+json-read --no-mmap
+json-huge --huge-pages
+json-sync --write-queue 0
+json-zstd --compress=zstd
+json-lz4 --compress=lz4
+json-cache --cache $work/cache
+json-range --tsc-range 0-0xffffffffffffffff
+compact --compact
+compact-j4 --compact -j 4
+compact-prefilter --compact --prefilter
+compact-window --compact --window 64m
+bin --format=bin
+bin-j4 --format=bin -j 4
+bin-prefilter --format=bin --prefilter
+bin-sample --format=bin --sample 1
+bin-window --format=bin --window 64m
+bin-cache --format=bin --cache $work/cache
+bin-range --format=bin --tsc-range 0-0xffffffffffffffff
+packed --format=packed
+packed-j4 --format=packed -j 4
+packed-prefilter --format=packed --prefilter
+packed-window --format=packed --window 64m
+packed-cache --format=packed --cache $work/cache
+perfetto --format=perfetto
+perfetto-j4 --format=perfetto -j 4
+perfetto-prefilter --format=perfetto --prefilter
+perfetto-cache --format=perfetto --cache $work/cache
+perfetto-range --format=perfetto --tsc-range 0-0xffffffffffffffff
+aggregate --aggregate
+aggregate-j4 --aggregate -j 4
+aggregate-prefilter --aggregate --prefilter
+aggregate-cache --aggregate --cache $work/cache
+aggregate-range --aggregate --tsc-range 0-0xffffffffffffffff
+EOF
+}
+
+# Generate the corpus unless an earlier run left it behind.
+generate() {
+	name=$1
+	shift
+
+	trace=$work/$name-$size.pt
+	if [ ! -s "$trace" ]; then
+		echo "generating $trace" >&2
+		"$bench" --size "$size" "$@" -o "$trace.tmp" &&
+			mv "$trace.tmp" "$trace" || exit 2
+	fi
+
+	echo "$trace"
+}
+
+# A PSB segment with nothing but the TSC 0x35ca2000000NN, NN being @1.
+tsc_segment() {
+	printf '\002\202\002\202\002\202\002\202\002\202\002\202\002\202\002\202'
+	printf "\\031\\$(printf %03o "$1")\\000\\000\\000\\242\\134\\003\\002\\043"
+}
+
+# Write the handcrafted trace @1 unless an earlier run left it behind.
+craft() {
+	name=$1
+
+	trace=$work/$name.pt
+	if [ ! -s "$trace" ]; then
+		case $name in
+		straddle)
+			# snapshot.pt from its first PSB, pushed back so that
+			# the PSB starts 8 bytes before the end of a 4k window.
+			{
+				head -c 4088 /dev/zero
+				tail -c +881 "$src/snapshot.pt"
+			} ;;
+		tsc-tail)
+			{
+				cat "$src/snapshot.pt"
+				tsc_segment 1
+				tsc_segment 2
+			} ;;
+		esac > "$trace.tmp" && mv "$trace.tmp" "$trace" || exit 2
+	fi
+
+	echo "$trace"
+}
+
+corpus="$src/snapshot.pt
+$(craft straddle)
+$(craft tsc-tail)
+$(generate dense --pip 50 --psb 4k)
+$(generate sparse --pip 1 --tsc 10 --psb 64k)
+$(generate noisy --pip 20 --tsc 200 --pad 200 --psb 16k)"
+
+for trace in $corpus; do
+	[ -s "$trace" ] || exit 2
+done
+
+# The digest of @1, decompressing it first if it was compressed.
+digest() {
+	case $1 in
+	*.zst) zstd -dcq "$1" | sha256sum ;;
+	*.lz4) lz4 -dcq "$1" | sha256sum ;;
+	*) sha256sum < "$1" ;;
+	esac | cut -d' ' -f1
+}
+
+now() {
+	date +%s%N
+}
+
+# Print <wall s> <max rss bytes> for one run of vmpt on @1 with @2...
+# writing to @out, or "skip" if vmpt was built without the mode.
+run() {
+	trace=$1
+	shift
+
+	rm -f "$out"
+	start=$(now)
+	"$vmpt" -o "$out" --stats=json "$@" "$trace" < /dev/null \
+		> "$work/stdout" 2> "$work/stderr"
+	status=$?
+	stop=$(now)
+
+	if [ $status != 0 ]; then
+		if grep -q "built without\|not supported" "$work/stderr"; then
+			echo skip
+		else
+			echo fail
+		fi
+		return
+	fi
+
+	rss=$(sed -n 's/.*"memory":{"max_rss":\([0-9]*\)}.*/\1/p' \
+		"$work/stderr")
+	echo "$start $stop ${rss:-0}" |
+		awk '{ printf "%.3f %d\n", ($2 - $1) / 1e9, $3 }'
+}
+
+: > "$results"
+echo "# trace config digest wall_s max_rss_bytes mb_per_s" >> "$results"
+
+rm -f "$work/failed"
+failed=0
+printf '%-22s %-20s %-8s %9s %10s %10s\n' trace config digest "time" "rss" \
+	"MB/s"
+for trace in $corpus; do
+	bytes=$(wc -c < "$trace")
+	tname=$(basename "$trace" .pt)
+
+	configs | while read -r config args; do
+		format=${config%%-*}
+		case $config in
+		*-zstd) suffix=.zst; unpack=zstd ;;
+		*-lz4) suffix=.lz4; unpack=lz4 ;;
+		*) suffix=; unpack=sh ;;
+		esac
+		if ! command -v $unpack > /dev/null; then
+			printf '%-22s %-20s skipped (no %s)\n' "$tname" "$config" \
+				"$unpack"
+			continue
+		fi
+		out=$work/out$suffix
+
+		best=
+		n=0
+		while [ $n -lt "$runs" ]; do
+			n=$((n + 1))
+
+			# shellcheck disable=SC2086
+			result=$(run "$trace" $args)
+			case $result in
+			skip|fail) best=$result; break ;;
+			esac
+
+			best=$(echo "$best $result" |
+				awk 'NF == 2 || $1 <= $3 { print $1, $2; next }
+					{ print $3, $4 }')
+		done
+
+		case $best in
+		skip)
+			printf '%-22s %-20s skipped\n' "$tname" "$config"
+			continue ;;
+		fail)
+			printf '%-22s %-20s FAILED\n' "$tname" "$config"
+			echo "failed" >> "$work/failed"
+			continue ;;
+		esac
+
+		sum=$(digest "$out")
+		wall=${best% *}
+		rss=${best#* }
+		mbps=$(echo "$bytes $wall" |
+			awk '{ printf "%.1f", ($2 > 0 ? $1 / $2 / 1e6 : 0) }')
+
+		verdict=
+		if [ "$config" = "$format" ]; then
+			echo "$sum" > "$work/ref-$format"
+		elif [ "$sum" != "$(cat "$work/ref-$format")" ]; then
+			verdict="MISMATCH with $format"
+		fi
+
+		if [ -n "$baseline" ]; then
+			base=$(awk -v t="$tname" -v c="$config" \
+				'$1 == t && $2 == c { print $3, $4, $5 }' \
+				"$baseline")
+		else
+			base=
+		fi
+
+		if [ -n "$base" ]; then
+			verdict="$verdict $(echo "$base $sum $wall $rss" |
+				awk -v t="$threshold" -v m="$min_time" '{
+					limit = 1 + t / 100
+					if ($1 != $4)
+						printf "DIGEST CHANGED "
+					if (($2 >= m || $5 >= m) && $5 > $2 * limit)
+						printf "SLOWER (%.3f s before) ", $2
+					if ($3 > 0 && $6 > $3 * limit)
+						printf "RSS GREW (%d before) ", $3
+				}')"
+		fi
+
+		# shellcheck disable=SC2086
+		verdict=$(echo $verdict)
+		printf '%-22s %-20s %-8.8s %7s s %6d MiB %10s%s\n' "$tname" \
+			"$config" "$sum" "$wall" $((rss / 1048576)) "$mbps" \
+			"${verdict:+ $verdict}"
+		echo "$tname $config $sum $wall $rss $mbps" >> "$results"
+
+		case $verdict in
+		*[A-Z]*) echo "$verdict" >> "$work/failed" ;;
+		esac
+	done
+done
+
+if [ -s "$work/failed" ]; then
+	failed=1
+	echo "$(wc -l < "$work/failed") configurations failed or regressed."
+fi
+
+rm -f "$work/failed" "$work"/ref-* "$work"/out "$work"/out.* \
+	"$work/stdout" "$work/stderr"
+rm -rf "$work/cache"
+echo "results in $results"
+
+exit $failed
@@ -0,0 +1,845 @@
+/*
+ * libvmpt.c
+ *
+ * The vmpt bundle decoder as a library.
+ * Suchakra Sharma <suchakrapani.sharma@polymtl.ca>
+ *
+ * Based on ptdump reference implementation,
+ * Copyright (c) 2013-2016, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *  * Neither the name of Intel Corporation nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "libvmpt.h"
+
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static int diag(const struct vmpt_decoder *dec, const char *errstr,
+        uint64_t offset, int errcode)
+{
+    if (!dec->diag)
+        return errcode;
+
+    if (errcode)
+        fprintf(dec->diag, "[%" PRIx64 ": %s: %s]\n", offset, errstr,
+                pt_errstr(pt_errcode(errcode)));
+    else
+        fprintf(dec->diag, "[%" PRIx64 ": %s]\n", offset, errstr);
+
+    return errcode;
+}
+
+/* The CLOCK_MONOTONIC time in nanoseconds. */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/* Merge pairs of @stats' error ranges until their range_shift is @shift. */
+static void ranges_fold(struct vmpt_stats *stats, uint32_t shift)
+{
+    while (stats->range_shift < shift) {
+        size_t idx;
+
+        for (idx = 0; idx < VMPT_STATS_NRANGES / 2; ++idx)
+            stats->ranges[idx] = stats->ranges[2 * idx] +
+                stats->ranges[2 * idx + 1];
+
+        memset(&stats->ranges[VMPT_STATS_NRANGES / 2], 0,
+                sizeof(stats->ranges) / 2);
+
+        stats->range_shift += 1;
+    }
+}
+
+void vmpt_stats_error(struct vmpt_stats *stats, int errcode, uint64_t offset)
+{
+    enum pt_error_code code;
+    uint32_t shift;
+
+    if (!stats)
+        return;
+
+    code = pt_errcode(errcode);
+    if ((unsigned int) code < VMPT_STATS_NERRORS)
+        stats->errors[code] += 1;
+
+    shift = stats->range_shift;
+    while ((offset >> shift) >= VMPT_STATS_NRANGES)
+        shift += 1;
+
+    ranges_fold(stats, shift);
+    stats->ranges[offset >> shift] += 1;
+}
+
+void vmpt_stats_add(struct vmpt_stats *sum, const struct vmpt_stats *stats)
+{
+    uint32_t shift;
+    int idx;
+
+    if (!sum || !stats)
+        return;
+
+    for (idx = 0; idx < VMPT_STATS_NTYPES; ++idx)
+        sum->packets[idx] += stats->packets[idx];
+
+    for (idx = 0; idx < VMPT_STATS_NERRORS; ++idx)
+        sum->errors[idx] += stats->errors[idx];
+
+    shift = sum->range_shift;
+    if (shift < stats->range_shift)
+        shift = stats->range_shift;
+
+    ranges_fold(sum, shift);
+    for (idx = 0; idx < VMPT_STATS_NRANGES; ++idx)
+        sum->ranges[idx >> (shift - stats->range_shift)] +=
+            stats->ranges[idx];
+
+    sum->bytes += stats->bytes;
+    sum->resyncs += stats->resyncs;
+    sum->bundles += stats->bundles;
+    sum->dropped += stats->dropped;
+    sum->skipped += stats->skipped;
+    sum->resync_ns += stats->resync_ns;
+}
+
+void vmpt_decoder_init(struct vmpt_decoder *dec,
+        const struct vmpt_callbacks *callbacks, void *priv)
+{
+    static const struct vmpt_callbacks none;
+
+    if (!dec)
+        return;
+
+    memset(dec, 0, sizeof(*dec));
+    dec->callbacks = callbacks ? callbacks : &none;
+    dec->priv = priv;
+}
+
+void vmpt_decoder_finish(struct vmpt_decoder *dec)
+{
+    if (!dec)
+        return;
+
+    if (dec->got_pip)
+        dec->stats.dropped += 1;
+
+    if (dec->diag && dec->suppressed)
+        fprintf(dec->diag, "[%" PRIu64 " decode errors, %" PRIu64
+                " not shown]\n", dec->reported + dec->suppressed,
+                dec->suppressed);
+}
+
+void vmpt_decoder_report(struct vmpt_decoder *dec,
+        const struct vmpt_error *error)
+{
+    uint64_t number;
+
+    if (!dec || !error || !dec->diag)
+        return;
+
+    /* Report the first few errors and then fewer and fewer, so a trace
+     * that is corrupt throughout does not swamp the user or slow us down.
+     */
+    number = dec->reported + dec->suppressed + 1;
+    if (VMPT_DIAG_BURST < number && (number & (number - 1))) {
+        dec->suppressed += 1;
+        return;
+    }
+
+    dec->reported += 1;
+
+    fprintf(dec->diag, "[%" PRIx64 ": %s: %s; skipped %" PRIu64 " bytes in "
+            "%" PRIu64 " us", error->offset, error->what,
+            pt_errstr(pt_errcode(error->errcode)), error->skipped,
+            error->ns / 1000);
+    if (dec->suppressed)
+        fprintf(dec->diag, "; %" PRIu64 " errors not shown",
+                dec->suppressed);
+    fprintf(dec->diag, "]\n");
+}
+
+int vmpt_decoder_error(struct vmpt_decoder *dec, const char *what,
+        uint64_t offset, int errcode)
+{
+    dec->error.what = what;
+    dec->error.offset = dec->base + offset;
+    dec->error.errcode = errcode;
+    dec->error.skipped = 0ull;
+    dec->error.ns = 0ull;
+
+    return errcode;
+}
+
+int vmpt_resync(struct vmpt_decoder *dec, struct pt_packet_decoder *decoder)
+{
+    const struct pt_config *config;
+    struct vmpt_error *error;
+    uint64_t start, sync;
+    int errcode;
+
+    if (!dec || !decoder)
+        return -pte_invalid;
+
+    error = &dec->error;
+    start = now_ns();
+
+    sync = error->offset - dec->base;
+    errcode = pt_pkt_sync_forward(decoder);
+    if (errcode >= 0)
+        errcode = pt_pkt_get_sync_offset(decoder, &sync);
+    else if (errcode == -pte_eos) {
+        config = pt_pkt_get_config(decoder);
+        if (config)
+            sync = (uint64_t) (config->end - config->begin);
+    }
+
+    error->ns = now_ns() - start;
+    error->skipped = 0ull;
+    if (error->offset < dec->base + sync)
+        error->skipped = dec->base + sync - error->offset;
+
+    vmpt_stats_error(&dec->stats, error->errcode, error->offset);
+    dec->stats.skipped += error->skipped;
+    dec->stats.resync_ns += error->ns;
+    if (errcode >= 0)
+        dec->stats.resyncs += 1;
+
+    vmpt_decoder_report(dec, error);
+
+    if (errcode < 0 && errcode != -pte_eos)
+        return diag(dec, "sync error", 0ull, errcode);
+
+    return errcode < 0 ? errcode : 0;
+}
+
+/* Feed one packet to @dec's bundle state machine.
+ *
+ * The packet is given by its columns in struct vmpt_batch.
+ */
+static inline int decode_one(struct vmpt_decoder *dec, uint8_t type,
+        uint64_t offset, uint64_t payload, uint8_t nr)
+{
+    const struct vmpt_callbacks *callbacks;
+
+    callbacks = dec->callbacks;
+
+    switch (type){
+        case ppt_pip:
+            if (dec->got_pip == 0)
+            {
+                dec->bundle.cr3 = payload;
+                dec->bundle.nr = nr;
+                if (callbacks->pip) {
+                    struct pt_packet_pip pip;
+
+                    memset(&pip, 0, sizeof(pip));
+                    pip.cr3 = payload;
+                    pip.nr = nr;
+
+                    callbacks->pip(dec, &pip);
+                }
+                dec->got_pip = 1;
+            } else
+                dec->stats.dropped += 1;
+            return 0;
+
+        case ppt_pad:
+            if ((dec->got_pip == 1) && (dec->pad_cnt < 8))
+            {
+                dec->pad_cnt++;
+            }
+            if (dec->pad_cnt == 8)
+            {
+                dec->pad_cnt = 0;
+                dec->got_pad = 1;
+            }
+            return 0;
+
+        case ppt_vmcs:
+            if ((dec->got_pad == 1) && (dec->got_pip == 1))
+            {
+                dec->bundle.vmcs_base = payload;
+                if (callbacks->vmcs) {
+                    struct pt_packet_vmcs vmcs;
+
+                    memset(&vmcs, 0, sizeof(vmcs));
+                    vmcs.base = payload;
+
+                    callbacks->vmcs(dec, &vmcs);
+                }
+                dec->got_vmcs = 1;
+            }
+            return 0;
+
+        case ppt_tsc:
+            dec->last_tsc = payload;
+            dec->got_tsc = 1;
+            if ((dec->got_pip == 1) && (dec->got_vmcs == 1))
+            {
+                dec->bundle.tsc = payload;
+                if (callbacks->bundle)
+                    callbacks->bundle(dec, &dec->bundle);
+                dec->stats.bundles += 1;
+                dec->got_pip = 0;
+                dec->got_vmcs = 0;
+            }
+            return 0;
+
+        case ppt_psb:
+            if (callbacks->psb)
+                callbacks->psb(dec, offset);
+            return 0;
+
+        default:
+            return 0;
+    }
+}
+
+/* The payload and non-root columns of @packet in struct vmpt_batch. */
+static inline uint64_t packet_payload(const struct pt_packet *packet,
+        uint8_t *nr)
+{
+    *nr = 0;
+
+    switch (packet->type) {
+    case ppt_pip:
+        *nr = (uint8_t) packet->payload.pip.nr;
+        return packet->payload.pip.cr3;
+
+    case ppt_vmcs:
+        return packet->payload.vmcs.base;
+
+    case ppt_tsc:
+        return packet->payload.tsc.tsc;
+
+    default:
+        return 0ull;
+    }
+}
+
+int vmpt_decode_packet(struct vmpt_decoder *dec, uint64_t offset,
+        const struct pt_packet *packet)
+{
+    uint64_t payload;
+    uint8_t nr;
+
+    payload = packet_payload(packet, &nr);
+    dec->pkt_cnt++;
+
+    return decode_one(dec, (uint8_t) packet->type, offset, payload, nr);
+}
+
+int vmpt_batch_decode(struct vmpt_batch *batch,
+        struct pt_packet_decoder *decoder, uint64_t *offset)
+{
+    uint64_t next;
+    size_t count;
+    int errcode;
+
+    if (!batch || !decoder || !offset)
+        return -pte_invalid;
+
+    /* The decoder moves on by exactly one packet per pt_pkt_next(), so we
+     * track the offset ourselves instead of asking for it every time.
+     */
+    next = *offset;
+    errcode = 0;
+    for (count = 0; count < VMPT_BATCH_SIZE; ++count) {
+        struct pt_packet packet;
+        uint64_t payload;
+        uint8_t nr;
+
+        errcode = pt_pkt_next(decoder, &packet, sizeof(packet));
+        if (errcode < 0)
+            break;
+
+        payload = packet_payload(&packet, &nr);
+
+        batch->type[count] = (uint8_t) packet.type;
+        batch->offset[count] = next;
+        batch->payload[count] = payload;
+        batch->nr[count] = nr;
+
+        next += packet.size;
+    }
+
+    batch->count = count;
+    *offset = next;
+
+    return errcode < 0 ? errcode : 0;
+}
+
+int vmpt_decode_batch(struct vmpt_decoder *dec,
+        const struct vmpt_batch *batch)
+{
+    size_t idx;
+    int errcode;
+
+    if (!dec || !batch)
+        return -pte_invalid;
+
+    for (idx = 0; idx < batch->count; ++idx)
+        vmpt_stats_packet(&dec->stats,
+                (enum pt_packet_type) batch->type[idx]);
+
+    dec->pkt_cnt += batch->count;
+
+    for (idx = 0; idx < batch->count; ++idx) {
+        errcode = decode_one(dec, batch->type[idx], batch->offset[idx],
+                batch->payload[idx], batch->nr[idx]);
+        if (errcode < 0)
+            return errcode;
+    }
+
+    return 0;
+}
+
+int vmpt_decode_packets(struct vmpt_decoder *dec,
+        struct pt_packet_decoder *decoder)
+{
+    struct vmpt_batch batch;
+    uint64_t offset;
+    int errcode, status;
+
+    offset = 0ull;
+    errcode = pt_pkt_get_offset(decoder, &offset);
+    if (errcode < 0)
+        return vmpt_decoder_error(dec, "error getting offset", offset,
+                errcode);
+
+    do {
+        errcode = vmpt_batch_decode(&batch, decoder, &offset);
+
+        status = vmpt_decode_batch(dec, &batch);
+        if (status < 0)
+            return status;
+    } while (!errcode);
+
+    if (errcode == -pte_eos)
+        return 0;
+
+    return vmpt_decoder_error(dec, "error decoding packet", offset,
+            errcode);
+}
+
+static int decode_sync(struct vmpt_decoder *dec,
+        struct pt_packet_decoder *decoder, int synced)
+{
+    int errcode;
+
+    errcode = pt_pkt_sync_set(decoder, 0ull);
+    if (errcode < 0)
+        return diag(dec, "sync error", 0ull, errcode);
+
+    /* A buffer that is known to start at a packet boundary - e.g. with a
+     * PSB - can be decoded right away.  Otherwise, search for the first PSB.
+     */
+    if (!synced) {
+        errcode = pt_pkt_sync_forward(decoder);
+        if (errcode < 0)
+            return diag(dec, "sync error", 0ull, errcode);
+    }
+
+    for (;;) {
+        errcode = vmpt_decode_packets(dec, decoder);
+        if (!errcode)
+            break;
+
+        errcode = vmpt_resync(dec, decoder);
+        if (errcode < 0)
+            return errcode;
+    }
+
+    return errcode;
+}
+
+int vmpt_decode(struct vmpt_decoder *dec, const struct pt_config *config,
+        int synced, uint64_t *stop)
+{
+    struct pt_packet_decoder *decoder;
+    int errcode;
+
+    if (!dec || !config)
+        return -pte_invalid;
+
+    decoder = pt_pkt_alloc_decoder(config);
+    if (!decoder) {
+        (void) diag(dec, "failed to allocate decoder", 0ull, 0);
+        return -pte_nomem;
+    }
+
+    dec->stats.bytes += (uint64_t) (config->end - config->begin);
+
+    errcode = decode_sync(dec, decoder, synced);
+    if (!errcode && stop)
+        errcode = pt_pkt_get_offset(decoder, stop);
+
+    pt_pkt_free_decoder(decoder);
+    return errcode;
+}
+
+static int read_trace(struct vmpt_trace *trace, int fd, uint64_t begin,
+        uint64_t size)
+{
+    uint8_t *content;
+    ssize_t got;
+    uint64_t done;
+
+    content = malloc(size);
+    if (!content)
+        return -pte_nomem;
+
+    for (done = 0; done < size; done += got) {
+        errno = 0;
+        got = pread(fd, content + done, size - done, begin + done);
+        if (got <= 0) {
+            if (!got)
+                errno = EIO;
+            free(content);
+            return -pte_bad_file;
+        }
+    }
+
+    trace->begin = content;
+    trace->size = size;
+
+    return 0;
+}
+
+static int map_trace(struct vmpt_trace *trace, int fd, uint64_t begin,
+        uint64_t size, unsigned int flags)
+{
+    uint64_t page, base;
+    uint8_t *map;
+    size_t map_size;
+
+    page = (uint64_t) sysconf(_SC_PAGESIZE);
+    base = begin & ~(page - 1);
+    map_size = (size_t) (size + (begin - base));
+
+    map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, (off_t) base);
+    if (map == MAP_FAILED)
+        return -pte_bad_file;
+
+    /* We walk the trace front to back exactly once.  Let the kernel read
+     * ahead aggressively and drop pages behind us.
+     */
+    (void) madvise(map, map_size, MADV_SEQUENTIAL);
+
+#ifdef MADV_HUGEPAGE
+    if ((flags & vtf_huge_pages) && !madvise(map, map_size, MADV_HUGEPAGE))
+        trace->huge_pages = 1;
+#endif
+
+    trace->begin = map + (begin - base);
+    trace->size = (size_t) size;
+    trace->map = map;
+    trace->map_size = map_size;
+
+    return 0;
+}
+
+int vmpt_trace_load(struct vmpt_trace *trace, int fd, uint64_t begin,
+        uint64_t end, unsigned int flags)
+{
+    int errcode;
+
+    if (!trace || end < begin ||
+            (uint64_t) (size_t) (end - begin) != end - begin)
+        return -pte_invalid;
+
+    memset(trace, 0, sizeof(*trace));
+
+    /* Map the file if we can and fall back to reading it if we can't;
+     * e.g. for files on file systems that do not support mmap.
+     */
+    errcode = -pte_bad_file;
+    if (!(flags & vtf_read))
+        errcode = map_trace(trace, fd, begin, end - begin, flags);
+    if (errcode < 0)
+        errcode = read_trace(trace, fd, begin, end - begin);
+
+    return errcode;
+}
+
+void vmpt_trace_unload(struct vmpt_trace *trace)
+{
+    if (!trace)
+        return;
+
+    if (trace->map)
+        munmap(trace->map, trace->map_size);
+    else
+        free(trace->begin);
+
+    memset(trace, 0, sizeof(*trace));
+}
+
+/* Load the trace at @path into @trace and set up @config for it. */
+static int load_path(struct vmpt_trace *trace, struct pt_config *config,
+        const char *path)
+{
+    struct stat st;
+    int errcode, fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -pte_bad_file;
+
+    errcode = -pte_bad_file;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        errcode = vmpt_trace_load(trace, fd, 0ull, (uint64_t) st.st_size,
+                0u);
+
+    close(fd);
+    if (errcode < 0)
+        return errcode;
+
+    memset(config, 0, sizeof(*config));
+    pt_config_init(config);
+    (void) pt_cpu_errata(&config->errata, &config->cpu);
+
+    config->begin = trace->begin;
+    config->end = trace->begin + trace->size;
+
+    return 0;
+}
+
+int vmpt_decode_file(struct vmpt_decoder *dec, const char *path)
+{
+    struct vmpt_trace trace;
+    struct pt_config config;
+    int errcode;
+
+    if (!dec || !path)
+        return -pte_invalid;
+
+    errcode = load_path(&trace, &config, path);
+    if (errcode < 0)
+        return errcode;
+
+    errcode = vmpt_decode(dec, &config, 0, NULL);
+    vmpt_decoder_finish(dec);
+
+    vmpt_trace_unload(&trace);
+    return errcode;
+}
+
+struct vmpt_iter {
+    /* The bundle decoder and the packet decoder feeding it. */
+    struct vmpt_decoder dec;
+    struct pt_packet_decoder *decoder;
+
+    /* The trace if we loaded it ourselves. */
+    struct vmpt_trace trace;
+
+    /* The bundle the last packet completed and whether there is one. */
+    struct vmpt_bundle next;
+    int ready;
+
+    /* The packets decoded ahead, the next one to feed to dec, the offset
+     * after the batch, and the error that ended the batch.
+     */
+    struct vmpt_batch batch;
+    size_t pos;
+    uint64_t offset;
+    int pending;
+
+    /* Whether we found the first PSB. */
+    int synced;
+
+    /* The error that ended the iteration - zero while it goes on. */
+    int errcode;
+};
+
+static void iter_bundle(struct vmpt_decoder *dec,
+        const struct vmpt_bundle *bundle)
+{
+    struct vmpt_iter *iter;
+
+    iter = dec->priv;
+    iter->next = *bundle;
+    iter->ready = 1;
+}
+
+static const struct vmpt_callbacks iter_callbacks = {
+    NULL,
+    NULL,
+    iter_bundle,
+    NULL
+};
+
+struct vmpt_iter *vmpt_iter_alloc(const struct pt_config *config)
+{
+    struct vmpt_iter *iter;
+
+    if (!config)
+        return NULL;
+
+    iter = malloc(sizeof(*iter));
+    if (!iter)
+        return NULL;
+
+    memset(iter, 0, sizeof(*iter));
+    vmpt_decoder_init(&iter->dec, &iter_callbacks, iter);
+
+    iter->decoder = pt_pkt_alloc_decoder(config);
+    if (!iter->decoder) {
+        free(iter);
+        return NULL;
+    }
+
+    iter->dec.stats.bytes = (uint64_t) (config->end - config->begin);
+
+    return iter;
+}
+
+struct vmpt_iter *vmpt_iter_open(const char *path)
+{
+    struct vmpt_trace trace;
+    struct pt_config config;
+    struct vmpt_iter *iter;
+
+    if (!path || load_path(&trace, &config, path) < 0)
+        return NULL;
+
+    iter = vmpt_iter_alloc(&config);
+    if (!iter) {
+        vmpt_trace_unload(&trace);
+        return NULL;
+    }
+
+    iter->trace = trace;
+    return iter;
+}
+
+void vmpt_iter_free(struct vmpt_iter *iter)
+{
+    if (!iter)
+        return;
+
+    pt_pkt_free_decoder(iter->decoder);
+    vmpt_trace_unload(&iter->trace);
+    free(iter);
+}
+
+/* Feed the next packet of @iter to its decoder, decoding a new batch when we
+ * ran out and resyncing like vmpt_decode() does.
+ *
+ * Returns zero on success and a negative pt_error_code once the iteration
+ * ended.
+ */
+static int iter_step(struct vmpt_iter *iter)
+{
+    struct vmpt_decoder *dec;
+    struct vmpt_batch *batch;
+    int errcode;
+
+    dec = &iter->dec;
+    batch = &iter->batch;
+    if (iter->pos < batch->count) {
+        size_t pos;
+
+        pos = iter->pos++;
+
+        vmpt_stats_packet(&dec->stats,
+                (enum pt_packet_type) batch->type[pos]);
+        dec->pkt_cnt++;
+
+        return decode_one(dec, batch->type[pos], batch->offset[pos],
+                batch->payload[pos], batch->nr[pos]);
+    }
+
+    errcode = iter->pending;
+    if (errcode < 0) {
+        if (errcode == -pte_eos)
+            return errcode;
+
+        (void) vmpt_decoder_error(dec, "error decoding packet",
+                iter->offset, errcode);
+
+        errcode = vmpt_resync(dec, iter->decoder);
+        if (errcode >= 0)
+            errcode = pt_pkt_get_offset(iter->decoder, &iter->offset);
+        if (errcode < 0)
+            return errcode;
+    }
+
+    if (!iter->synced) {
+        errcode = pt_pkt_sync_forward(iter->decoder);
+        if (errcode >= 0)
+            errcode = pt_pkt_get_offset(iter->decoder, &iter->offset);
+        if (errcode < 0)
+            return diag(dec, "sync error", 0ull, errcode);
+
+        iter->synced = 1;
+    }
+
+    iter->pos = 0;
+    iter->pending = vmpt_batch_decode(batch, iter->decoder, &iter->offset);
+
+    return 0;
+}
+
+int vmpt_next(struct vmpt_iter *iter, struct vmpt_bundle *bundle)
+{
+    if (!iter || !bundle)
+        return -pte_invalid;
+
+    while (!iter->ready) {
+        int errcode;
+
+        if (iter->errcode)
+            return iter->errcode;
+
+        errcode = iter_step(iter);
+        if (errcode < 0) {
+            iter->errcode = errcode;
+            vmpt_decoder_finish(&iter->dec);
+        }
+    }
+
+    *bundle = iter->next;
+    iter->ready = 0;
+
+    return 0;
+}
+
+struct vmpt_decoder *vmpt_iter_decoder(struct vmpt_iter *iter)
+{
+    return iter ? &iter->dec : NULL;
+}
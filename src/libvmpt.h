@@ -0,0 +1,366 @@
+/*
+ * libvmpt.h
+ *
+ * The vmpt bundle decoder as a library.
+ *
+ * libvmpt decodes an Intel PT trace and links each PIP, the VMCS that
+ * follows it and the TSC that completes it into a struct vmpt_bundle.  There
+ * are two ways to get at the bundles, neither of which formats anything:
+ *
+ * A struct vmpt_decoder calls struct vmpt_callbacks as the trace is decoded:
+ *
+ *     static void bundle(struct vmpt_decoder *dec,
+ *             const struct vmpt_bundle *bundle)
+ *     {
+ *         ...
+ *     }
+ *
+ *     static const struct vmpt_callbacks callbacks = {
+ *         NULL, NULL, bundle, NULL
+ *     };
+ *
+ *     struct vmpt_decoder dec;
+ *
+ *     vmpt_decoder_init(&dec, &callbacks, NULL);
+ *     errcode = vmpt_decode_file(&dec, "snapshot.pt");
+ *
+ * A struct vmpt_iter hands out one bundle at a time:
+ *
+ *     struct vmpt_bundle bundle;
+ *     struct vmpt_iter *iter;
+ *
+ *     iter = vmpt_iter_open("snapshot.pt");
+ *     while (vmpt_next(iter, &bundle) >= 0)
+ *         ...
+ *     vmpt_iter_free(iter);
+ *
+ * Functions return zero on success and a negative pt_error_code otherwise,
+ * like libipt.  Decode errors are skipped by resyncing at the next PSB.  They
+ * are counted in struct vmpt_stats and reported to struct vmpt_decoder's
+ * diag file if one is set, up to a limit.
+ */
+
+#ifndef LIBVMPT_H
+#define LIBVMPT_H
+
+#include "intel-pt.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A bundle of linked PIP, VMCS and TSC packets. */
+struct vmpt_bundle {
+    /* The PIP packet's cr3 and non-root bit. */
+    uint64_t cr3;
+    uint32_t nr;
+
+    /* The VMCS base address. */
+    uint64_t vmcs_base;
+
+    /* The TSC that completes the bundle. */
+    uint64_t tsc;
+};
+
+/* The number of packet types we count - libipt's enum pt_packet_type. */
+#define VMPT_STATS_NTYPES 32
+
+/* The number of error codes we count - libipt's enum pt_error_code. */
+#define VMPT_STATS_NERRORS 32
+
+/* The number of trace offset ranges we count errors in. */
+#define VMPT_STATS_NRANGES 64
+
+/* Decode statistics.
+ *
+ * The counters are updated in the decode loops and are cheap enough to keep
+ * around when nobody asks for them.  Decoders that run on their own thread
+ * count into their own statistics, which the user may sum up.
+ */
+struct vmpt_stats {
+    /* The packets decoded, indexed by enum pt_packet_type. */
+    uint64_t packets[VMPT_STATS_NTYPES];
+
+    /* The bytes of trace decoded (including PSB segments we skipped). */
+    uint64_t bytes;
+
+    /* The number of times we resynced after a decode error. */
+    uint64_t resyncs;
+
+    /* The number of complete bundles. */
+    uint64_t bundles;
+
+    /* The number of PIPs that did not make it into a complete bundle. */
+    uint64_t dropped;
+
+    /* The decode errors, indexed by enum pt_error_code. */
+    uint64_t errors[VMPT_STATS_NERRORS];
+
+    /* Where the errors were: an error at offset o in the trace is counted in
+     * ranges[o >> range_shift].  The ranges double in size whenever an error
+     * shows up beyond the last one, so they always cover the trace.
+     */
+    uint64_t ranges[VMPT_STATS_NRANGES];
+    uint32_t range_shift;
+
+    /* The bytes of trace resyncs skipped and the time they took. */
+    uint64_t skipped, resync_ns;
+
+    /* The time spent loading and decoding the trace and the bytes loaded up
+     * front - not filled in by the library.
+     */
+    uint64_t load_ns, decode_ns, loaded;
+};
+
+static inline void vmpt_stats_packet(struct vmpt_stats *stats,
+        enum pt_packet_type type)
+{
+    if ((unsigned int) type < VMPT_STATS_NTYPES)
+        stats->packets[type] += 1;
+}
+
+/* Count the pt_error_code @errcode at @offset in the trace in @stats. */
+extern void vmpt_stats_error(struct vmpt_stats *stats, int errcode,
+        uint64_t offset);
+
+/* Add the counters of @stats to @sum. */
+extern void vmpt_stats_add(struct vmpt_stats *sum,
+        const struct vmpt_stats *stats);
+
+/* A decode error and the resync after it. */
+struct vmpt_error {
+    /* What failed, where, and the pt_error_code. */
+    const char *what;
+    uint64_t offset;
+    int errcode;
+
+    /* The bytes of trace we skipped to the next PSB - or to the end of the
+     * trace - and the time that took.
+     */
+    uint64_t skipped, ns;
+};
+
+/* The number of decode errors each decoder reports in full.  After that,
+ * only every error whose number is a power of two is reported.
+ */
+#define VMPT_DIAG_BURST 16
+
+struct vmpt_decoder;
+
+/* What a struct vmpt_decoder tells its user.  All callbacks are optional.
+ *
+ * The pip and vmcs callbacks are called as soon as the respective packet is
+ * added to the bundle.  The bundle callback is called for every complete
+ * bundle.  The psb callback sees the bundle state at every PSB before the PSB
+ * is decoded; @offset is relative to the start of the trace buffer.
+ */
+struct vmpt_callbacks {
+    void (*pip)(struct vmpt_decoder *dec, const struct pt_packet_pip *pip);
+    void (*vmcs)(struct vmpt_decoder *dec,
+            const struct pt_packet_vmcs *vmcs);
+    void (*bundle)(struct vmpt_decoder *dec,
+            const struct vmpt_bundle *bundle);
+    void (*psb)(struct vmpt_decoder *dec, uint64_t offset);
+};
+
+/* The state of one bundle decoder.
+ *
+ * Everything the bundle state machine needs lives here, so independent
+ * decoders can run side by side.  Users may save and restore the state
+ * fields to continue decoding at a PSB, as long as they restore all of them.
+ */
+struct vmpt_decoder {
+    /* State flags */
+    int got_pip, got_pad, got_vmcs, pad_cnt;
+
+    /* The bundle we are putting together. */
+    struct vmpt_bundle bundle;
+
+    /* The last TSC we saw and whether we saw one. */
+    uint64_t last_tsc;
+    int got_tsc;
+
+    /* The number of packets fed to the bundle state machine. */
+    uint64_t pkt_cnt;
+
+    /* The decode statistics. */
+    struct vmpt_stats stats;
+
+    /* The callbacks and their private data. */
+    const struct vmpt_callbacks *callbacks;
+    void *priv;
+
+    /* Where decode errors are reported to - NULL to keep quiet. */
+    FILE *diag;
+
+    /* The offset of the decoded buffer in the trace.  It is added to the
+     * offsets in error reports and statistics.
+     */
+    uint64_t base;
+
+    /* The last decode error, which vmpt_resync() resyncs after. */
+    struct vmpt_error error;
+
+    /* The errors we reported to diag and the ones we kept quiet about. */
+    uint64_t reported, suppressed;
+};
+
+/* Initialize @dec to call @callbacks with @priv in its priv field. */
+extern void vmpt_decoder_init(struct vmpt_decoder *dec,
+        const struct vmpt_callbacks *callbacks, void *priv);
+
+/* Account for a bundle @dec did not complete when the trace ended and
+ * report how many errors we kept quiet about.
+ */
+extern void vmpt_decoder_finish(struct vmpt_decoder *dec);
+
+/* Report @error to @dec's diag file unless we reported too many already.
+ *
+ * This does not count @error; see vmpt_stats_error().
+ */
+extern void vmpt_decoder_report(struct vmpt_decoder *dec,
+        const struct vmpt_error *error);
+
+/* Remember that @what failed with @errcode at @offset in the decoded buffer
+ * as @dec's last error.  Returns @errcode.
+ */
+extern int vmpt_decoder_error(struct vmpt_decoder *dec, const char *what,
+        uint64_t offset, int errcode);
+
+/* Resync @decoder at the next PSB after @dec's last error.
+ *
+ * Counts the error and the resync in @dec's statistics and reports it.
+ * Returns zero on success and -pte_eos if there is no further PSB, in which
+ * case the rest of the trace was skipped.
+ */
+extern int vmpt_resync(struct vmpt_decoder *dec,
+        struct pt_packet_decoder *decoder);
+
+/* Feed @packet at @offset to @dec's bundle state machine. */
+extern int vmpt_decode_packet(struct vmpt_decoder *dec, uint64_t offset,
+        const struct pt_packet *packet);
+
+/* The number of packets in a struct vmpt_batch. */
+#define VMPT_BATCH_SIZE 256
+
+/* A batch of decoded packets in struct-of-arrays layout.
+ *
+ * Packet i has type[i] - an enum pt_packet_type - and starts at offset[i].
+ * Its payload[i] is the PIP's cr3, the VMCS base or the TSC, and nr[i] is
+ * the PIP's non-root bit; both are zero for other packets.
+ */
+struct vmpt_batch {
+    uint64_t offset[VMPT_BATCH_SIZE];
+    uint64_t payload[VMPT_BATCH_SIZE];
+    uint8_t type[VMPT_BATCH_SIZE];
+    uint8_t nr[VMPT_BATCH_SIZE];
+
+    /* The number of packets in the batch. */
+    size_t count;
+};
+
+/* Decode up to VMPT_BATCH_SIZE packets of the synchronized @decoder into
+ * @batch.
+ *
+ * @offset is the offset of @decoder's next packet and is advanced past the
+ * packets we decoded.
+ *
+ * Returns zero if @batch is full and the pt_error_code that stopped us
+ * otherwise, e.g. -pte_eos at the end of the trace.  The packets before the
+ * error are in @batch either way.
+ */
+extern int vmpt_batch_decode(struct vmpt_batch *batch,
+        struct pt_packet_decoder *decoder, uint64_t *offset);
+
+/* Count the packets in @batch and feed them to @dec's bundle state machine. */
+extern int vmpt_decode_batch(struct vmpt_decoder *dec,
+        const struct vmpt_batch *batch);
+
+/* Feed the packets of the synchronized @decoder to @dec until the end of the
+ * trace or the first decode error, one struct vmpt_batch at a time.
+ *
+ * Returns zero at the end of the trace.  A decode error is kept in @dec's
+ * error field for vmpt_resync().
+ */
+extern int vmpt_decode_packets(struct vmpt_decoder *dec,
+        struct pt_packet_decoder *decoder);
+
+/* Decode the trace in @config.
+ *
+ * If @synced is non-zero, the trace starts at a packet boundary - e.g. at a
+ * PSB - and is decoded right away; otherwise we search for the first PSB.
+ * If @stop is not NULL, it will be set to the offset at which the decoder
+ * reached the end of the buffer; a partial packet starts there.
+ */
+extern int vmpt_decode(struct vmpt_decoder *dec,
+        const struct pt_config *config, int synced, uint64_t *stop);
+
+/* Map or read @path and decode it like vmpt_decode(). */
+extern int vmpt_decode_file(struct vmpt_decoder *dec, const char *path);
+
+/* A trace loaded into memory. */
+struct vmpt_trace {
+    /* The [begin, begin + size) range that was requested. */
+    uint8_t *begin;
+    size_t size;
+
+    /* The page-aligned mapping backing it - NULL if it was malloc'ed. */
+    void *map;
+    size_t map_size;
+
+    /* Whether we got the transparent huge pages we asked for. */
+    int huge_pages;
+};
+
+/* How vmpt_trace_load() loads a trace. */
+enum vmpt_trace_flags {
+    /* Read the trace into anonymous memory instead of mapping it. */
+    vtf_read = 1 << 0,
+
+    /* Ask for transparent huge pages on a mapped trace. */
+    vtf_huge_pages = 1 << 1
+};
+
+/* Load [@begin, @end) of @fd into @trace as requested by @flags.
+ *
+ * The trace is mapped if possible and read otherwise.  On failure, errno
+ * tells what went wrong.
+ */
+extern int vmpt_trace_load(struct vmpt_trace *trace, int fd, uint64_t begin,
+        uint64_t end, unsigned int flags);
+
+extern void vmpt_trace_unload(struct vmpt_trace *trace);
+
+/* An iterator over the bundles of a trace. */
+struct vmpt_iter;
+
+/* Iterate over the bundles in @config's trace buffer.
+ *
+ * The buffer must stay valid until the iterator is freed.
+ */
+extern struct vmpt_iter *vmpt_iter_alloc(const struct pt_config *config);
+
+/* Iterate over the bundles in the trace at @path. */
+extern struct vmpt_iter *vmpt_iter_open(const char *path);
+
+extern void vmpt_iter_free(struct vmpt_iter *iter);
+
+/* Get the next bundle of @iter into @bundle.
+ *
+ * Returns zero on success, -pte_eos at the end of the trace, and another
+ * negative pt_error_code otherwise.
+ */
+extern int vmpt_next(struct vmpt_iter *iter, struct vmpt_bundle *bundle);
+
+/* The decoder behind @iter, e.g. for its statistics or diag file. */
+extern struct vmpt_decoder *vmpt_iter_decoder(struct vmpt_iter *iter);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBVMPT_H */
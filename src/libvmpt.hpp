@@ -0,0 +1,564 @@
+/*
+ * libvmpt.hpp
+ *
+ * A header-only C++ bundle decoder on top of libvmpt.
+ *
+ * vmpt::decoder<Sink, Filter> runs the same bundle state machine as
+ * vmpt_decode_packet(), but the packet filter and the bundle sink are template
+ * parameters.  Both are inlined into the decode loop, so there is no indirect
+ * call per packet or per bundle:
+ *
+ *     std::FILE *file = std::fopen("bundles.json", "w");
+ *     vmpt::decoder<vmpt::json_sink> dec{vmpt::json_sink(file)};
+ *
+ *     errcode = dec.decode_file("snapshot.pt");
+ *
+ * or, with a lambda:
+ *
+ *     auto dec = vmpt::make_decoder([&](const vmpt_bundle &bundle) {
+ *         ...
+ *     });
+ *
+ * A sink derives from vmpt::sink_base and hides the hooks it wants to see.
+ * A filter is any callable that takes a const pt_packet & and returns whether
+ * the packet goes to the state machine.
+ *
+ * Like the C API, functions return zero on success and a negative
+ * pt_error_code otherwise.  The state lives in a struct vmpt_decoder, so it
+ * can be saved and restored like the C decoder's; its callbacks are unused.
+ */
+
+#ifndef LIBVMPT_HPP
+#define LIBVMPT_HPP
+
+#include "libvmpt.h"
+#include "vmpt-bin.h"
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace vmpt {
+
+/* A sink that ignores everything - derive from it and hide what you need. */
+struct sink_base {
+    /* A PIP started a bundle. */
+    void pip(const pt_packet_pip &) {}
+
+    /* A VMCS was added to the bundle. */
+    void vmcs(const pt_packet_vmcs &) {}
+
+    /* A bundle is complete. */
+    void bundle(const vmpt_bundle &) {}
+
+    /* We are at the PSB at @offset in the trace buffer. */
+    void psb(uint64_t) {}
+
+    /* The trace ended in @state. */
+    void end(const vmpt_decoder &) {}
+};
+
+/* Every packet goes to the state machine. */
+struct no_filter {
+    bool operator()(const pt_packet &) const { return true; }
+};
+
+/* Only bundles of the address space with this cr3 are put together. */
+struct cr3_filter {
+    explicit cr3_filter(uint64_t cr3) : cr3(cr3) {}
+
+    bool operator()(const pt_packet &packet) const
+    {
+        return packet.type != ppt_pip || packet.payload.pip.cr3 == cr3;
+    }
+
+    uint64_t cr3;
+};
+
+/* Only bundles that start in VMX non-root operation are put together. */
+struct non_root_filter {
+    bool operator()(const pt_packet &packet) const
+    {
+        return packet.type != ppt_pip || packet.payload.pip.nr;
+    }
+};
+
+template <class Sink, class Filter = no_filter>
+class decoder {
+public:
+    explicit decoder(Sink sink = Sink(), Filter filter = Filter())
+        : sink_(std::move(sink)), filter_(std::move(filter))
+    {
+        vmpt_decoder_init(&state_, NULL, NULL);
+    }
+
+    Sink &sink() { return sink_; }
+    vmpt_decoder &state() { return state_; }
+    const vmpt_stats &stats() const { return state_.stats; }
+
+    /* Report decode errors to @file - NULL to keep quiet. */
+    void set_diag(std::FILE *file) { state_.diag = file; }
+
+    /* Feed @packet at @offset to the state machine. */
+    inline void decode_packet(uint64_t offset, const pt_packet &packet);
+
+    /* Decode the packets of the synchronized @pkt until the end of the trace
+     * or the first decode error, like vmpt_decode_packets().
+     */
+    int decode_packets(pt_packet_decoder *pkt);
+
+    /* Decode the trace in @config like vmpt_decode(). */
+    int decode(const pt_config &config, bool synced = false,
+            uint64_t *stop = NULL);
+
+    /* Map or read @path, decode it, and finish(). */
+    int decode_file(const char *path);
+
+    /* Account for an incomplete bundle and tell the sink we are done. */
+    void finish()
+    {
+        vmpt_decoder_finish(&state_);
+        sink_.end(state_);
+    }
+
+private:
+    int diag(const char *errstr, uint64_t offset, int errcode)
+    {
+        if (state_.diag)
+            std::fprintf(state_.diag, "[%" PRIx64 ": %s: %s]\n", offset,
+                    errstr, pt_errstr(pt_errcode(errcode)));
+
+        return errcode;
+    }
+
+    vmpt_decoder state_;
+    Sink sink_;
+    Filter filter_;
+};
+
+template <class Sink, class Filter>
+inline void decoder<Sink, Filter>::decode_packet(uint64_t offset,
+        const pt_packet &packet)
+{
+    vmpt_decoder &s = state_;
+
+    if (!filter_(packet))
+        return;
+
+    s.pkt_cnt++;
+
+    switch (packet.type) {
+    case ppt_pip:
+        if (!s.got_pip) {
+            s.bundle.cr3 = packet.payload.pip.cr3;
+            s.bundle.nr = packet.payload.pip.nr;
+            sink_.pip(packet.payload.pip);
+            s.got_pip = 1;
+        } else
+            s.stats.dropped += 1;
+        return;
+
+    case ppt_pad:
+        if (s.got_pip && s.pad_cnt < 8)
+            s.pad_cnt++;
+        if (s.pad_cnt == 8) {
+            s.pad_cnt = 0;
+            s.got_pad = 1;
+        }
+        return;
+
+    case ppt_vmcs:
+        if (s.got_pad && s.got_pip) {
+            s.bundle.vmcs_base = packet.payload.vmcs.base;
+            sink_.vmcs(packet.payload.vmcs);
+            s.got_vmcs = 1;
+        }
+        return;
+
+    case ppt_tsc:
+        s.last_tsc = packet.payload.tsc.tsc;
+        s.got_tsc = 1;
+        if (s.got_pip && s.got_vmcs) {
+            s.bundle.tsc = packet.payload.tsc.tsc;
+            sink_.bundle(s.bundle);
+            s.stats.bundles += 1;
+            s.got_pip = 0;
+            s.got_vmcs = 0;
+        }
+        return;
+
+    case ppt_psb:
+        sink_.psb(offset);
+        return;
+
+    default:
+        return;
+    }
+}
+
+template <class Sink, class Filter>
+int decoder<Sink, Filter>::decode_packets(pt_packet_decoder *pkt)
+{
+    uint64_t offset;
+    int errcode;
+
+    offset = 0ull;
+    for (;;) {
+        pt_packet packet;
+
+        errcode = pt_pkt_get_offset(pkt, &offset);
+        if (errcode < 0)
+            return vmpt_decoder_error(&state_, "error getting offset",
+                    offset, errcode);
+
+        errcode = pt_pkt_next(pkt, &packet, sizeof(packet));
+        if (errcode < 0) {
+            if (errcode == -pte_eos)
+                return 0;
+
+            return vmpt_decoder_error(&state_, "error decoding packet",
+                    offset, errcode);
+        }
+
+        vmpt_stats_packet(&state_.stats, packet.type);
+        decode_packet(offset, packet);
+    }
+}
+
+template <class Sink, class Filter>
+int decoder<Sink, Filter>::decode(const pt_config &config, bool synced,
+        uint64_t *stop)
+{
+    pt_packet_decoder *pkt;
+    int errcode;
+
+    pkt = pt_pkt_alloc_decoder(&config);
+    if (!pkt)
+        return -pte_nomem;
+
+    state_.stats.bytes += (uint64_t) (config.end - config.begin);
+
+    errcode = pt_pkt_sync_set(pkt, 0ull);
+    if (errcode >= 0 && !synced)
+        errcode = pt_pkt_sync_forward(pkt);
+    if (errcode < 0) {
+        errcode = diag("sync error", 0ull, errcode);
+        goto out;
+    }
+
+    for (;;) {
+        errcode = decode_packets(pkt);
+        if (!errcode)
+            break;
+
+        errcode = vmpt_resync(&state_, pkt);
+        if (errcode < 0)
+            goto out;
+    }
+
+    if (stop)
+        errcode = pt_pkt_get_offset(pkt, stop);
+
+out:
+    pt_pkt_free_decoder(pkt);
+    return errcode;
+}
+
+template <class Sink, class Filter>
+int decoder<Sink, Filter>::decode_file(const char *path)
+{
+    vmpt_trace trace;
+    pt_config config;
+    struct stat st;
+    int errcode, fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -pte_bad_file;
+
+    errcode = -pte_bad_file;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        errcode = vmpt_trace_load(&trace, fd, 0ull, (uint64_t) st.st_size,
+                0u);
+
+    close(fd);
+    if (errcode < 0)
+        return errcode;
+
+    std::memset(&config, 0, sizeof(config));
+    pt_config_init(&config);
+    (void) pt_cpu_errata(&config.errata, &config.cpu);
+    config.begin = trace.begin;
+    config.end = trace.begin + trace.size;
+
+    errcode = decode(config);
+    finish();
+
+    vmpt_trace_unload(&trace);
+    return errcode;
+}
+
+/* A sink that calls @F for every complete bundle. */
+template <class F>
+struct lambda_sink : sink_base {
+    explicit lambda_sink(F f) : f(std::move(f)) {}
+
+    void bundle(const vmpt_bundle &bundle) { f(bundle); }
+
+    F f;
+};
+
+template <class F, class Filter = no_filter>
+decoder<lambda_sink<F>, Filter> make_decoder(F f, Filter filter = Filter())
+{
+    return decoder<lambda_sink<F>, Filter>(lambda_sink<F>(std::move(f)),
+            std::move(filter));
+}
+
+/* A sink that buffers its output and writes it to a FILE. */
+class buffered_sink : public sink_base {
+public:
+    explicit buffered_sink(std::FILE *file) : file_(file) {}
+
+    /* Write out what we buffered; false if a write failed. */
+    bool flush()
+    {
+        if (!buf_.empty() && file_ &&
+                std::fwrite(buf_.data(), 1, buf_.size(), file_) !=
+                buf_.size())
+            error_ = true;
+
+        buf_.clear();
+        return !error_;
+    }
+
+protected:
+    /* The size at which we write the buffer out. */
+    static const size_t flush_size = 1024 * 1024;
+
+    void put(const char *str, size_t n)
+    {
+        buf_.append(str, n);
+        if (flush_size <= buf_.size())
+            (void) flush();
+    }
+
+    void put(const char *str) { put(str, std::strlen(str)); }
+
+    /* Write @value in lower-case hex without leading zeros like PRIx64. */
+    void hex(uint64_t value)
+    {
+        static const char digits[] = "0123456789abcdef";
+        char buf[16], *pos;
+
+        pos = buf + sizeof(buf);
+        do {
+            *--pos = digits[value & 0xf];
+            value >>= 4;
+        } while (value);
+
+        put(pos, (size_t) (buf + sizeof(buf) - pos));
+    }
+
+    void dec(uint64_t value)
+    {
+        char buf[20], *pos;
+
+        pos = buf + sizeof(buf);
+        do {
+            *--pos = (char) ('0' + value % 10);
+            value /= 10;
+        } while (value);
+
+        put(pos, (size_t) (buf + sizeof(buf) - pos));
+    }
+
+private:
+    std::FILE *file_;
+    std::string buf_;
+    bool error_ = false;
+};
+
+/* The JSON output of vmpt, optionally without whitespace like --compact. */
+class json_sink : public buffered_sink {
+public:
+    explicit json_sink(std::FILE *file, bool compact = false)
+        : buffered_sink(file), compact_(compact)
+    {
+        put(compact_ ? "\"bundle\":[\n" : "\"bundle\": [\n");
+    }
+
+    void pip(const pt_packet_pip &pip)
+    {
+        if (compact_) {
+            put("{\"packet\":[{\"id\":\"PIP\",\"payload\":");
+            hex(pip.cr3);
+            put(",\"nr\":");
+            dec(pip.nr);
+            put("},");
+        } else {
+            put("\t{\n\t\t\"packet\": [\n\t\t\t{\n\t\t\t\t\"id\": \"PIP\","
+                    "\n\t\t\t\t\"payload\": ");
+            hex(pip.cr3);
+            put(",\n\t\t\t\t\"nr\": ");
+            dec(pip.nr);
+            put("\n\t\t\t},\n");
+        }
+    }
+
+    void vmcs(const pt_packet_vmcs &vmcs)
+    {
+        if (compact_) {
+            put("{\"id\":\"VMCS\",\"payload\":");
+            hex(vmcs.base);
+            put("},");
+        } else {
+            put("\t\t\t{\n\t\t\t\t\"id\": \"VMCS\",\n\t\t\t\t\"payload\": ");
+            hex(vmcs.base);
+            put("\n\t\t\t},\n");
+        }
+    }
+
+    void bundle(const vmpt_bundle &bundle)
+    {
+        if (compact_) {
+            put("{\"id\":\"TSC\",\"payload\":");
+            hex(bundle.tsc);
+            put("}]},\n");
+        } else {
+            put("\t\t\t{\n\t\t\t\t\"id\": \"TSC\",\n\t\t\t\t\"payload\": ");
+            hex(bundle.tsc);
+            put("\n\t\t\t}\n\t\t]\n\t},\n");
+        }
+    }
+
+    void end(const vmpt_decoder &)
+    {
+        put("]\n");
+        (void) flush();
+    }
+
+private:
+    bool compact_;
+};
+
+/* The binary output of vmpt --format=bin; see vmpt-bin.h. */
+class bin_sink : public buffered_sink {
+public:
+    explicit bin_sink(std::FILE *file) : buffered_sink(file)
+    {
+        vmpt_bin_header header;
+
+        vmpt_bin_header_init(&header);
+        put((const char *) &header, sizeof(header));
+    }
+
+    void bundle(const vmpt_bundle &bundle)
+    {
+        vmpt_bin_record record;
+
+        record.cr3 = bundle.cr3;
+        record.vmcs_base = bundle.vmcs_base;
+        record.tsc = bundle.tsc;
+        record.nr = bundle.nr;
+        record.reserved = 0;
+
+        put((const char *) &record, sizeof(record));
+    }
+
+    void end(const vmpt_decoder &) { (void) flush(); }
+};
+
+/* The residency of each VMCS like vmpt --aggregate, kept in memory.
+ *
+ * A bundle switches the cpu to its VMCS at its TSC; the VMCS holds the cpu
+ * until a bundle with another VMCS comes along.
+ */
+class aggregate_sink : public sink_base {
+public:
+    struct residency {
+        /* The TSC ticks the VMCS held the cpu and the number of slices. */
+        uint64_t ticks = 0, slices = 0;
+
+        /* The shortest and longest slice. */
+        uint64_t min = UINT64_MAX, max = 0;
+    };
+
+    /* The residency by VMCS base address. */
+    const std::unordered_map<uint64_t, residency> &vms() const
+    {
+        return vms_;
+    }
+
+    /* The number of switches and of slices that went backwards in time. */
+    uint64_t switches() const { return switches_; }
+    uint64_t backwards() const { return backwards_; }
+
+    void bundle(const vmpt_bundle &bundle)
+    {
+        if (current_ && current_base_ == bundle.vmcs_base)
+            return;
+
+        slice(bundle.tsc);
+
+        if (current_)
+            switches_ += 1;
+
+        current_ = &vms_[bundle.vmcs_base];
+        current_base_ = bundle.vmcs_base;
+        start_ = bundle.tsc;
+    }
+
+    /* The last slice lasts as far as we can tell. */
+    void end(const vmpt_decoder &state)
+    {
+        if (state.got_tsc)
+            slice(state.last_tsc);
+
+        current_ = NULL;
+    }
+
+private:
+    void slice(uint64_t tsc)
+    {
+        uint64_t length;
+
+        if (!current_)
+            return;
+
+        if (tsc < start_) {
+            backwards_ += 1;
+            return;
+        }
+
+        length = tsc - start_;
+        current_->ticks += length;
+        current_->slices += 1;
+        if (length < current_->min)
+            current_->min = length;
+        if (current_->max < length)
+            current_->max = length;
+    }
+
+    std::unordered_map<uint64_t, residency> vms_;
+
+    /* The VMCS holding the cpu and the TSC its slice started at.  Elements
+     * of an unordered_map stay put when it grows.
+     */
+    residency *current_ = NULL;
+    uint64_t current_base_ = 0, start_ = 0;
+
+    uint64_t switches_ = 0, backwards_ = 0;
+};
+
+} /* namespace vmpt */
+
+#endif /* LIBVMPT_HPP */
@@ -0,0 +1,956 @@
+/*
+ * vmpt-bench.c
+ *
+ * Synthesize a large processor trace and benchmark the vmpt decoder, the
+ * trace loaders and the output formats on it.
+ *
+ * The trace is encoded with libipt's packet encoder.  Between PSBs, which
+ * are spaced --psb bytes apart, each packet is drawn at random: a PIP with
+ * --pip per mille (followed by the eight PADs and the VMCS that make up a
+ * bundle for --vmcs percent of them), a TSC with --tsc per mille, a stray
+ * PAD with --pad per mille, and TNT or TIP filler otherwise.  The same seed
+ * gives the same trace.
+ *
+ * Every benchmark runs --runs times and we report the fastest run in GB/s of
+ * trace and in bundles per second.  The format benchmarks run the vmpt tool
+ * next to vmpt-bench with its output going to /dev/null.
+ */
+
+#include "libvmpt.h"
+
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+/* What to generate and what to run. */
+struct bench_options {
+    /* The size of the trace and the distance between PSBs in bytes. */
+    uint64_t size, psb;
+
+    /* The PIP, TSC and stray PAD packets per 1000 packets. */
+    unsigned int pip, tsc, pad;
+
+    /* The percentage of PIPs that start a complete bundle. */
+    unsigned int vmcs;
+
+    /* The number of guests whose cr3 and VMCS we pick from. */
+    unsigned int vms;
+
+    /* The random seed and the number of runs per benchmark. */
+    uint64_t seed;
+    unsigned int runs;
+
+    /* The benchmark groups to run - enum bench_group. */
+    unsigned int groups;
+
+    /* Write the trace to this file and exit if not NULL. */
+    const char *output;
+
+    /* The vmpt tool for the format benchmarks. */
+    const char *vmpt;
+};
+
+enum bench_group {
+    bg_decode = 1 << 0,
+    bg_load = 1 << 1,
+    bg_format = 1 << 2
+};
+
+static int usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [<options>]\n", name);
+    return -1;
+}
+
+static int help(const char *name)
+{
+    printf("usage: %s [<options>]\n\n", name);
+    printf("options:\n");
+    printf("  --help|-h         this text.\n");
+    printf("  --size <size>     synthesize <size> bytes of trace (k, m, g "
+            "suffixes allowed;\n");
+    printf("                    default: 256m).\n");
+    printf("  --psb <size>      put a PSB every <size> bytes (default: "
+            "4k).\n");
+    printf("  --pip <n>         PIPs per 1000 packets (default: 20).\n");
+    printf("  --vmcs <n>        the percentage of PIPs followed by eight PADs "
+            "and a VMCS\n");
+    printf("                    (default: 90).\n");
+    printf("  --tsc <n>         TSCs per 1000 packets (default: 40).\n");
+    printf("  --pad <n>         stray PADs per 1000 packets (default: 10).\n");
+    printf("  --vms <n>         the number of guests (default: 8).\n");
+    printf("  --seed <n>        the random seed (default: 1).\n");
+    printf("  --runs <n>        run each benchmark <n> times and report the "
+            "fastest\n");
+    printf("                    (default: 3).\n");
+    printf("  --bench <list>    the comma-separated benchmark groups to run: "
+            "decode,\n");
+    printf("                    load and format (default: all).\n");
+    printf("  --vmpt <path>     the vmpt tool for the format benchmarks "
+            "(default: the one\n");
+    printf("                    next to %s).\n", name);
+    printf("  -o|--output <file> write the trace to <file> and exit.\n");
+
+    return 0;
+}
+
+static int parse_size(const char *arg, uint64_t *size)
+{
+    uint64_t value;
+    char *rest;
+
+    if (!arg)
+        return -1;
+
+    errno = 0;
+    value = strtoull(arg, &rest, 0);
+    if (errno || rest == arg)
+        return -1;
+
+    switch (*rest) {
+    case 'g':
+    case 'G':
+        value <<= 10;
+        /* Fall through. */
+    case 'm':
+    case 'M':
+        value <<= 10;
+        /* Fall through. */
+    case 'k':
+    case 'K':
+        value <<= 10;
+        rest += 1;
+        break;
+    }
+
+    if (*rest)
+        return -1;
+
+    *size = value;
+    return 0;
+}
+
+static int parse_uint(const char *arg, unsigned int *value)
+{
+    uint64_t size;
+
+    if (parse_size(arg, &size) < 0 || UINT_MAX < size)
+        return -1;
+
+    *value = (unsigned int) size;
+    return 0;
+}
+
+static int parse_groups(const char *arg, unsigned int *groups)
+{
+    const char *name;
+
+    if (!arg)
+        return -1;
+
+    *groups = 0u;
+    for (name = arg; *name; ) {
+        size_t len;
+
+        len = strcspn(name, ",");
+        if (len == 6 && strncmp(name, "decode", len) == 0)
+            *groups |= bg_decode;
+        else if (len == 4 && strncmp(name, "load", len) == 0)
+            *groups |= bg_load;
+        else if (len == 6 && strncmp(name, "format", len) == 0)
+            *groups |= bg_format;
+        else
+            return -1;
+
+        name += len;
+        if (*name)
+            name += 1;
+    }
+
+    return *groups ? 0 : -1;
+}
+
+/* The CLOCK_MONOTONIC time in nanoseconds. */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/* A xorshift64* random number generator. */
+static uint64_t random_next(uint64_t *state)
+{
+    uint64_t x;
+
+    x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+
+    return x * 0x2545f4914f6cdd1dull;
+}
+
+static int encode(struct pt_encoder *encoder, enum pt_packet_type type,
+        uint64_t payload)
+{
+    struct pt_packet packet;
+
+    memset(&packet, 0, sizeof(packet));
+    packet.type = type;
+
+    switch (type) {
+    case ppt_pip:
+        packet.payload.pip.cr3 = payload;
+        packet.payload.pip.nr = 1;
+        break;
+
+    case ppt_vmcs:
+        packet.payload.vmcs.base = payload;
+        break;
+
+    case ppt_tsc:
+        packet.payload.tsc.tsc = payload;
+        break;
+
+    case ppt_tnt_8:
+        packet.payload.tnt.bit_size = 6;
+        packet.payload.tnt.payload = payload & 0x3f;
+        break;
+
+    case ppt_tip:
+        packet.payload.ip.ipc = pt_ipc_sext_48;
+        packet.payload.ip.ip = payload & 0x7fffffffffffull;
+        break;
+
+    default:
+        break;
+    }
+
+    return pt_enc_next(encoder, &packet);
+}
+
+/* Encode one randomly drawn packet - or the eight PADs and the VMCS that
+ * follow a PIP - as requested by @options.
+ */
+static int encode_random(struct pt_encoder *encoder,
+        const struct bench_options *options, uint64_t *state, uint64_t *tsc)
+{
+    uint64_t draw;
+    int errcode;
+
+    draw = random_next(state);
+    if ((draw % 1000) < options->pip) {
+        uint64_t vm;
+        int pad;
+
+        vm = (draw >> 32) % options->vms;
+        errcode = encode(encoder, ppt_pip, (vm + 1) << 12);
+        if (errcode < 0 || options->vmcs <= (draw >> 16) % 100)
+            return errcode;
+
+        for (pad = 0; pad < 8 && errcode >= 0; ++pad)
+            errcode = encode(encoder, ppt_pad, 0ull);
+        if (errcode < 0)
+            return errcode;
+
+        return encode(encoder, ppt_vmcs, 0x100000ull + ((vm + 1) << 12));
+    }
+
+    draw /= 1000;
+    if ((draw % 1000) < options->tsc) {
+        *tsc += 1 + ((draw >> 16) & 0xfff);
+        return encode(encoder, ppt_tsc, *tsc);
+    }
+
+    draw /= 1000;
+    if ((draw % 1000) < options->pad)
+        return encode(encoder, ppt_pad, 0ull);
+
+    if (draw & 1)
+        return encode(encoder, ppt_tnt_8, draw >> 1);
+
+    return encode(encoder, ppt_tip, draw >> 1);
+}
+
+/* Fill @buffer of @size bytes with trace as requested by @options.
+ *
+ * Sets @used to the bytes of trace we generated; the last packet may not
+ * have fit.
+ */
+static int generate(uint8_t *buffer, uint64_t size,
+        const struct bench_options *options, uint64_t *used)
+{
+    struct pt_encoder *encoder;
+    struct pt_config config;
+    uint64_t state, tsc, next_psb;
+    int errcode;
+
+    memset(&config, 0, sizeof(config));
+    pt_config_init(&config);
+    config.begin = buffer;
+    config.end = buffer + size;
+
+    encoder = pt_alloc_encoder(&config);
+    if (!encoder)
+        return -pte_nomem;
+
+    state = options->seed ? options->seed : 1ull;
+    tsc = 0x100000ull;
+    next_psb = 0ull;
+    for (;;) {
+        uint64_t offset;
+
+        errcode = pt_enc_get_offset(encoder, &offset);
+        if (errcode < 0)
+            break;
+
+        if (next_psb <= offset) {
+            next_psb = offset + options->psb;
+
+            errcode = encode(encoder, ppt_psb, 0ull);
+            if (errcode >= 0)
+                errcode = encode(encoder, ppt_psbend, 0ull);
+            if (errcode < 0)
+                break;
+
+            continue;
+        }
+
+        errcode = encode_random(encoder, options, &state, &tsc);
+        if (errcode < 0)
+            break;
+    }
+
+    if (errcode == -pte_eos)
+        errcode = pt_enc_get_offset(encoder, used);
+
+    pt_free_encoder(encoder);
+    return errcode < 0 ? errcode : 0;
+}
+
+static int write_trace(int fd, const uint8_t *buffer, uint64_t size)
+{
+    uint64_t done;
+    ssize_t written;
+
+    for (done = 0; done < size; done += (uint64_t) written) {
+        written = write(fd, buffer + done, (size_t) (size - done));
+        if (written < 0) {
+            if (errno == EINTR) {
+                written = 0;
+                continue;
+            }
+
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* The trace and what we know about it. */
+struct bench_trace {
+    /* The trace in memory and its size. */
+    uint8_t *buffer;
+    uint64_t size;
+
+    /* The trace in a file for the loaders and the vmpt tool. */
+    char path[PATH_MAX];
+
+    /* The bundles and packets in the trace. */
+    uint64_t bundles, packets;
+};
+
+static void bench_report(const char *name, const struct bench_trace *trace,
+        uint64_t ns)
+{
+    double seconds;
+
+    if (!ns)
+        ns = 1;
+
+    seconds = (double) ns / 1e9;
+    printf("%-22s %8.3f %12.3f %10.3f s\n", name,
+            (double) trace->size / 1e9 / seconds,
+            (double) trace->bundles / 1e6 / seconds, seconds);
+    fflush(stdout);
+}
+
+static void bench_failed(const char *name, const char *why)
+{
+    printf("%-22s %s\n", name, why);
+    fflush(stdout);
+}
+
+static void bench_config(struct pt_config *config, uint8_t *begin,
+        uint64_t size)
+{
+    memset(config, 0, sizeof(*config));
+    pt_config_init(config);
+    (void) pt_cpu_errata(&config->errata, &config->cpu);
+
+    config->begin = begin;
+    config->end = begin + size;
+}
+
+/* Walk the packets without looking at them - what libipt costs us. */
+static int run_scan(const struct bench_trace *trace)
+{
+    struct pt_packet_decoder *decoder;
+    struct pt_config config;
+    int errcode;
+
+    bench_config(&config, trace->buffer, trace->size);
+
+    decoder = pt_pkt_alloc_decoder(&config);
+    if (!decoder)
+        return -pte_nomem;
+
+    errcode = pt_pkt_sync_forward(decoder);
+    while (errcode >= 0) {
+        struct pt_packet packet;
+
+        errcode = pt_pkt_next(decoder, &packet, sizeof(packet));
+        if (errcode == -pte_eos)
+            break;
+
+        if (errcode < 0)
+            errcode = pt_pkt_sync_forward(decoder);
+    }
+
+    pt_pkt_free_decoder(decoder);
+    return errcode == -pte_eos ? 0 : errcode;
+}
+
+/* Feed one packet at a time to vmpt_decode_packet(). */
+static int run_packet(const struct bench_trace *trace)
+{
+    struct pt_packet_decoder *decoder;
+    struct vmpt_decoder dec;
+    struct pt_config config;
+    int errcode;
+
+    bench_config(&config, trace->buffer, trace->size);
+    vmpt_decoder_init(&dec, NULL, NULL);
+
+    decoder = pt_pkt_alloc_decoder(&config);
+    if (!decoder)
+        return -pte_nomem;
+
+    errcode = pt_pkt_sync_forward(decoder);
+    while (errcode >= 0) {
+        struct pt_packet packet;
+        uint64_t offset;
+
+        errcode = pt_pkt_get_offset(decoder, &offset);
+        if (errcode >= 0)
+            errcode = pt_pkt_next(decoder, &packet, sizeof(packet));
+        if (errcode == -pte_eos)
+            break;
+
+        if (errcode < 0) {
+            errcode = pt_pkt_sync_forward(decoder);
+            continue;
+        }
+
+        vmpt_stats_packet(&dec.stats, packet.type);
+        errcode = vmpt_decode_packet(&dec, offset, &packet);
+    }
+
+    pt_pkt_free_decoder(decoder);
+    return errcode == -pte_eos ? 0 : errcode;
+}
+
+/* The bundle state machine without a user. */
+static int run_batch(const struct bench_trace *trace)
+{
+    struct vmpt_decoder dec;
+    struct pt_config config;
+
+    bench_config(&config, trace->buffer, trace->size);
+    vmpt_decoder_init(&dec, NULL, NULL);
+
+    return vmpt_decode(&dec, &config, 0, NULL);
+}
+
+static void sum_bundle(struct vmpt_decoder *dec,
+        const struct vmpt_bundle *bundle)
+{
+    uint64_t *sum;
+
+    sum = dec->priv;
+    *sum += bundle->tsc ^ bundle->vmcs_base;
+}
+
+static const struct vmpt_callbacks sum_callbacks = {
+    NULL,
+    NULL,
+    sum_bundle,
+    NULL
+};
+
+/* A bundle callback like the formats use. */
+static volatile uint64_t bench_sum;
+
+static int run_callback(const struct bench_trace *trace)
+{
+    struct vmpt_decoder dec;
+    struct pt_config config;
+    uint64_t sum;
+    int errcode;
+
+    bench_config(&config, trace->buffer, trace->size);
+
+    sum = 0ull;
+    vmpt_decoder_init(&dec, &sum_callbacks, &sum);
+
+    errcode = vmpt_decode(&dec, &config, 0, NULL);
+    bench_sum = sum;
+
+    return errcode;
+}
+
+static int run_iter(const struct bench_trace *trace)
+{
+    struct vmpt_bundle bundle;
+    struct pt_config config;
+    struct vmpt_iter *iter;
+    uint64_t sum;
+    int errcode;
+
+    bench_config(&config, trace->buffer, trace->size);
+
+    iter = vmpt_iter_alloc(&config);
+    if (!iter)
+        return -pte_nomem;
+
+    sum = 0ull;
+    while ((errcode = vmpt_next(iter, &bundle)) >= 0)
+        sum += bundle.tsc ^ bundle.vmcs_base;
+
+    vmpt_iter_free(iter);
+    bench_sum = sum;
+
+    return errcode == -pte_eos ? 0 : errcode;
+}
+
+/* Load the trace file with @flags and decode it. */
+static int run_load(const struct bench_trace *trace, unsigned int flags)
+{
+    struct vmpt_trace loaded;
+    struct vmpt_decoder dec;
+    struct pt_config config;
+    int errcode, fd;
+
+    fd = open(trace->path, O_RDONLY);
+    if (fd < 0)
+        return -pte_bad_file;
+
+    errcode = vmpt_trace_load(&loaded, fd, 0ull, trace->size, flags);
+    close(fd);
+    if (errcode < 0)
+        return errcode;
+
+    bench_config(&config, loaded.begin, loaded.size);
+    vmpt_decoder_init(&dec, NULL, NULL);
+
+    errcode = vmpt_decode(&dec, &config, 0, NULL);
+
+    vmpt_trace_unload(&loaded);
+    return errcode;
+}
+
+static int run_mmap(const struct bench_trace *trace)
+{
+    return run_load(trace, 0u);
+}
+
+static int run_huge_pages(const struct bench_trace *trace)
+{
+    return run_load(trace, vtf_huge_pages);
+}
+
+static int run_read(const struct bench_trace *trace)
+{
+    return run_load(trace, vtf_read);
+}
+
+/* Run @fn @runs times and report the fastest run. */
+static void bench_run(const char *name, const struct bench_trace *trace,
+        int (*fn)(const struct bench_trace *), unsigned int runs)
+{
+    uint64_t best;
+    unsigned int run;
+
+    best = UINT64_MAX;
+    for (run = 0; run < runs; ++run) {
+        uint64_t start, ns;
+        int errcode;
+
+        start = now_ns();
+        errcode = fn(trace);
+        ns = now_ns() - start;
+
+        if (errcode < 0) {
+            bench_failed(name, pt_errstr(pt_errcode(errcode)));
+            return;
+        }
+
+        if (ns < best)
+            best = ns;
+    }
+
+    bench_report(name, trace, best);
+}
+
+/* Run the vmpt tool at @vmpt with @args on the trace, discarding its output.
+ *
+ * Returns its exit status or -1 if it could not be run.
+ */
+static int run_vmpt(const char *vmpt, const char *const *args,
+        const struct bench_trace *trace)
+{
+    posix_spawn_file_actions_t actions;
+    char *argv[16];
+    int errcode, status, argc;
+    pid_t pid;
+
+    argc = 0;
+    argv[argc++] = (char *) vmpt;
+    argv[argc++] = (char *) "-o";
+    argv[argc++] = (char *) "/dev/null";
+    for (; *args && argc < 14; ++args)
+        argv[argc++] = (char *) *args;
+    argv[argc++] = (char *) trace->path;
+    argv[argc] = NULL;
+
+    if (posix_spawn_file_actions_init(&actions))
+        return -1;
+
+    errcode = posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO,
+            "/dev/null", O_WRONLY, 0);
+    if (!errcode)
+        errcode = posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO,
+                STDERR_FILENO);
+    if (!errcode)
+        errcode = posix_spawn(&pid, vmpt, &actions, NULL, argv, environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+    if (errcode)
+        return -1;
+
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR)
+            return -1;
+
+    if (!WIFEXITED(status))
+        return -1;
+
+    return WEXITSTATUS(status);
+}
+
+/* The output formats we time, by their vmpt options. */
+struct bench_format {
+    const char *name;
+    const char *args[4];
+};
+
+static const struct bench_format formats[] = {
+    { "format/json", { NULL } },
+    { "format/compact", { "--compact", NULL } },
+    { "format/bin", { "--format=bin", NULL } },
+    { "format/packed", { "--format=packed", NULL } },
+    { "format/perfetto", { "--format=perfetto", NULL } },
+    { "format/aggregate", { "--aggregate", NULL } },
+    { "format/json-zstd", { "--compress=zstd", NULL } },
+    { "format/json-lz4", { "--compress=lz4", NULL } },
+    { "format/json-j4", { "-j", "4", NULL } },
+    { "format/json-prefilter", { "--prefilter", NULL } }
+};
+
+static void bench_format(const struct bench_format *format,
+        const struct bench_trace *trace, const struct bench_options *options)
+{
+    uint64_t best;
+    unsigned int run;
+
+    best = UINT64_MAX;
+    for (run = 0; run < options->runs; ++run) {
+        uint64_t start, ns;
+        int status;
+
+        start = now_ns();
+        status = run_vmpt(options->vmpt, format->args, trace);
+        ns = now_ns() - start;
+
+        if (status) {
+            bench_failed(format->name, status < 0 ?
+                    "failed to run vmpt" : "not supported by vmpt");
+            return;
+        }
+
+        if (ns < best)
+            best = ns;
+    }
+
+    bench_report(format->name, trace, best);
+}
+
+/* The vmpt tool next to us. */
+static int find_vmpt(char *path, size_t size)
+{
+    ssize_t len;
+    char *slash;
+
+    len = readlink("/proc/self/exe", path, size - 1);
+    if (len < 0)
+        return -1;
+
+    path[len] = 0;
+    slash = strrchr(path, '/');
+    if (!slash || size - (size_t) (slash - path) < sizeof("/vmpt"))
+        return -1;
+
+    strcpy(slash, "/vmpt");
+    return access(path, X_OK);
+}
+
+static int count_trace(struct bench_trace *trace)
+{
+    struct vmpt_decoder dec;
+    struct pt_config config;
+    int errcode, type;
+
+    bench_config(&config, trace->buffer, trace->size);
+    vmpt_decoder_init(&dec, NULL, NULL);
+
+    errcode = vmpt_decode(&dec, &config, 0, NULL);
+    if (errcode < 0)
+        return errcode;
+
+    trace->bundles = dec.stats.bundles;
+    trace->packets = 0ull;
+    for (type = 0; type < VMPT_STATS_NTYPES; ++type)
+        trace->packets += dec.stats.packets[type];
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_options options;
+    struct bench_trace trace;
+    char vmpt[PATH_MAX];
+    uint64_t start;
+    const char *tmpdir;
+    int errcode, fd, idx;
+
+    memset(&options, 0, sizeof(options));
+    options.size = 256ull << 20;
+    options.psb = 4ull << 10;
+    options.pip = 20u;
+    options.vmcs = 90u;
+    options.tsc = 40u;
+    options.pad = 10u;
+    options.vms = 8u;
+    options.seed = 1ull;
+    options.runs = 3u;
+    options.groups = bg_decode | bg_load | bg_format;
+
+    for (idx = 1; idx < argc; ++idx) {
+        const char *arg;
+
+        arg = argv[idx];
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0)
+            return help(argv[0]);
+
+        if (strcmp(arg, "--size") == 0) {
+            if (parse_size(argv[++idx], &options.size) < 0 || !options.size)
+                return usage(argv[0]);
+        } else if (strcmp(arg, "--psb") == 0) {
+            if (parse_size(argv[++idx], &options.psb) < 0 || !options.psb)
+                return usage(argv[0]);
+        } else if (strcmp(arg, "--pip") == 0) {
+            if (parse_uint(argv[++idx], &options.pip) < 0)
+                return usage(argv[0]);
+        } else if (strcmp(arg, "--vmcs") == 0) {
+            if (parse_uint(argv[++idx], &options.vmcs) < 0 ||
+                    100u < options.vmcs)
+                return usage(argv[0]);
+        } else if (strcmp(arg, "--tsc") == 0) {
+            if (parse_uint(argv[++idx], &options.tsc) < 0)
+                return usage(argv[0]);
+        } else if (strcmp(arg, "--pad") == 0) {
+            if (parse_uint(argv[++idx], &options.pad) < 0)
+                return usage(argv[0]);
+        } else if (strcmp(arg, "--vms") == 0) {
+            if (parse_uint(argv[++idx], &options.vms) < 0 || !options.vms)
+                return usage(argv[0]);
+        } else if (strcmp(arg, "--seed") == 0) {
+            if (parse_size(argv[++idx], &options.seed) < 0)
+                return usage(argv[0]);
+        } else if (strcmp(arg, "--runs") == 0) {
+            if (parse_uint(argv[++idx], &options.runs) < 0 || !options.runs)
+                return usage(argv[0]);
+        } else if (strcmp(arg, "--bench") == 0) {
+            if (parse_groups(argv[++idx], &options.groups) < 0)
+                return usage(argv[0]);
+        } else if (strcmp(arg, "--vmpt") == 0) {
+            options.vmpt = argv[++idx];
+            if (!options.vmpt)
+                return usage(argv[0]);
+        } else if (strcmp(arg, "-o") == 0 || strcmp(arg, "--output") == 0) {
+            options.output = argv[++idx];
+            if (!options.output)
+                return usage(argv[0]);
+        } else {
+            fprintf(stderr, "%s: unknown option: %s.\n", argv[0], arg);
+            return -1;
+        }
+    }
+
+    if (1000u < options.pip || 1000u < options.tsc || 1000u < options.pad) {
+        fprintf(stderr, "%s: --pip, --tsc and --pad are per 1000 packets.\n",
+                argv[0]);
+        return -1;
+    }
+
+    if ((uint64_t) (size_t) options.size != options.size) {
+        fprintf(stderr, "%s: --size is too big.\n", argv[0]);
+        return -1;
+    }
+
+    memset(&trace, 0, sizeof(trace));
+    trace.buffer = malloc((size_t) options.size);
+    if (!trace.buffer) {
+        fprintf(stderr, "%s: failed to allocate %" PRIu64 " bytes.\n",
+                argv[0], options.size);
+        return -1;
+    }
+
+    start = now_ns();
+    errcode = generate(trace.buffer, options.size, &options, &trace.size);
+    if (errcode < 0) {
+        fprintf(stderr, "%s: failed to generate the trace: %s.\n", argv[0],
+                pt_errstr(pt_errcode(errcode)));
+        goto out;
+    }
+
+    if (options.output) {
+        fd = open(options.output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0 || write_trace(fd, trace.buffer, trace.size) < 0) {
+            fprintf(stderr, "%s: failed to write %s: %s.\n", argv[0],
+                    options.output, strerror(errno));
+            errcode = -1;
+        }
+
+        if (0 <= fd && close(fd) < 0 && !errcode) {
+            fprintf(stderr, "%s: failed to write %s: %s.\n", argv[0],
+                    options.output, strerror(errno));
+            errcode = -1;
+        }
+
+        goto out;
+    }
+
+    errcode = count_trace(&trace);
+    if (errcode < 0) {
+        fprintf(stderr, "%s: failed to decode the trace: %s.\n", argv[0],
+                pt_errstr(pt_errcode(errcode)));
+        goto out;
+    }
+
+    printf("trace: %" PRIu64 " bytes, %" PRIu64 " packets, %" PRIu64
+            " bundles, PSB every %" PRIu64 " bytes, seed %" PRIu64
+            " (%.3f s)\n", trace.size, trace.packets, trace.bundles,
+            options.psb, options.seed, (double) (now_ns() - start) / 1e9);
+    printf("%-22s %8s %12s %12s\n", "benchmark", "GB/s", "Mbundles/s",
+            "time");
+    fflush(stdout);
+
+    if (options.groups & bg_decode) {
+        bench_run("decode/scan", &trace, run_scan, options.runs);
+        bench_run("decode/packet", &trace, run_packet, options.runs);
+        bench_run("decode/batch", &trace, run_batch, options.runs);
+        bench_run("decode/callback", &trace, run_callback, options.runs);
+        bench_run("decode/iter", &trace, run_iter, options.runs);
+    }
+
+    if (!(options.groups & (bg_load | bg_format)))
+        goto out;
+
+    tmpdir = getenv("TMPDIR");
+    if (!tmpdir || !*tmpdir)
+        tmpdir = "/tmp";
+
+    errcode = snprintf(trace.path, sizeof(trace.path), "%s/vmpt-bench-XXXXXX",
+            tmpdir);
+    if (errcode < 0 || (size_t) errcode >= sizeof(trace.path)) {
+        fprintf(stderr, "%s: TMPDIR is too long.\n", argv[0]);
+        errcode = -1;
+        goto out;
+    }
+
+    fd = mkstemp(trace.path);
+    if (fd < 0) {
+        fprintf(stderr, "%s: failed to create %s: %s.\n", argv[0],
+                trace.path, strerror(errno));
+        errcode = -1;
+        goto out;
+    }
+
+    errcode = write_trace(fd, trace.buffer, trace.size);
+    if (close(fd) < 0)
+        errcode = -1;
+    if (errcode < 0) {
+        fprintf(stderr, "%s: failed to write %s: %s.\n", argv[0],
+                trace.path, strerror(errno));
+        goto out_unlink;
+    }
+
+    if (options.groups & bg_load) {
+        bench_run("load/mmap", &trace, run_mmap, options.runs);
+        bench_run("load/huge-pages", &trace, run_huge_pages, options.runs);
+        bench_run("load/read", &trace, run_read, options.runs);
+    }
+
+    if (options.groups & bg_format) {
+        size_t format;
+
+        if (!options.vmpt) {
+            if (find_vmpt(vmpt, sizeof(vmpt)) < 0) {
+                fprintf(stderr, "%s: vmpt not found; use --vmpt.\n",
+                        argv[0]);
+                errcode = -1;
+                goto out_unlink;
+            }
+
+            options.vmpt = vmpt;
+        }
+
+        for (format = 0; format < sizeof(formats) / sizeof(*formats);
+                ++format)
+            bench_format(&formats[format], &trace, &options);
+    }
+
+    errcode = 0;
+
+out_unlink:
+    unlink(trace.path);
+
+out:
+    free(trace.buffer);
+    return errcode < 0 ? -1 : 0;
+}
@@ -0,0 +1,422 @@
+/*
+ * vmpt-bin.h
+ *
+ * The binary bundle format written by vmpt --format=bin and a small reader
+ * for it.
+ *
+ * A file starts with a struct vmpt_bin_header followed by fixed-size
+ * struct vmpt_bin_record entries in trace order until the end of the file.
+ * All fields are in host byte order.  Records are 8-byte aligned when the
+ * file is mapped, so they can be used in place:
+ *
+ *     struct vmpt_bin_file file;
+ *     const struct vmpt_bin_record *record;
+ *
+ *     if (vmpt_bin_open(&file, "bundles.bin") < 0)
+ *         ...
+ *
+ *     for (record = file.begin; record < file.end; ++record)
+ *         ...
+ *
+ *     vmpt_bin_close(&file);
+ *
+ * vmpt --format=packed writes the same records much smaller.  A packed file
+ * starts with a struct vmpt_bin_header with VMPT_PACK_MAGIC and a zero
+ * record size.  Each record that follows is a byte of enum vmpt_pack_flags
+ * and up to three unsigned LEB128 varints:
+ *
+ *   - the VMCS base if vpf_new_vmcs is set, its id otherwise - unless
+ *     vpf_same_vmcs says it is the previous record's.  VMCS bases get ids
+ *     1, 2, 3, ... in the order they first show up,
+ *   - the same for the cr3,
+ *   - the distance of the TSC from the previous record's, or from zero for
+ *     the first one.  vpf_tsc_back says it went backwards.
+ *
+ * vmpt_pack_next() turns them back into records:
+ *
+ *     struct vmpt_pack_file file;
+ *     struct vmpt_bin_record record;
+ *
+ *     if (vmpt_pack_open(&file, "bundles.vpk") < 0)
+ *         ...
+ *
+ *     while (vmpt_pack_next(&file, &record) > 0)
+ *         ...
+ *
+ *     vmpt_pack_close(&file);
+ */
+
+#ifndef VMPT_BIN_H
+#define VMPT_BIN_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define VMPT_BIN_MAGIC "VMPTBNDL"
+#define VMPT_BIN_VERSION 1
+
+#define VMPT_PACK_MAGIC "VMPTPACK"
+#define VMPT_PACK_VERSION 1
+
+struct vmpt_bin_header {
+    /* VMPT_BIN_MAGIC without the terminating zero. */
+    char magic[8];
+
+    /* The format version and the size of one record in bytes. */
+    uint32_t version;
+    uint32_t record_size;
+
+    uint64_t reserved[2];
+};
+
+/* One bundle of linked PIP, VMCS and TSC packets. */
+struct vmpt_bin_record {
+    /* The PIP packet's cr3. */
+    uint64_t cr3;
+
+    /* The VMCS base address. */
+    uint64_t vmcs_base;
+
+    /* The TSC that completed the bundle. */
+    uint64_t tsc;
+
+    /* The PIP packet's non-root bit. */
+    uint32_t nr;
+    uint32_t reserved;
+};
+
+/* The flags byte of a packed record. */
+enum vmpt_pack_flags {
+    /* The record brings a new VMCS base or cr3 rather than an id. */
+    vpf_new_vmcs = 1 << 0,
+    vpf_new_cr3 = 1 << 1,
+
+    /* The record has the previous record's VMCS base or cr3. */
+    vpf_same_vmcs = 1 << 2,
+    vpf_same_cr3 = 1 << 3,
+
+    /* The TSC went backwards. */
+    vpf_tsc_back = 1 << 4,
+
+    /* The PIP packet's non-root bit. */
+    vpf_nr = 1 << 5
+};
+
+static inline void vmpt_bin_header_init(struct vmpt_bin_header *header)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, VMPT_BIN_MAGIC, sizeof(header->magic));
+    header->version = VMPT_BIN_VERSION;
+    header->record_size = sizeof(struct vmpt_bin_record);
+}
+
+static inline void vmpt_pack_header_init(struct vmpt_bin_header *header)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, VMPT_PACK_MAGIC, sizeof(header->magic));
+    header->version = VMPT_PACK_VERSION;
+}
+
+/* A mapped binary bundle file. */
+struct vmpt_bin_file {
+    /* The records in [begin, end). */
+    const struct vmpt_bin_record *begin, *end;
+
+    /* The mapping. */
+    void *map;
+    size_t size;
+};
+
+/* Map @path into [*@map, *@map + *@size) and check that its header has
+ * @magic, @version and @record_size.
+ *
+ * Returns zero on success, a negative errno otherwise.
+ */
+static inline int vmpt_bin_map(void **map, size_t *size, const char *path,
+        const char *magic, uint32_t version, uint32_t record_size)
+{
+    const struct vmpt_bin_header *header;
+    struct stat st;
+    int fd, errcode;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -errno;
+
+    if (fstat(fd, &st) < 0) {
+        errcode = -errno;
+        goto out;
+    }
+
+    errcode = -EINVAL;
+    if ((uint64_t) st.st_size < sizeof(*header) ||
+            (uint64_t) (size_t) st.st_size != (uint64_t) st.st_size)
+        goto out;
+
+    *size = (size_t) st.st_size;
+    *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (*map == MAP_FAILED) {
+        *map = NULL;
+        errcode = -errno;
+        goto out;
+    }
+
+    header = (const struct vmpt_bin_header *) *map;
+    if (memcmp(header->magic, magic, sizeof(header->magic)) ||
+            header->version != version ||
+            header->record_size != record_size) {
+        munmap(*map, *size);
+        *map = NULL;
+        goto out;
+    }
+
+    (void) madvise(*map, *size, MADV_SEQUENTIAL);
+    errcode = 0;
+
+out:
+    close(fd);
+    return errcode;
+}
+
+/* Map @path and check its header.
+ *
+ * Returns zero on success, a negative errno otherwise.
+ */
+static inline int vmpt_bin_open(struct vmpt_bin_file *file, const char *path)
+{
+    const struct vmpt_bin_header *header;
+    size_t records;
+    int errcode;
+
+    if (!file || !path)
+        return -EINVAL;
+
+    memset(file, 0, sizeof(*file));
+
+    errcode = vmpt_bin_map(&file->map, &file->size, path, VMPT_BIN_MAGIC,
+            VMPT_BIN_VERSION, sizeof(struct vmpt_bin_record));
+    if (errcode < 0)
+        return errcode;
+
+    header = (const struct vmpt_bin_header *) file->map;
+
+    /* Ignore a partial record at the end; the writer may have been cut
+     * short.
+     */
+    records = (file->size - sizeof(*header)) / sizeof(*file->begin);
+    file->begin = (const struct vmpt_bin_record *) (header + 1);
+    file->end = file->begin + records;
+
+    return 0;
+}
+
+static inline void vmpt_bin_close(struct vmpt_bin_file *file)
+{
+    if (!file)
+        return;
+
+    if (file->map)
+        munmap(file->map, file->size);
+
+    memset(file, 0, sizeof(*file));
+}
+
+/* The values a packed file gave ids to so far - id i is values[i - 1]. */
+struct vmpt_pack_dict {
+    uint64_t *values;
+    size_t count, capacity;
+};
+
+/* A mapped packed bundle file. */
+struct vmpt_pack_file {
+    /* The bytes of the records we did not read yet. */
+    const uint8_t *pos, *end;
+
+    /* The VMCS bases and cr3s by id. */
+    struct vmpt_pack_dict vmcs, cr3;
+
+    /* The previous record. */
+    struct vmpt_bin_record last;
+
+    /* The mapping. */
+    void *map;
+    size_t size;
+};
+
+/* Map @path and check its header.
+ *
+ * Returns zero on success, a negative errno otherwise.
+ */
+static inline int vmpt_pack_open(struct vmpt_pack_file *file,
+        const char *path)
+{
+    int errcode;
+
+    if (!file || !path)
+        return -EINVAL;
+
+    memset(file, 0, sizeof(*file));
+
+    errcode = vmpt_bin_map(&file->map, &file->size, path, VMPT_PACK_MAGIC,
+            VMPT_PACK_VERSION, 0u);
+    if (errcode < 0)
+        return errcode;
+
+    file->pos = (const uint8_t *) file->map + sizeof(struct vmpt_bin_header);
+    file->end = (const uint8_t *) file->map + file->size;
+
+    return 0;
+}
+
+/* Read a varint at *@pos, which must be before @end, into @value.
+ *
+ * Returns zero on success, -EAGAIN if it is cut off, -EINVAL if it is too
+ * long.
+ */
+static inline int vmpt_pack_varint(const uint8_t **pos, const uint8_t *end,
+        uint64_t *value)
+{
+    const uint8_t *byte;
+    unsigned int shift;
+
+    *value = 0ull;
+    for (byte = *pos, shift = 0; byte < end; ++byte, shift += 7) {
+        if (64 <= shift)
+            return -EINVAL;
+
+        *value |= (uint64_t) (*byte & 0x7f) << shift;
+        if (!(*byte & 0x80)) {
+            *pos = byte + 1;
+            return 0;
+        }
+    }
+
+    return -EAGAIN;
+}
+
+/* Read a VMCS base or cr3 at *@pos into @value using @dict.
+ *
+ * It is @last if @same, a new value for @dict if @fresh, the value of an id
+ * in @dict otherwise.
+ */
+static inline int vmpt_pack_value(const uint8_t **pos, const uint8_t *end,
+        struct vmpt_pack_dict *dict, int same, int fresh, uint64_t last,
+        uint64_t *value)
+{
+    uint64_t raw;
+    int errcode;
+
+    if (same) {
+        *value = last;
+        return 0;
+    }
+
+    errcode = vmpt_pack_varint(pos, end, &raw);
+    if (errcode < 0)
+        return errcode;
+
+    if (!fresh) {
+        if (!raw || dict->count < raw)
+            return -EINVAL;
+
+        *value = dict->values[raw - 1];
+        return 0;
+    }
+
+    if (dict->count == dict->capacity) {
+        uint64_t *values;
+        size_t capacity;
+
+        capacity = dict->capacity ? dict->capacity * 2 : 64;
+        values = (uint64_t *) realloc(dict->values,
+                capacity * sizeof(*values));
+        if (!values)
+            return -ENOMEM;
+
+        dict->values = values;
+        dict->capacity = capacity;
+    }
+
+    dict->values[dict->count++] = raw;
+    *value = raw;
+    return 0;
+}
+
+/* Read the next record of @file into @record.
+ *
+ * Returns one if there was a record, zero at the end of the file and a
+ * negative errno if the file is corrupt or we ran out of memory.  Like
+ * vmpt_bin_open(), we ignore a partial record at the end.
+ */
+static inline int vmpt_pack_next(struct vmpt_pack_file *file,
+        struct vmpt_bin_record *record)
+{
+    const uint8_t *pos;
+    uint64_t delta;
+    size_t nvmcs, ncr3;
+    uint8_t flags;
+    int errcode;
+
+    if (!file || !record)
+        return -EINVAL;
+
+    if (file->end <= file->pos)
+        return 0;
+
+    pos = file->pos;
+    flags = *pos++;
+    nvmcs = file->vmcs.count;
+    ncr3 = file->cr3.count;
+
+    memset(record, 0, sizeof(*record));
+    errcode = vmpt_pack_value(&pos, file->end, &file->vmcs,
+            flags & vpf_same_vmcs, flags & vpf_new_vmcs,
+            file->last.vmcs_base, &record->vmcs_base);
+    if (!errcode)
+        errcode = vmpt_pack_value(&pos, file->end, &file->cr3,
+                flags & vpf_same_cr3, flags & vpf_new_cr3, file->last.cr3,
+                &record->cr3);
+    if (!errcode)
+        errcode = vmpt_pack_varint(&pos, file->end, &delta);
+    if (errcode < 0) {
+        /* Forget what the partial record added. */
+        file->vmcs.count = nvmcs;
+        file->cr3.count = ncr3;
+
+        if (errcode == -EAGAIN) {
+            file->pos = file->end;
+            return 0;
+        }
+
+        return errcode;
+    }
+
+    record->tsc = (flags & vpf_tsc_back) ? file->last.tsc - delta :
+        file->last.tsc + delta;
+    record->nr = (flags & vpf_nr) ? 1u : 0u;
+
+    file->last = *record;
+    file->pos = pos;
+    return 1;
+}
+
+static inline void vmpt_pack_close(struct vmpt_pack_file *file)
+{
+    if (!file)
+        return;
+
+    if (file->map)
+        munmap(file->map, file->size);
+
+    free(file->vmcs.values);
+    free(file->cr3.values);
+    memset(file, 0, sizeof(*file));
+}
+
+#endif /* VMPT_BIN_H */
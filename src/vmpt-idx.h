@@ -0,0 +1,193 @@
+/*
+ * vmpt-idx.h
+ *
+ * The PSB index vmpt keeps next to a trace as <ptfile>.idx and a small
+ * reader for it.
+ *
+ * A file starts with a struct vmpt_idx_header followed by one fixed-size
+ * struct vmpt_idx_entry per PSB in trace order.  All fields are in host byte
+ * order.  An entry holds the bundle state the decoder was in when it reached
+ * the PSB, so decoding can start at any PSB and produce the same bundles as
+ * a decode from the start of the trace.
+ *
+ * The header records the size and modification time of the trace the index
+ * was built from; an index that does not match its trace is stale.
+ */
+
+#ifndef VMPT_IDX_H
+#define VMPT_IDX_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define VMPT_IDX_MAGIC "VMPTINDX"
+#define VMPT_IDX_VERSION 2
+
+/* The bundle state flags in struct vmpt_idx_entry. */
+enum vmpt_idx_flags {
+    /* A PIP started a bundle. */
+    vif_pip = 1 << 0,
+
+    /* We saw the PADs that precede the VMCS. */
+    vif_pad = 1 << 1,
+
+    /* The bundle has a VMCS. */
+    vif_vmcs = 1 << 2,
+
+    /* The tsc field is valid, i.e. we saw a TSC before the PSB. */
+    vif_tsc = 1 << 3
+};
+
+/* The number of PADs counted so far is kept above the flags. */
+#define VMPT_IDX_PAD_SHIFT 8
+#define VMPT_IDX_PAD_MASK 0xfu
+
+struct vmpt_idx_header {
+    /* VMPT_IDX_MAGIC without the terminating zero. */
+    char magic[8];
+
+    /* The format version and the size of one entry in bytes. */
+    uint32_t version;
+    uint32_t entry_size;
+
+    /* The size and modification time in nanoseconds of the trace. */
+    uint64_t trace_size;
+    uint64_t trace_mtime;
+
+    uint64_t reserved[2];
+};
+
+/* The decoder state at one PSB. */
+struct vmpt_idx_entry {
+    /* The PSB's offset in the trace file. */
+    uint64_t offset;
+
+    /* The last TSC before the PSB. */
+    uint64_t tsc;
+
+    /* The cr3 and VMCS base of the bundle being put together. */
+    uint64_t cr3;
+    uint64_t vmcs_base;
+
+    /* The PIP packet's non-root bit and enum vmpt_idx_flags. */
+    uint32_t nr;
+    uint32_t flags;
+
+    /* The lowest and highest TSC of a bundle in the segment from this PSB
+     * to the next.  The TSC need not grow along the trace, e.g. in a
+     * wrapped ring buffer.  tsc_min is above tsc_max if there is none.
+     */
+    uint64_t tsc_min, tsc_max;
+};
+
+static inline uint64_t vmpt_idx_mtime(const struct stat *st)
+{
+    return (uint64_t) st->st_mtim.tv_sec * 1000000000ull +
+        (uint64_t) st->st_mtim.tv_nsec;
+}
+
+static inline void vmpt_idx_header_init(struct vmpt_idx_header *header,
+        const struct stat *st)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, VMPT_IDX_MAGIC, sizeof(header->magic));
+    header->version = VMPT_IDX_VERSION;
+    header->entry_size = sizeof(struct vmpt_idx_entry);
+    header->trace_size = (uint64_t) st->st_size;
+    header->trace_mtime = vmpt_idx_mtime(st);
+}
+
+/* A mapped index file. */
+struct vmpt_idx_file {
+    /* The entries in [begin, end). */
+    const struct vmpt_idx_entry *begin, *end;
+
+    /* The mapping. */
+    void *map;
+    size_t size;
+};
+
+/* Map the index at @path and check it against the trace described by @st.
+ *
+ * Returns zero on success, -ESTALE if the index does not match the trace,
+ * and another negative errno otherwise.
+ */
+static inline int vmpt_idx_open(struct vmpt_idx_file *file, const char *path,
+        const struct stat *st)
+{
+    const struct vmpt_idx_header *header;
+    struct stat ist;
+    size_t entries;
+    int fd, errcode;
+
+    if (!file || !path || !st)
+        return -EINVAL;
+
+    memset(file, 0, sizeof(*file));
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -errno;
+
+    if (fstat(fd, &ist) < 0) {
+        errcode = -errno;
+        goto out;
+    }
+
+    errcode = -EINVAL;
+    if ((uint64_t) ist.st_size < sizeof(*header) ||
+            (uint64_t) (size_t) ist.st_size != (uint64_t) ist.st_size)
+        goto out;
+
+    file->size = (size_t) ist.st_size;
+    file->map = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file->map == MAP_FAILED) {
+        file->map = NULL;
+        errcode = -errno;
+        goto out;
+    }
+
+    header = (const struct vmpt_idx_header *) file->map;
+    if (memcmp(header->magic, VMPT_IDX_MAGIC, sizeof(header->magic)) ||
+            header->version != VMPT_IDX_VERSION ||
+            header->entry_size != sizeof(struct vmpt_idx_entry))
+        goto out_unmap;
+
+    errcode = -ESTALE;
+    if (header->trace_size != (uint64_t) st->st_size ||
+            header->trace_mtime != vmpt_idx_mtime(st))
+        goto out_unmap;
+
+    entries = (file->size - sizeof(*header)) / sizeof(*file->begin);
+    file->begin = (const struct vmpt_idx_entry *) (header + 1);
+    file->end = file->begin + entries;
+
+    errcode = 0;
+    goto out;
+
+out_unmap:
+    munmap(file->map, file->size);
+    file->map = NULL;
+
+out:
+    close(fd);
+    return errcode;
+}
+
+static inline void vmpt_idx_close(struct vmpt_idx_file *file)
+{
+    if (!file)
+        return;
+
+    if (file->map)
+        munmap(file->map, file->size);
+
+    memset(file, 0, sizeof(*file));
+}
+
+#endif /* VMPT_IDX_H */
@@ -0,0 +1,109 @@
+/*
+ * vmpt-read.c
+ *
+ * Print the bundles in a binary bundle file written by vmpt --format=bin or
+ * --format=packed.
+ */
+
+#include "vmpt-bin.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+static int usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [--count] <bundles.bin|bundles.vpk>\n",
+            name);
+    return -1;
+}
+
+static void print_record(const struct vmpt_bin_record *record)
+{
+    printf("%" PRIx64 " %" PRIx64 " %" PRIx64 " %u\n", record->tsc,
+            record->vmcs_base, record->cr3, record->nr);
+}
+
+/* Print or, if @count, count the records in the packed file @path.
+ *
+ * Returns zero on success, a negative errno otherwise.
+ */
+static int read_packed(const char *path, int count)
+{
+    struct vmpt_pack_file file;
+    struct vmpt_bin_record record;
+    size_t records;
+    int errcode;
+
+    errcode = vmpt_pack_open(&file, path);
+    if (errcode < 0)
+        return errcode;
+
+    if (!count)
+        printf("tsc vmcs cr3 nr\n");
+
+    records = 0;
+    while ((errcode = vmpt_pack_next(&file, &record)) > 0) {
+        if (count)
+            records += 1;
+        else
+            print_record(&record);
+    }
+
+    if (count && !errcode)
+        printf("%zu\n", records);
+
+    vmpt_pack_close(&file);
+    return errcode;
+}
+
+int main(int argc, char *argv[])
+{
+    const struct vmpt_bin_record *record;
+    struct vmpt_bin_file file;
+    const char *path;
+    int errcode, count, idx;
+
+    path = NULL;
+    count = 0;
+    for (idx = 1; idx < argc; ++idx) {
+        if (strcmp(argv[idx], "--count") == 0)
+            count = 1;
+        else if (!path && strncmp(argv[idx], "-", 1) != 0)
+            path = argv[idx];
+        else
+            return usage(argv[0]);
+    }
+
+    if (!path)
+        return usage(argv[0]);
+
+    errcode = vmpt_bin_open(&file, path);
+    if (errcode == -EINVAL) {
+        errcode = read_packed(path, count);
+        if (errcode < 0) {
+            fprintf(stderr, "%s: failed to read %s: %s.\n", argv[0], path,
+                    strerror(-errcode));
+            return -1;
+        }
+
+        return 0;
+    }
+
+    if (errcode < 0) {
+        fprintf(stderr, "%s: failed to read %s: %s.\n", argv[0], path,
+                strerror(-errcode));
+        return -1;
+    }
+
+    if (count)
+        printf("%zu\n", (size_t) (file.end - file.begin));
+    else {
+        printf("tsc vmcs cr3 nr\n");
+        for (record = file.begin; record < file.end; ++record)
+            print_record(record);
+    }
+
+    vmpt_bin_close(&file);
+    return 0;
+}
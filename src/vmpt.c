@@ -32,23 +32,163 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include "intel-pt.h"
+/* For cpu_set_t and pthread_setaffinity_np(). */
+#define _GNU_SOURCE
+
+#include "libvmpt.h"
+#include "vmpt-bin.h"
+#include "vmpt-idx.h"
 
 #include <stdlib.h>
 #include <stdarg.h>
 #include <inttypes.h>
 #include <string.h>
 #include <stdio.h>
+#include <math.h>
+#include <limits.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/perf_event.h>
+
+#ifdef HAVE_LIBURING
+#  include <liburing.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#  include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#  include <lz4frame.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <immintrin.h>
+#  define VMPT_X86 1
+#endif
 
 static int usage(const char *name)
 {
     fprintf(stderr,
-            "usage: %s <ptfile>\n",
+            "usage: %s [<options>] <ptfile>[:<from>[-<to>]]...\n",
             name);
     return -1;
 }
 
+static int help(const char *name)
+{
+    printf("usage: %s [<options>] <ptfile>[:<from>[-<to>]]...\n\n", name);
+    printf("options:\n");
+    printf("  --help|-h         this text.\n");
+    printf("  --no-mmap         read the trace into memory instead of "
+            "mapping it.\n");
+    printf("  --huge-pages      ask for transparent huge pages on the "
+            "trace buffer.\n");
+    printf("  --format=json     write bundles to bundles.json (default).\n");
+    printf("  --format=bin      write fixed-size bundle records to "
+            "bundles.bin.\n");
+    printf("  --format=perfetto write VMCS residency slices to "
+            "bundles.pftrace for the\n");
+    printf("                    Perfetto UI.\n");
+    printf("  --format=packed   write bundles to bundles.vpk with interned "
+            "VMCS bases and\n");
+    printf("                    cr3s and TSC deltas.\n");
+    printf("  -o|--output <out> write to <out> instead of bundles.json: a "
+            "file, - for\n");
+    printf("                    stdout, or unix:<path> for a listening "
+            "Unix socket.\n");
+    printf("  --compact         write bundles.json without whitespace.\n");
+    printf("  --compress=zstd|lz4\n");
+    printf("                    compress the output on the writer thread "
+            "and add .zst or\n");
+    printf("                    .lz4 to the default file name.\n");
+    printf("  --compress-level <n>\n");
+    printf("                    the compression level (default: 3 for zstd, "
+            "0 for lz4).\n");
+    printf("  --ring <n>        keep the last <n> bundles in a flight "
+            "recorder and write them\n");
+    printf("                    to ring.bin at the end and to ring.bin.<k> "
+            "on SIGUSR1.\n");
+    printf("  --ring-ticks <t>  only keep bundles up to <t> TSC ticks older "
+            "than the newest.\n");
+    printf("  --trigger-hold <t>\n");
+    printf("                    dump the ring when a VMCS holds the cpu for "
+            "more than <t>\n");
+    printf("                    TSC ticks.\n");
+    printf("  --aggregate       write per-VMCS residency statistics to "
+            "aggregate.json\n");
+    printf("                    instead of bundles.\n");
+    printf("  --stats[=text|json]\n");
+    printf("                    print packet counts, throughput, memory and "
+            "resyncs to stderr.\n");
+    printf("  -j|--jobs <n>     decode PSB segments on <n> threads.\n");
+    printf("  --cpus <list>     run on the cpus in <list>, e.g. 0-3,8, and "
+            "pin -j and\n");
+    printf("                    multi-trace workers to them, spread over "
+            "NUMA nodes.\n");
+    printf("  --prefilter[=scalar|avx2|avx512]\n");
+    printf("                    skip PSB segments without interesting "
+            "packets using a\n");
+    printf("                    vectorized scan.\n");
+    printf("  --sample <n>      only decode every <n>-th PSB segment; "
+            "--aggregate scales\n");
+    printf("                    its results to the whole trace and adds "
+            "error bounds.\n");
+    printf("  --live <cpu>      trace <cpu> with perf and decode the trace "
+            "as it comes in.\n");
+    printf("  --aux-size <size> the size of the live AUX buffer (default: "
+            "4m).\n");
+    printf("  --duration <sec>  stop live tracing after <sec> seconds.\n");
+    printf("  --index           build the PSB index <ptfile>.idx of each "
+            "trace and exit.\n");
+    printf("  --tsc-range <a>[-<b>]\n");
+    printf("                    only decode bundles with a TSC in [a, b] "
+            "using the PSB\n");
+    printf("                    index, which is built if needed.\n");
+    printf("  --cache <dir>     keep decoded traces and their PSB indices in "
+            "<dir> and write\n");
+    printf("                    the output from there when a trace is "
+            "decoded again.\n");
+    printf("  --checkpoint <file> record where decoding stopped in <file>.\n");
+    printf("  --resume          continue from the --checkpoint: only decode "
+            "what was\n");
+    printf("                    appended to the trace and append to the "
+            "output.\n");
+    printf("  --write-queue <n> queue up to <n> output buffers for a writer "
+            "thread (default:\n");
+    printf("                    4); 0 writes on the decode thread.\n");
+    printf("  --window <size>   decode the trace in windows of <size> "
+            "bytes (k, m, g\n");
+    printf("                    suffixes allowed) to bound memory "
+            "usage.\n");
+    printf("\n");
+    printf("<ptfile>[:<from>[-<to>]] load the processor trace from "
+            "<ptfile>.\n");
+    printf("                  an optional offset or range can be given.\n");
+    printf("                  several traces (or a directory of traces), "
+            "e.g. one per cpu,\n");
+    printf("                  are decoded in parallel and their bundles "
+            "are merged in\n");
+    printf("                  TSC order.\n");
+
+    return 0;
+}
+
 static int no_file_error(const char *name)
 {
     fprintf(stderr, "%s: No processor trace file specified.\n", name);
@@ -85,18 +225,129 @@ static int parse_range(char *arg, uint64_t *begin, uint64_t *end)
 
     return 0;
 }
-static int load_file(uint8_t **buffer, size_t *size, char *arg,
+struct vmpt_options {
+    /* Read the trace into anonymous memory instead of mapping it. */
+    int no_mmap;
+
+    /* Ask for transparent huge pages on the trace buffer. */
+    int huge_pages;
+
+    /* Decode the trace in windows of this many bytes (zero for off). */
+    uint64_t window;
+
+    /* The number of threads decoding PSB segments in parallel. */
+    int jobs;
+
+    /* Write the JSON output without whitespace. */
+    int compact;
+
+    /* The output format. */
+    const struct bundle_format *format;
+
+    /* Where the output goes - the format's file if NULL.  See
+     * open_output().
+     */
+    const char *output;
+
+    /* Skip PSB segments without interesting packets (enum prefilter_mode). */
+    int prefilter;
+
+    /* Only decode every this many PSB segments (zero for off). */
+    uint64_t sample;
+
+    /* Keep the last ring bundles in a flight recorder (zero for off), only
+     * those up to ring_ticks TSC ticks older than the newest (zero for
+     * all), and dump it when a VMCS holds the cpu for longer than
+     * ring_trigger ticks (zero for never).  See struct flight_ring.
+     */
+    uint64_t ring, ring_ticks, ring_trigger;
+
+    /* Print decode statistics to stderr (enum stats_mode). */
+    int stats;
+
+    /* Build the PSB index of each trace and exit. */
+    int index;
+
+    /* The number of output buffers queued for the writer thread - zero to
+     * write on the decode thread.
+     */
+    int write_queue;
+
+    /* The output compression (enum writer_codec) and level (negative for
+     * the codec's default).
+     */
+    int compress;
+    int compress_level;
+
+    /* Only write bundles whose TSC is in [tsc_begin, tsc_end] - found via
+     * the PSB index.
+     */
+    int tsc_range;
+    uint64_t tsc_begin, tsc_end;
+
+    /* Record the state at the last PSB in this file, and continue from it
+     * if we resume.  See struct vmpt_checkpoint.
+     */
+    const char *checkpoint;
+    int resume;
+
+    /* Keep decoded traces in this directory and write the output from there
+     * when we decode a trace again (NULL for off).  See struct vmpt_cache.
+     */
+    const char *cache;
+
+    /* The cpus we may run on, in the order workers are pinned to them - all
+     * cpus if ncpus is zero.  See cpu_order().
+     */
+    int cpus[CPU_SETSIZE];
+    int ncpus;
+
+    /* Trace this cpu live instead of reading a trace file (-1 for off). */
+    int live_cpu;
+
+    /* The size of the live AUX buffer and how many seconds to trace (zero
+     * to trace until interrupted).
+     */
+    uint64_t aux_size;
+    unsigned int duration;
+};
+
+/* The default size of the AUX buffer for live tracing. */
+static const uint64_t default_aux_size = 4ull * 1024ull * 1024ull;
+
+/* The number of data pages we map for live tracing.  We only need them for
+ * PERF_RECORD_AUX records.
+ */
+static const size_t live_data_pages = 16;
+
+/* The window for compressed traces if --window was not given. */
+static const uint64_t default_window = 16ull * 1024ull * 1024ull;
+
+/* The smallest window we accept for streaming decode. */
+static const uint64_t min_window = 4096ull;
+
+/* The smallest trace segment we hand to a worker for parallel decode. */
+static const uint64_t min_segment = 64ull * 1024ull;
+
+/* The number of segments per worker we split the trace into. */
+static const uint64_t segments_per_job = 4ull;
+
+/* The initial size of a segment's formatted output; it grows as needed. */
+static const size_t segment_output = 64 * 1024;
+
+/* Open @arg and determine the [@begin, @end) file range to decode.
+ *
+ * Returns the file descriptor on success, a negative value otherwise.
+ */
+static int open_file(uint64_t *begin, uint64_t *end, char *arg,
         const char *prog)
 {
-    uint64_t begin_arg, end_arg;
-    uint8_t *content;
-    size_t read;
-    FILE *file;
-    long fsize, begin, end;
-    int errcode;
+    uint64_t fsize;
+    struct stat st;
+    int errcode, fd;
     char *range;
 
-    if (!buffer || !size || !arg || !prog) {
+    if (!begin || !end || !arg || !prog) {
         fprintf(stderr, "%s: internal error.\n", prog ? prog : "");
         return -1;
     }
@@ -108,296 +359,7528 @@ static int load_file(uint8_t **buffer, size_t *size, char *arg,
     }
 
     errno = 0;
-    file = fopen(arg, "rb");
-    if (!file) {
+    fd = open(arg, O_RDONLY);
+    if (fd < 0) {
         fprintf(stderr, "%s: failed to open %s: %d.\n",
                 prog, arg, errno);
         return -1;
     }
 
-    errcode = fseek(file, 0, SEEK_END);
-    if (errcode) {
+    errcode = fstat(fd, &st);
+    if (errcode < 0 || st.st_size < 0) {
         fprintf(stderr, "%s: failed to determine size of %s: %d.\n",
                 prog, arg, errno);
         goto err_file;
     }
 
-    fsize = ftell(file);
-    if (fsize < 0) {
-        fprintf(stderr, "%s: failed to determine size of %s: %d.\n",
-                prog, arg, errno);
-        goto err_file;
-    }
+    fsize = (uint64_t) st.st_size;
 
-    begin_arg = 0ull;
-    end_arg = (uint64_t) fsize;
-    errcode = parse_range(range, &begin_arg, &end_arg);
+    *begin = 0ull;
+    *end = fsize;
+    errcode = parse_range(range, begin, end);
     if (errcode < 0) {
         fprintf(stderr, "%s: bad range: %s.\n", prog, range);
         goto err_file;
     }
 
-    begin = (long) begin_arg;
-    end = (long) end_arg;
-    if ((uint64_t) begin != begin_arg || (uint64_t) end != end_arg) {
+    if ((uint64_t) (off_t) *begin != *begin || (size_t) (*end - *begin) !=
+            *end - *begin) {
         fprintf(stderr, "%s: invalid offset/range argument.\n", prog);
         goto err_file;
     }
 
-    if (fsize <= begin) {
-        fprintf(stderr, "%s: offset 0x%lx outside of %s.\n",
-                prog, begin, arg);
+    if (fsize <= *begin) {
+        fprintf(stderr, "%s: offset 0x%" PRIx64 " outside of %s.\n",
+                prog, *begin, arg);
         goto err_file;
     }
 
-    if (fsize < end) {
-        fprintf(stderr, "%s: range 0x%lx outside of %s.\n",
-                prog, end, arg);
+    if (fsize < *end) {
+        fprintf(stderr, "%s: range 0x%" PRIx64 " outside of %s.\n",
+                prog, *end, arg);
         goto err_file;
     }
 
-    if (end <= begin) {
+    if (*end <= *begin) {
         fprintf(stderr, "%s: bad range.\n", prog);
         goto err_file;
     }
 
-    fsize = end - begin;
+    return fd;
 
-    content = malloc(fsize);
-    if (!content) {
-        fprintf(stderr, "%s: failed to allocated memory %s.\n",
-                prog, arg);
-        goto err_file;
-    }
+err_file:
+    close(fd);
+    return -1;
+}
 
-    errcode = fseek(file, begin, SEEK_SET);
-    if (errcode) {
-        fprintf(stderr, "%s: failed to load %s: %d.\n",
-                prog, arg, errno);
-        goto err_content;
-    }
+/* Load [@begin, @end) of @fd, which was opened for @arg. */
+static int load_range(struct vmpt_trace *tb, int fd, uint64_t begin,
+        uint64_t end, const struct vmpt_options *options, const char *arg,
+        const char *prog)
+{
+    unsigned int flags;
+    int errcode;
 
-    read = fread(content, fsize, 1, file);
-    if (read != 1) {
-        fprintf(stderr, "%s: failed to load %s: %d.\n",
-                prog, arg, errno);
-        goto err_content;
-    }
+    flags = 0u;
+    if (options->no_mmap)
+        flags |= vtf_read;
+    if (options->huge_pages)
+        flags |= vtf_huge_pages;
 
-    fclose(file);
+    errno = 0;
+    errcode = vmpt_trace_load(tb, fd, begin, end, flags);
+    if (errcode < 0) {
+        fprintf(stderr, "%s: failed to load %s: %d.\n", prog, arg, errno);
+        return errcode;
+    }
 
-    *buffer = content;
-    *size = fsize;
+    if (options->huge_pages && tb->map && !tb->huge_pages)
+        fprintf(stderr, "%s: no huge pages for %s.\n", prog, arg);
 
     return 0;
-
-err_content:
-    free(content);
-
-err_file:
-    fclose(file);
-    return -1;
 }
 
-static int load_pt(struct pt_config *config, char *arg, const char *prog)
+static int parse_size(const char *arg, uint64_t *size)
 {
-    uint8_t *buffer;
-    size_t size;
-    int errcode;
+    uint64_t value;
+    char *rest;
 
-    errcode = load_file(&buffer, &size, arg, prog);
-    if (errcode < 0)
-        return errcode;
+    if (!arg)
+        return -1;
+
+    errno = 0;
+    value = strtoull(arg, &rest, 0);
+    if (errno || rest == arg)
+        return -1;
+
+    switch (*rest) {
+    case 'g':
+    case 'G':
+        value <<= 10;
+        /* Fall through. */
+    case 'm':
+    case 'M':
+        value <<= 10;
+        /* Fall through. */
+    case 'k':
+    case 'K':
+        value <<= 10;
+        rest += 1;
+        break;
+    }
 
-    config->begin = buffer;
-    config->end = buffer + size;
+    if (*rest)
+        return -1;
 
+    *size = value;
     return 0;
 }
 
+/* Report @errstr to stderr, out of the way of the output. */
 static int diag(const char *errstr, uint64_t offset, int errcode)
 {
     if (errcode)
-        printf("[%" PRIx64 ": %s: %s]\n", offset, errstr,
+        fprintf(stderr, "[%" PRIx64 ": %s: %s]\n", offset, errstr,
                 pt_errstr(pt_errcode(errcode)));
     else
-        printf("[%" PRIx64 ": %s]\n", offset, errstr);
+        fprintf(stderr, "[%" PRIx64 ": %s]\n", offset, errstr);
 
     return errcode;
 }
 
-/* State flags */
-int got_pip, got_pad, got_vmcs, pad_cnt, pkt_cnt = 0;
+/* The CLOCK_MONOTONIC time in nanoseconds. */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
 
-/* JSONify the output */
-FILE* fp = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
 
-static int dump_bundle(uint64_t offset, const struct pt_packet *packet,
-        const struct pt_config *config)
+/* Parse a cpu list like 0-3,8 into @set.
+ *
+ * Returns zero on success and -1 otherwise.
+ */
+static int parse_cpus(const char *arg, cpu_set_t *set)
 {
-    int errcode;
+    CPU_ZERO(set);
+    for (;;) {
+        unsigned long first, last;
+        char *rest;
 
-    switch (packet->type){
-        case ppt_pip:
-            if (got_pip == 0)
-            {
-                fprintf(fp, "\t{\n");
-                fprintf(fp, "\t\t\"packet\": [\n");
-                fprintf(fp, "\t\t\t{\n\t\t\t\t\"id\": \"PIP\","
-                        "\n\t\t\t\t\"payload\": %"PRIx64","
-                        "\n\t\t\t\t\"nr\": %d\n\t\t\t},\n",
-                        packet->payload.pip.cr3, packet->payload.pip.nr);
+        errno = 0;
+        first = last = strtoul(arg, &rest, 10);
+        if (errno || rest == arg)
+            return -1;
 
-                got_pip = 1;
-            }
-            return 0;
+        if (*rest == '-') {
+            arg = rest + 1;
+            last = strtoul(arg, &rest, 10);
+            if (errno || rest == arg || last < first)
+                return -1;
+        }
 
-        case ppt_pad:
-            if ((got_pip == 1) && (pad_cnt < 8))
-            {
-                pad_cnt++;
-            }
-            if (pad_cnt == 8)
-            {
-                pad_cnt = 0;
-                got_pad = 1;
-            }
-            return 0;
+        if (CPU_SETSIZE <= last)
+            return -1;
 
-        case ppt_vmcs:
-            if ((got_pad == 1) && (got_pip == 1))
-            {
-                fprintf(fp, "\t\t\t{\n\t\t\t\t\"id\": \"VMCS\","
-                        "\n\t\t\t\t\"payload\": %"PRIx64"\n\t\t\t},\n", 
-                        packet->payload.vmcs.base);
-                got_vmcs = 1;
-            }
-            return 0;
+        for (; first <= last; ++first)
+            CPU_SET(first, set);
 
-        case ppt_tsc:
-            if ((got_pip == 1) && (got_vmcs == 1))
-            {
-                fprintf(fp, "\t\t\t{\n\t\t\t\t\"id\": \"TSC\","
-                        "\n\t\t\t\t\"payload\": %"PRIx64"\n\t\t\t}\n", 
-                        packet->payload.tsc.tsc);
-                got_pip = 0;
-                got_vmcs = 0;
-                fprintf(fp, "\t\t]\n\t},\n");
-            }
+        if (!*rest)
             return 0;
+
+        if (*rest != ',')
+            return -1;
+
+        arg = rest + 1;
     }
+}
+
+/* The NUMA node of @cpu, or zero if we cannot tell. */
+static int cpu_node(int cpu)
+{
+    struct dirent *entry;
+    char path[64];
+    int node;
+    DIR *dir;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    dir = opendir(path);
+    if (!dir)
+        return 0;
+
+    node = 0;
+    while ((entry = readdir(dir)) != NULL)
+        if (sscanf(entry->d_name, "node%d", &node) == 1)
+            break;
 
+    closedir(dir);
+    return node;
 }
 
-static int dump_packets(struct pt_packet_decoder *decoder,
-        const struct pt_config *config)
+/* A cpu, its NUMA node and the number of cpus of that node before it. */
+struct cpu_slot {
+    int cpu, node, rank;
+};
+
+static int cpu_compare(const void *lhs, const void *rhs)
 {
-    uint64_t offset;
-    int errcode;
+    const struct cpu_slot *left, *right;
 
-    offset = 0ull;
-    for (;;) {
-        struct pt_packet packet;
+    left = lhs;
+    right = rhs;
+    if (left->rank != right->rank)
+        return left->rank - right->rank;
 
-        errcode = pt_pkt_get_offset(decoder, &offset);
-        if (errcode < 0)
-            return diag("error getting offset", offset, errcode);
+    if (left->node != right->node)
+        return left->node - right->node;
 
-        errcode = pt_pkt_next(decoder, &packet, sizeof(packet));
-        if (errcode < 0) {
-            if (errcode == -pte_eos)
-                return 0;
+    return left->cpu - right->cpu;
+}
 
-            return diag("error decoding packet", offset, errcode);
-        }
+/* Put the cpus in @set into @cpus so that consecutive ones are on
+ * different NUMA nodes as long as there are cpus on more than one node.
+ * Workers take the cpus in turn, so they spread over the nodes.
+ *
+ * Returns the number of cpus on success and a negative pt_error_code
+ * otherwise.
+ */
+static int cpu_order(int *cpus, const cpu_set_t *set)
+{
+    struct cpu_slot *slots;
+    int cpu, idx, ncpus;
 
-        errcode = dump_bundle(offset, &packet,
-                config);
-        if (errcode < 0)
-            return errcode;
+    slots = calloc(CPU_SETSIZE, sizeof(*slots));
+    if (!slots)
+        return -pte_nomem;
+
+    ncpus = 0;
+    for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, set))
+            continue;
+
+        slots[ncpus].cpu = cpu;
+        slots[ncpus].node = cpu_node(cpu);
+        for (idx = 0; idx < ncpus; ++idx)
+            if (slots[idx].node == slots[ncpus].node)
+                slots[ncpus].rank += 1;
+
+        ncpus += 1;
     }
+
+    qsort(slots, (size_t) ncpus, sizeof(*slots), cpu_compare);
+    for (idx = 0; idx < ncpus; ++idx)
+        cpus[idx] = slots[idx].cpu;
+
+    free(slots);
+    return ncpus;
+}
+
+/* Pin the calling thread, our @worker-th worker, to its --cpus cpu.
+ *
+ * A worker pinned before it touches its part of the trace has the pages it
+ * reads, maps or decompresses the trace into allocated on its own node.
+ */
+static void pin_worker(const struct vmpt_options *options, size_t worker)
+{
+    cpu_set_t set;
+
+    if (!options->ncpus)
+        return;
+
+    CPU_ZERO(&set);
+    CPU_SET(options->cpus[worker % (size_t) options->ncpus], &set);
+
+    /* The cpu is one we are allowed to run on, but if the pinning fails
+     * anyhow, the worker runs where the scheduler puts it.
+     */
+    (void) pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/* The size of the output buffer.  We write it out whenever it fills up. */
+static const size_t writer_size = 1024 * 1024;
+
+/* The default number of output buffers queued for the writer thread. */
+static const int default_write_queue = 4;
+
+/* How the output is compressed. */
+enum writer_codec {
+    wc_none,
+    wc_zstd,
+    wc_lz4
+};
+
+/* The name and file name suffix of each codec. */
+static const char * const codec_name[] = {
+    "none",
+    "zstd",
+    "lz4"
+};
+
+static const char * const codec_suffix[] = {
+    "",
+    ".zst",
+    ".lz4"
+};
+
+/* The default compression levels. */
+static const int default_zstd_level = 3;
+static const int default_lz4_level = 0;
+
+/* An output buffer queued for the writer thread. */
+struct writer_slot {
+    char *buf;
+
+    /* The number of bytes to write - zero tells the thread to stop. */
+    size_t len;
+
+#ifdef HAVE_LIBURING
+    /* The file offset the buffer is written to. */
+    uint64_t offset;
+#endif
+};
+
+/* A buffered output writer.
+ *
+ * We format bundles ourselves into a single reusable buffer and write() it
+ * out in large blocks.  This avoids format string parsing and stdio locking
+ * in the decode loop.
+ *
+ * After writer_start(), full buffers are handed to a writer thread instead,
+ * so the decoder does not wait for the disk.  The buffers form a ring that is
+ * filled by the decoder and drained by the writer thread in order.  Each side
+ * only touches its own end of the ring; a pair of counting semaphores hands
+ * buffers back and forth, which costs an atomic operation unless one side
+ * has to sleep.  The ring size bounds how far the decoder can run ahead.
+ */
+struct vmpt_writer {
+    /* The buffer and the number of bytes in use. */
+    char *buf;
+    size_t len, size;
+
+    /* The file descriptor we write to. */
+    int fd;
+
+    /* Grow buf instead of writing it out, to put output together in memory.
+     * See writer_init_memory().
+     */
+    int grow;
+
+    /* The errno of the first failed write - zero if all went well. */
+    int error;
+
+    /* The number of bytes written and the time spent writing them. */
+    uint64_t written, write_ns;
+
+    /* The output offset of buf.  See writer_tell(). */
+    uint64_t pos;
+
+    /* The time the decoder waited for output to be written. */
+    uint64_t stall_ns;
+
+    /* The output compression (enum writer_codec), its state, and the
+     * buffer it compresses into.  See writer_compress().
+     */
+    int codec;
+    void *cctx;
+    char *cbuf;
+    size_t csize;
+
+    /* The bytes handed to the compressor and the time spent compressing. */
+    uint64_t raw, compress_ns;
+
+    /* The ring of buffers, the decoder's and the writer thread's position
+     * in it, and the number of filled and free buffers.  Only used with a
+     * writer thread.
+     */
+    struct writer_slot *slots;
+    size_t nslots, head, tail;
+    sem_t filled, free;
+    pthread_t thread;
+};
+
+static int writer_init(struct vmpt_writer *w, int fd, size_t size)
+{
+    memset(w, 0, sizeof(*w));
+
+    w->buf = malloc(size);
+    if (!w->buf)
+        return -pte_nomem;
+
+    w->size = size;
+    w->fd = fd;
+
+    return 0;
 }
 
-static int dump_sync(struct pt_packet_decoder *decoder,
-        const struct pt_config *config)
+/* Set up @w to collect its output in a buffer of initially @size bytes.
+ *
+ * The buffer grows as needed; w->buf and w->len hold the output.  If it
+ * cannot grow, the output is dropped and w->error is set.
+ */
+static int writer_init_memory(struct vmpt_writer *w, size_t size)
 {
     int errcode;
 
-    errcode = pt_pkt_sync_set(decoder, 0ull);
-    if (errcode < 0)
-        return diag("sync error", 0ull, errcode);
-    errcode = pt_pkt_sync_forward(decoder);
+    errcode = writer_init(w, -1, size);
     if (errcode < 0)
-        return diag("sync error", 0ull, errcode);
+        return errcode;
 
-    for (;;) {
-        errcode = dump_packets(decoder, config);
-        if (!errcode)
-            break;
+    w->grow = 1;
+    return 0;
+}
 
-        errcode = pt_pkt_sync_forward(decoder);
-        if (errcode < 0)
-            return diag("sync error", 0ull, errcode);
+/* Double the buffer of the memory writer @w. */
+static int writer_grow(struct vmpt_writer *w)
+{
+    char *buf;
 
+    buf = w->error ? NULL : realloc(w->buf, w->size * 2);
+    if (!buf) {
+        w->error = ENOMEM;
+        w->len = 0;
+        return -1;
     }
 
-    return errcode;
+    w->buf = buf;
+    w->size *= 2;
+    return 0;
 }
 
-static int dump(const struct pt_config *config)
+/* Write @len bytes at @buf to @w's file descriptor. */
+static void writer_write(struct vmpt_writer *w, const char *buf, size_t len)
 {
-    struct pt_packet_decoder *decoder;
-    int errcode;
+    uint64_t start;
+    size_t done;
 
-    decoder = pt_pkt_alloc_decoder(config);
-    if (!decoder)
-        return diag("failed to allocate decoder", 0ull, 0);
+    start = now_ns();
+    for (done = 0; done < len;) {
+        ssize_t written;
 
-    errcode = dump_sync(decoder, config);
+        written = write(w->fd, buf + done, len - done);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
 
-    pt_pkt_free_decoder(decoder);
-    return errcode;
+            __atomic_store_n(&w->error, errno, __ATOMIC_RELAXED);
+            break;
+        }
+
+        done += (size_t) written;
+    }
+
+    w->written += done;
+    w->write_ns += now_ns() - start;
 }
 
+/* Free @w's compression state.  The codec stays set for --stats. */
+static void writer_free_codec(struct vmpt_writer *w)
+{
+    switch (w->codec) {
+#ifdef HAVE_ZSTD
+    case wc_zstd:
+        ZSTD_freeCCtx(w->cctx);
+        break;
+#endif
 
-int main(int argc, char *argv[])
+#ifdef HAVE_LZ4
+    case wc_lz4:
+        LZ4F_freeCompressionContext(w->cctx);
+        break;
+#endif
+
+    default:
+        break;
+    }
+
+    free(w->cbuf);
+    w->cbuf = NULL;
+    w->cctx = NULL;
+}
+
+/* Compress @len bytes at @buf and write the result.
+ *
+ * With @end non-zero, this finishes the compressed stream.  We compress on
+ * whichever thread writes, i.e. on the writer thread after writer_start().
+ */
+static void writer_compress(struct vmpt_writer *w, const char *buf,
+        size_t len, int end)
 {
-    struct pt_config config;
-    int errcode, idx;
-    char *ptfile;
+    uint64_t start;
 
-    ptfile = NULL;
+    start = now_ns();
+    w->raw += len;
 
-    memset(&config, 0, sizeof(config));
-    pt_config_init(&config);
+    switch (w->codec) {
+#ifdef HAVE_ZSTD
+    case wc_zstd: {
+        ZSTD_inBuffer in;
+        size_t remaining;
 
-    for (idx = 1; idx < argc; ++idx) {
-        if (strncmp(argv[idx], "-", 1) != 0) {
-            ptfile = argv[idx];
-            if (idx < (argc-1))
-                return usage(argv[0]);
+        in.src = buf;
+        in.size = len;
+        in.pos = 0;
+        do {
+            ZSTD_outBuffer out;
+
+            out.dst = w->cbuf;
+            out.size = w->csize;
+            out.pos = 0;
+
+            remaining = ZSTD_compressStream2(w->cctx, &out, &in,
+                    end ? ZSTD_e_end : ZSTD_e_continue);
+            if (ZSTD_isError(remaining)) {
+                __atomic_store_n(&w->error, EIO, __ATOMIC_RELAXED);
+                break;
+            }
+
+            w->compress_ns += now_ns() - start;
+            writer_write(w, w->cbuf, out.pos);
+            start = now_ns();
+        } while (in.pos < in.size || (end && remaining));
+    }
+        break;
+#endif
+
+#ifdef HAVE_LZ4
+    case wc_lz4: {
+        size_t size;
+
+        size = len ? LZ4F_compressUpdate(w->cctx, w->cbuf, w->csize, buf, len,
+                NULL) : 0;
+        if (!LZ4F_isError(size) && end) {
+            size_t tail;
+
+            tail = LZ4F_compressEnd(w->cctx, w->cbuf + size, w->csize - size,
+                    NULL);
+            size = LZ4F_isError(tail) ? tail : size + tail;
+        }
+
+        if (LZ4F_isError(size)) {
+            __atomic_store_n(&w->error, EIO, __ATOMIC_RELAXED);
             break;
         }
+
+        w->compress_ns += now_ns() - start;
+        writer_write(w, w->cbuf, size);
+        start = now_ns();
     }
+        break;
+#endif
 
-    if (!ptfile)
-        return no_file_error(argv[0]);
+    default:
+        break;
+    }
 
-    errcode = pt_cpu_errata(&config.errata, &config.cpu);
-    if (errcode < 0)
-        diag("failed to determine errata", 0ull, errcode);
+    w->compress_ns += now_ns() - start;
+}
 
-    errcode = load_pt(&config, ptfile, argv[0]);
-    if (errcode < 0)
-        return errcode;
+/* Compress the output of @w with @codec at @level.
+ *
+ * This must be called before anything is written.  Returns zero on success,
+ * -pte_not_supported if we were built without @codec, and a negative
+ * pt_error_code otherwise.
+ */
+static int writer_set_codec(struct vmpt_writer *w, int codec, int level)
+{
+#if defined(HAVE_ZSTD) || defined(HAVE_LZ4)
+    int errcode;
+#endif
+
+    switch (codec) {
+    case wc_none:
+        return 0;
+
+#ifdef HAVE_ZSTD
+    case wc_zstd:
+        w->cctx = ZSTD_createCCtx();
+        if (!w->cctx)
+            return -pte_nomem;
+
+        w->codec = codec;
+        errcode = -pte_invalid;
+        if (ZSTD_isError(ZSTD_CCtx_setParameter(w->cctx,
+                        ZSTD_c_compressionLevel, level)))
+            goto err;
+
+        errcode = -pte_nomem;
+        w->csize = ZSTD_CStreamOutSize();
+        w->cbuf = malloc(w->csize);
+        if (!w->cbuf)
+            goto err;
+
+        return 0;
+#endif
+
+#ifdef HAVE_LZ4
+    case wc_lz4: {
+        LZ4F_compressionContext_t cctx;
+        LZ4F_preferences_t prefs;
+        size_t size;
+
+        if (LZ4F_isError(LZ4F_createCompressionContext(&cctx,
+                        LZ4F_VERSION)))
+            return -pte_nomem;
+
+        w->cctx = cctx;
+        w->codec = codec;
 
-    fp = fopen("bundles.json", "w+");
-    fprintf(fp, "\"bundle\": [\n");
-    errcode = dump(&config);
-    fprintf(fp, "]\n");
-    fclose(fp);
+        memset(&prefs, 0, sizeof(prefs));
+        prefs.compressionLevel = level;
 
-    free(config.begin);
+        /* Room for one full buffer and the frame header and footer. */
+        errcode = -pte_nomem;
+        w->csize = LZ4F_compressBound(w->size, &prefs) + LZ4F_HEADER_SIZE_MAX;
+        w->cbuf = malloc(w->csize);
+        if (!w->cbuf)
+            goto err;
+
+        errcode = -pte_invalid;
+        size = LZ4F_compressBegin(cctx, w->cbuf, w->csize, &prefs);
+        if (LZ4F_isError(size))
+            goto err;
+
+        writer_write(w, w->cbuf, size);
+        return 0;
+    }
+#endif
+
+    default:
+        (void) level;
+        return -pte_not_supported;
+    }
+
+#if defined(HAVE_ZSTD) || defined(HAVE_LZ4)
+err:
+    writer_free_codec(w);
+    w->codec = wc_none;
+    return errcode;
+#endif
+}
+
+/* Whether we were built with support for @codec. */
+static int writer_has_codec(int codec)
+{
+    switch (codec) {
+    case wc_none:
+        return 1;
+
+#ifdef HAVE_ZSTD
+    case wc_zstd:
+        return 1;
+#endif
+
+#ifdef HAVE_LZ4
+    case wc_lz4:
+        return 1;
+#endif
+
+    default:
+        return 0;
+    }
+}
+
+/* Write @len bytes at @buf, compressed if so requested. */
+static void writer_output(struct vmpt_writer *w, const char *buf, size_t len)
+{
+    if (w->codec)
+        writer_compress(w, buf, len, 0);
+    else
+        writer_write(w, buf, len);
+}
+
+#ifdef HAVE_LIBURING
+/* Drain @w's ring with io_uring.
+ *
+ * We submit all buffers that are ready at once with explicit file offsets,
+ * so the kernel can work on several of them in parallel, and release them
+ * in ring order once the whole batch completed.  Returns a negative errno if
+ * the file is not seekable or io_uring is not available; the caller falls
+ * back to write().
+ */
+static int writer_uring(struct vmpt_writer *w)
+{
+    struct io_uring ring;
+    off_t pos;
+    int errcode;
+
+    pos = lseek(w->fd, 0, SEEK_CUR);
+    if (pos < 0)
+        return -errno;
+
+    errcode = io_uring_queue_init((unsigned int) w->nslots, &ring, 0);
+    if (errcode < 0)
+        return errcode;
+
+    for (;;) {
+        size_t batch, idx, stop;
+        uint64_t start;
+
+        sem_wait(&w->filled);
+        for (batch = 1; batch < w->nslots && !sem_trywait(&w->filled);)
+            ++batch;
+
+        start = now_ns();
+        for (idx = 0, stop = batch; idx < batch; ++idx) {
+            struct writer_slot *slot;
+            struct io_uring_sqe *sqe;
+
+            slot = &w->slots[(w->tail + idx) % w->nslots];
+            if (!slot->len) {
+                stop = idx;
+                break;
+            }
+
+            slot->offset = (uint64_t) pos;
+
+            sqe = io_uring_get_sqe(&ring);
+            io_uring_prep_write(sqe, w->fd, slot->buf,
+                    (unsigned int) slot->len, slot->offset);
+            io_uring_sqe_set_data(sqe, slot);
+            pos += (off_t) slot->len;
+        }
+
+        if (stop)
+            (void) io_uring_submit(&ring);
+
+        for (idx = 0; idx < stop; ++idx) {
+            struct io_uring_cqe *cqe;
+            struct writer_slot *slot;
+            size_t done;
+            int res;
+
+            if (io_uring_wait_cqe(&ring, &cqe) < 0)
+                break;
+
+            slot = io_uring_cqe_get_data(cqe);
+            res = cqe->res;
+            io_uring_cqe_seen(&ring, cqe);
+
+            done = res < 0 ? 0 : (size_t) res;
+            if (res < 0)
+                __atomic_store_n(&w->error, -res, __ATOMIC_RELAXED);
+
+            /* Finish a short write synchronously. */
+            while (done < slot->len && res >= 0) {
+                ssize_t written;
+
+                written = pwrite(w->fd, slot->buf + done, slot->len - done,
+                        (off_t) (slot->offset + done));
+                if (written <= 0) {
+                    __atomic_store_n(&w->error, written ? errno : EIO,
+                            __ATOMIC_RELAXED);
+                    break;
+                }
+
+                done += (size_t) written;
+            }
+
+            w->written += done;
+        }
+
+        w->write_ns += now_ns() - start;
+
+        for (idx = 0; idx < stop; ++idx) {
+            w->tail += 1;
+            sem_post(&w->free);
+        }
+
+        if (stop < batch)
+            break;
+    }
+
+    /* Leave the file position where write() would have left it. */
+    (void) lseek(w->fd, pos, SEEK_SET);
+    io_uring_queue_exit(&ring);
+
+    return 0;
+}
+#endif /* HAVE_LIBURING */
+
+static void *writer_thread(void *arg)
+{
+    struct vmpt_writer *w;
+
+    w = arg;
+
+#ifdef HAVE_LIBURING
+    /* We compress in order, one buffer at a time. */
+    if (!w->codec && writer_uring(w) >= 0)
+        return NULL;
+#endif
+
+    for (;;) {
+        struct writer_slot *slot;
+
+        sem_wait(&w->filled);
+
+        slot = &w->slots[w->tail % w->nslots];
+        if (!slot->len) {
+            if (w->codec)
+                writer_compress(w, NULL, 0, 1);
+            break;
+        }
+
+        writer_output(w, slot->buf, slot->len);
+
+        w->tail += 1;
+        sem_post(&w->free);
+    }
+
+    return NULL;
+}
+
+/* Hand @w's buffers to a writer thread with a queue of @depth buffers. */
+static int writer_start(struct vmpt_writer *w, int depth)
+{
+    size_t idx;
+    int errcode;
+
+    if (depth < 2)
+        return -pte_invalid;
+
+    w->slots = calloc((size_t) depth, sizeof(*w->slots));
+    if (!w->slots)
+        return -pte_nomem;
+
+    w->nslots = (size_t) depth;
+    w->slots[0].buf = w->buf;
+    for (idx = 1; idx < w->nslots; ++idx) {
+        w->slots[idx].buf = malloc(w->size);
+        if (!w->slots[idx].buf)
+            goto err;
+    }
+
+    /* We are filling the first buffer. */
+    sem_init(&w->filled, 0, 0);
+    sem_init(&w->free, 0, (unsigned int) w->nslots - 1);
+
+    errcode = pthread_create(&w->thread, NULL, writer_thread, w);
+    if (errcode) {
+        sem_destroy(&w->filled);
+        sem_destroy(&w->free);
+        goto err;
+    }
+
+    return 0;
+
+err:
+    for (idx = 1; idx < w->nslots; ++idx)
+        free(w->slots[idx].buf);
+    free(w->slots);
+    w->slots = NULL;
+    w->nslots = 0;
+
+    return -pte_nomem;
+}
+
+/* Queue the current buffer and wait for a free one. */
+static void writer_queue(struct vmpt_writer *w, size_t len)
+{
+    w->slots[w->head % w->nslots].len = len;
+    w->head += 1;
+    sem_post(&w->filled);
+
+    if (sem_trywait(&w->free)) {
+        uint64_t start;
+
+        start = now_ns();
+        while (sem_wait(&w->free) && errno == EINTR)
+            ;
+        w->stall_ns += now_ns() - start;
+    }
+
+    w->buf = w->slots[w->head % w->nslots].buf;
+}
+
+static int writer_flush(struct vmpt_writer *w)
+{
+    if (w->grow)
+        return writer_grow(w);
+
+    if (w->len) {
+        if (w->slots)
+            writer_queue(w, w->len);
+        else {
+            uint64_t start;
+
+            start = now_ns();
+            writer_output(w, w->buf, w->len);
+            w->stall_ns += now_ns() - start;
+        }
+
+        w->pos += w->len;
+        w->len = 0;
+    }
+
+    return __atomic_load_n(&w->error, __ATOMIC_RELAXED) ? -1 : 0;
+}
+
+static int writer_fini(struct vmpt_writer *w)
+{
+    size_t idx;
+
+    if (!w->grow)
+        (void) writer_flush(w);
+
+    if (w->slots) {
+        uint64_t start;
+
+        start = now_ns();
+        w->slots[w->head % w->nslots].len = 0;
+        sem_post(&w->filled);
+        pthread_join(w->thread, NULL);
+        w->stall_ns += now_ns() - start;
+
+        sem_destroy(&w->filled);
+        sem_destroy(&w->free);
+
+        for (idx = 0; idx < w->nslots; ++idx)
+            free(w->slots[idx].buf);
+        free(w->slots);
+        w->slots = NULL;
+    } else {
+        if (w->codec)
+            writer_compress(w, NULL, 0, 1);
+        free(w->buf);
+    }
+
+    w->buf = NULL;
+    writer_free_codec(w);
+
+    return w->error ? -1 : 0;
+}
+
+/* Make room for @n more bytes; @n must not exceed the buffer size. */
+static inline char *writer_reserve(struct vmpt_writer *w, size_t n)
+{
+    if (w->size - w->len < n)
+        (void) writer_flush(w);
+
+    return w->buf + w->len;
+}
+
+static inline void writer_put(struct vmpt_writer *w, const char *str,
+        size_t n)
+{
+    memcpy(writer_reserve(w, n), str, n);
+    w->len += n;
+}
+
+/* Put @n bytes at @str, which may be more than the buffer holds. */
+static void writer_append(struct vmpt_writer *w, const char *str, size_t n)
+{
+    while (n) {
+        size_t len;
+
+        len = n < w->size ? n : w->size;
+        writer_put(w, str, len);
+
+        str += len;
+        n -= len;
+    }
+}
+
+/* The offset in the output of the next byte we put - before compression. */
+static inline uint64_t writer_tell(const struct vmpt_writer *w)
+{
+    return w->pos + w->len;
+}
+
+#define writer_str(w, str) writer_put((w), (str), sizeof(str) - 1)
+
+/* Write @value in lower-case hex without leading zeros like PRIx64. */
+static inline void writer_hex(struct vmpt_writer *w, uint64_t value)
+{
+    static const char digits[] = "0123456789abcdef";
+    char buf[16], *pos;
+    int n;
+
+    pos = buf + sizeof(buf);
+    do {
+        *--pos = digits[value & 0xf];
+        value >>= 4;
+    } while (value);
+
+    n = (int) (buf + sizeof(buf) - pos);
+    writer_put(w, pos, (size_t) n);
+}
+
+static inline void writer_dec(struct vmpt_writer *w, uint64_t value)
+{
+    char buf[20], *pos;
+
+    pos = buf + sizeof(buf);
+    do {
+        *--pos = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value);
+
+    writer_put(w, pos, (size_t) (buf + sizeof(buf) - pos));
+}
+
+/* Write @value with six decimals. */
+static void writer_fixed(struct vmpt_writer *w, double value)
+{
+    char buf[32];
+    int n;
+
+    n = snprintf(buf, sizeof(buf), "%.6f", value);
+    if (0 < n && (size_t) n < sizeof(buf))
+        writer_put(w, buf, (size_t) n);
+}
+
+/* How --stats reports. */
+enum stats_mode {
+    stm_off,
+    stm_text,
+    stm_json
+};
+
+/* The names of the packet types we report.
+ *
+ * We only name the packets libipt 1.x knows about; newer packets are
+ * counted but reported as "other".
+ */
+static const char * const packet_names[VMPT_STATS_NTYPES] = {
+    [ppt_unknown] = "unknown",
+    [ppt_pad] = "pad",
+    [ppt_psb] = "psb",
+    [ppt_psbend] = "psbend",
+    [ppt_fup] = "fup",
+    [ppt_tip] = "tip",
+    [ppt_tip_pge] = "tip.pge",
+    [ppt_tip_pgd] = "tip.pgd",
+    [ppt_tnt_8] = "tnt.8",
+    [ppt_tnt_64] = "tnt.64",
+    [ppt_mode] = "mode",
+    [ppt_pip] = "pip",
+    [ppt_vmcs] = "vmcs",
+    [ppt_cbr] = "cbr",
+    [ppt_tsc] = "tsc",
+    [ppt_tma] = "tma",
+    [ppt_mtc] = "mtc",
+    [ppt_cyc] = "cyc",
+    [ppt_stop] = "stop",
+    [ppt_ovf] = "ovf",
+    [ppt_mnt] = "mnt"
+};
+
+/* The names of the error codes we report, like packet_names. */
+static const char * const error_names[VMPT_STATS_NERRORS] = {
+    [pte_internal] = "internal",
+    [pte_invalid] = "invalid",
+    [pte_nosync] = "nosync",
+    [pte_bad_opc] = "bad_opc",
+    [pte_bad_packet] = "bad_packet",
+    [pte_bad_context] = "bad_context",
+    [pte_eos] = "eos",
+    [pte_bad_query] = "bad_query",
+    [pte_nomem] = "nomem",
+    [pte_bad_config] = "bad_config"
+};
+
+/* @count per second given @ns nanoseconds - zero if no time passed. */
+static double stats_rate(uint64_t count, uint64_t ns)
+{
+    return ns ? (double) count * 1e9 / (double) ns : 0.0;
+}
+
+/* The peak resident set size of the process in bytes. */
+static uint64_t stats_max_rss(void)
+{
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) < 0)
+        return 0ull;
+
+    return (uint64_t) usage.ru_maxrss * 1024ull;
+}
+
+/* Print @stats and the output statistics of @out to stderr. */
+static void stats_print(const struct vmpt_stats *stats,
+        const struct vmpt_writer *out, int mode)
+{
+    uint64_t packets, other, errors, other_errors, max_rss, range;
+    int type, code, idx;
+
+    max_rss = stats_max_rss();
+    packets = other = 0ull;
+    for (type = 0; type < VMPT_STATS_NTYPES; ++type) {
+        packets += stats->packets[type];
+        if (!packet_names[type])
+            other += stats->packets[type];
+    }
+
+    errors = other_errors = 0ull;
+    for (code = 0; code < VMPT_STATS_NERRORS; ++code) {
+        errors += stats->errors[code];
+        if (!error_names[code])
+            other_errors += stats->errors[code];
+    }
+
+    range = 1ull << stats->range_shift;
+
+    if (mode == stm_json) {
+        fprintf(stderr, "{\"load\":{\"bytes\":%" PRIu64 ",\"ns\":%" PRIu64
+                ",\"bytes_per_s\":%.0f},", stats->loaded, stats->load_ns,
+                stats_rate(stats->loaded, stats->load_ns));
+        fprintf(stderr, "\"decode\":{\"bytes\":%" PRIu64 ",\"packets\":%"
+                PRIu64 ",\"ns\":%" PRIu64 ",\"bytes_per_s\":%.0f,"
+                "\"packets_per_s\":%.0f},", stats->bytes, packets,
+                stats->decode_ns, stats_rate(stats->bytes, stats->decode_ns),
+                stats_rate(packets, stats->decode_ns));
+        fprintf(stderr, "\"output\":{\"bytes\":%" PRIu64 ",\"ns\":%" PRIu64
+                ",\"bytes_per_s\":%.0f,\"stall_ns\":%" PRIu64 "},",
+                out->written, out->write_ns,
+                stats_rate(out->written, out->write_ns), out->stall_ns);
+        if (out->codec)
+            fprintf(stderr, "\"compress\":{\"raw\":%" PRIu64 ",\"bytes\":%"
+                    PRIu64 ",\"ns\":%" PRIu64 ",\"raw_per_s\":%.0f,"
+                    "\"bytes_per_s\":%.0f},", out->raw, out->written,
+                    out->compress_ns,
+                    stats_rate(out->raw, out->compress_ns),
+                    stats_rate(out->written, out->compress_ns));
+        fprintf(stderr, "\"memory\":{\"max_rss\":%" PRIu64 "},", max_rss);
+        fprintf(stderr, "\"bundles\":%" PRIu64 ",\"dropped\":%" PRIu64
+                ",\"resyncs\":%" PRIu64 ",\"packets\":{", stats->bundles,
+                stats->dropped, stats->resyncs);
+        for (type = 0; type < VMPT_STATS_NTYPES; ++type)
+            if (packet_names[type])
+                fprintf(stderr, "\"%s\":%" PRIu64 ",", packet_names[type],
+                        stats->packets[type]);
+        fprintf(stderr, "\"other\":%" PRIu64 "},", other);
+        fprintf(stderr, "\"errors\":{\"count\":%" PRIu64 ",\"skipped\":%"
+                PRIu64 ",\"resync_ns\":%" PRIu64 ",\"codes\":{", errors,
+                stats->skipped, stats->resync_ns);
+        for (code = 0; code < VMPT_STATS_NERRORS; ++code)
+            if (error_names[code])
+                fprintf(stderr, "\"%s\":%" PRIu64 ",", error_names[code],
+                        stats->errors[code]);
+        fprintf(stderr, "\"other\":%" PRIu64 "},\"ranges\":{\"size\":%"
+                PRIu64 ",\"counts\":[", other_errors, range);
+        for (idx = 0, type = 0; idx < VMPT_STATS_NRANGES; ++idx)
+            if (stats->ranges[idx])
+                fprintf(stderr, "%s{\"offset\":%" PRIu64 ",\"count\":%"
+                        PRIu64 "}", type++ ? "," : "",
+                        (uint64_t) idx * range, stats->ranges[idx]);
+        fprintf(stderr, "]}}}\n");
+        return;
+    }
+
+    fprintf(stderr, "load:    %" PRIu64 " bytes in %.3f s (%.1f MiB/s)\n",
+            stats->loaded, (double) stats->load_ns / 1e9,
+            stats_rate(stats->loaded, stats->load_ns) / 1048576.0);
+    fprintf(stderr, "decode:  %" PRIu64 " bytes, %" PRIu64 " packets in "
+            "%.3f s (%.1f MiB/s, %.0f packets/s)\n", stats->bytes, packets,
+            (double) stats->decode_ns / 1e9,
+            stats_rate(stats->bytes, stats->decode_ns) / 1048576.0,
+            stats_rate(packets, stats->decode_ns));
+    fprintf(stderr, "output:  %" PRIu64 " bytes in %.3f s (%.1f MiB/s), "
+            "decode stalled %.3f s\n", out->written,
+            (double) out->write_ns / 1e9,
+            stats_rate(out->written, out->write_ns) / 1048576.0,
+            (double) out->stall_ns / 1e9);
+    if (out->codec)
+        fprintf(stderr, "compress: %" PRIu64 " -> %" PRIu64 " bytes in %.3f s "
+                "(%.1f MiB/s in, %.1f MiB/s out)\n", out->raw, out->written,
+                (double) out->compress_ns / 1e9,
+                stats_rate(out->raw, out->compress_ns) / 1048576.0,
+                stats_rate(out->written, out->compress_ns) / 1048576.0);
+    fprintf(stderr, "memory:  %" PRIu64 " bytes peak RSS (%.1f MiB)\n",
+            max_rss, (double) max_rss / 1048576.0);
+    fprintf(stderr, "bundles: %" PRIu64 "\n", stats->bundles);
+    fprintf(stderr, "dropped: %" PRIu64 " incomplete PIP-VMCS-TSC chains\n",
+            stats->dropped);
+    fprintf(stderr, "resyncs: %" PRIu64 "\n", stats->resyncs);
+    fprintf(stderr, "packets:\n");
+    for (type = 0; type < VMPT_STATS_NTYPES; ++type)
+        if (packet_names[type] && stats->packets[type])
+            fprintf(stderr, "  %-8s %" PRIu64 "\n", packet_names[type],
+                    stats->packets[type]);
+    if (other)
+        fprintf(stderr, "  %-8s %" PRIu64 "\n", "other", other);
+    fprintf(stderr, "errors:  %" PRIu64 ", skipping %" PRIu64 " bytes in "
+            "%.3f s\n", errors, stats->skipped,
+            (double) stats->resync_ns / 1e9);
+    for (code = 0; code < VMPT_STATS_NERRORS; ++code)
+        if (error_names[code] && stats->errors[code])
+            fprintf(stderr, "  %-10s %" PRIu64 "\n", error_names[code],
+                    stats->errors[code]);
+    if (other_errors)
+        fprintf(stderr, "  %-10s %" PRIu64 "\n", "other", other_errors);
+    for (idx = 0; idx < VMPT_STATS_NRANGES; ++idx)
+        if (stats->ranges[idx])
+            fprintf(stderr, "  at %" PRIx64 "-%" PRIx64 ": %" PRIu64 "\n",
+                    (uint64_t) idx * range, (uint64_t) (idx + 1) * range - 1,
+                    stats->ranges[idx]);
+}
+
+struct vmpt_context;
+struct vmpt_checkpoint;
+struct vmpt_cache;
+
+/* An output format.
+ *
+ * The pip and vmcs callbacks are optional and are called as soon as the
+ * respective packet is added to the bundle.  The bundle callback is called
+ * for every complete bundle.  The optional psb callback sees the bundle state
+ * at every PSB.
+ */
+struct bundle_format {
+    /* The file we write to by default. */
+    const char *filename;
+
+    void (*begin)(struct vmpt_context *ctx);
+    void (*end)(struct vmpt_context *ctx);
+    void (*pip)(struct vmpt_context *ctx, const struct pt_packet_pip *pip);
+    void (*vmcs)(struct vmpt_context *ctx,
+            const struct pt_packet_vmcs *vmcs);
+    void (*bundle)(struct vmpt_context *ctx,
+            const struct vmpt_bundle *bundle);
+
+    /* Called for every PSB at @offset before it is decoded. */
+    void (*psb)(struct vmpt_context *ctx, uint64_t offset);
+
+    /* Called before we skip part of the trace and reset the bundle state,
+     * e.g. at the end of each PSB segment --sample decodes.
+     */
+    void (*gap)(struct vmpt_context *ctx);
+
+    /* Called now and then while we wait for more trace, e.g. live. */
+    void (*idle)(struct vmpt_context *ctx);
+
+    /* Non-zero if the callbacks only write to ctx->out and keep no state,
+     * so parts of the output can be formatted on their own and put
+     * together.  See dump_parallel().
+     */
+    int stateless;
+};
+
+/* A bundle decoder and where its bundles go.
+ *
+ * The decoder calls back into the output format through our callbacks,
+ * which find us in its priv field.  A context must not be copied.
+ */
+struct vmpt_context {
+    /* The bundle decoder and the callbacks we gave it. */
+    struct vmpt_decoder dec;
+    struct vmpt_callbacks callbacks;
+
+    /* The output format and where it goes. */
+    const struct bundle_format *format;
+    struct vmpt_writer *out;
+
+    /* Leave out all the whitespace in the JSON output. */
+    int compact;
+
+    /* Private data of the output format. */
+    void *priv;
+
+    /* Why the output format's end hook could not write its output - zero if
+     * it could.
+     */
+    int error;
+
+    /* For --sample: we decoded every sample-th of the trace's segments PSB
+     * segments, sampled in all, and the trace spans this many TSC ticks -
+     * zero if we could not tell.  The sample is zero if we decoded all of
+     * the trace.
+     */
+    uint64_t sample, segments, sampled, span;
+
+    /* Where we keep the state at the last PSB for --checkpoint - NULL if not
+     * asked for.  The PSB's trace offset is relative to dec.base.
+     */
+    struct vmpt_checkpoint *checkpoint;
+
+    /* Where we record the decode for --cache - NULL if not asked for or if
+     * the output comes from the cache.
+     */
+    struct vmpt_cache *cache;
+};
+
+/* Save the bundle state of @ctx at the PSB at @offset into @entry. */
+static void vmpt_context_save(const struct vmpt_context *ctx, uint64_t offset,
+        struct vmpt_idx_entry *entry)
+{
+    entry->offset = offset;
+    entry->tsc = ctx->dec.last_tsc;
+    entry->cr3 = ctx->dec.bundle.cr3;
+    entry->vmcs_base = ctx->dec.bundle.vmcs_base;
+    entry->nr = ctx->dec.bundle.nr;
+    entry->flags = ((uint32_t) ctx->dec.pad_cnt & VMPT_IDX_PAD_MASK) <<
+        VMPT_IDX_PAD_SHIFT;
+    if (ctx->dec.got_pip)
+        entry->flags |= vif_pip;
+    if (ctx->dec.got_pad)
+        entry->flags |= vif_pad;
+    if (ctx->dec.got_vmcs)
+        entry->flags |= vif_vmcs;
+    if (ctx->dec.got_tsc)
+        entry->flags |= vif_tsc;
+    entry->tsc_min = UINT64_MAX;
+    entry->tsc_max = 0ull;
+}
+
+/* Put @ctx into the bundle state saved in @entry. */
+static void vmpt_context_restore(struct vmpt_context *ctx,
+        const struct vmpt_idx_entry *entry)
+{
+    ctx->dec.bundle.cr3 = entry->cr3;
+    ctx->dec.bundle.nr = entry->nr;
+    ctx->dec.bundle.vmcs_base = entry->vmcs_base;
+    ctx->dec.got_pip = (entry->flags & vif_pip) ? 1 : 0;
+    ctx->dec.got_pad = (entry->flags & vif_pad) ? 1 : 0;
+    ctx->dec.got_vmcs = (entry->flags & vif_vmcs) ? 1 : 0;
+    ctx->dec.pad_cnt = (int) ((entry->flags >> VMPT_IDX_PAD_SHIFT) &
+            VMPT_IDX_PAD_MASK);
+    ctx->dec.got_tsc = (entry->flags & vif_tsc) ? 1 : 0;
+    ctx->dec.last_tsc = entry->tsc;
+}
+
+#define VMPT_CKPT_MAGIC "VMPTCKPT"
+#define VMPT_CKPT_VERSION 2
+
+/* The output formats a checkpoint can resume. */
+enum checkpoint_format {
+    ckf_json,
+    ckf_compact,
+    ckf_bin
+};
+
+/* A --checkpoint file.
+ *
+ * It holds the decoder state at the last PSB of a trace that is still being
+ * appended to, and how much output we had written when we got there.  A run
+ * with --resume truncates the output back to that size and decodes the trace
+ * from that PSB on.  All fields are in host byte order.
+ */
+struct vmpt_checkpoint {
+    /* VMPT_CKPT_MAGIC without the terminating zero and the version. */
+    char magic[8];
+    uint32_t version;
+
+    /* The output format (enum checkpoint_format). */
+    uint32_t format;
+
+    /* The trace's device and inode, and its size when we last decoded it. */
+    uint64_t trace_dev, trace_ino, trace_size;
+
+    /* The size of the output when we reached the PSB. */
+    uint64_t output;
+
+    /* The last PSB and the bundle state at it.  The offset is UINT64_MAX
+     * until we saw a PSB.
+     */
+    struct vmpt_idx_entry state;
+};
+
+/* Remember the state at the PSB at @offset for a --checkpoint. */
+static void checkpoint_psb(struct vmpt_context *ctx, uint64_t offset)
+{
+    struct vmpt_checkpoint *ckpt;
+
+    ckpt = ctx->checkpoint;
+    vmpt_context_save(ctx, ctx->dec.base + offset, &ckpt->state);
+    ckpt->output = writer_tell(ctx->out);
+}
+
+#define VMPT_CACHE_MAGIC "VMPTCACH"
+#define VMPT_CACHE_VERSION 1
+
+/* The callbacks of a decode as we record them in struct vmpt_bin_record,
+ * e.g. in a --cache entry, in the record's reserved field.
+ */
+enum cache_event {
+    cev_pip = 1,
+    cev_vmcs,
+    cev_bundle
+};
+
+/* What a --cache entry was decoded from.
+ *
+ * The trace is identified by its device, inode, size and modification time
+ * rather than by a hash of its contents, which would take about as long to
+ * compute as the decode we want to save.  Unused fields are zero.
+ */
+struct vmpt_cache_key {
+    uint64_t trace_dev, trace_ino, trace_size;
+    uint64_t mtime_sec, mtime_nsec;
+
+    /* The [begin, end) range of the trace we decoded. */
+    uint64_t begin, end;
+
+    /* The --tsc-range if tsc_range is non-zero. */
+    uint64_t tsc_begin, tsc_end;
+    uint32_t tsc_range;
+
+    /* The cpu the decoder applied the errata of. */
+    uint32_t vendor, family, model, stepping;
+    uint32_t reserved;
+};
+
+/* A --cache entry.
+ *
+ * The header is followed by nrecords struct vmpt_bin_record, one for each
+ * pip, vmcs and bundle callback of the decode in order.  The output formats
+ * only see those, so any of them can be written from an entry, whichever
+ * format the run that cached it wrote.  All fields are in host byte order.
+ */
+struct vmpt_cache_header {
+    /* VMPT_CACHE_MAGIC without the terminating zero and the version. */
+    char magic[8];
+    uint32_t version;
+
+    /* The size of a record - sizeof(struct vmpt_bin_record). */
+    uint32_t record_size;
+
+    struct vmpt_cache_key key;
+    uint64_t nrecords;
+
+    /* The bundle state and the statistics at the end of the decode, which
+     * the output formats and --stats still look at.
+     */
+    uint64_t last_tsc;
+    uint32_t got_tsc, got_pip;
+    struct vmpt_stats stats;
+};
+
+/* The --cache entry of a run.
+ *
+ * On a hit, the entry is loaded into entry.  On a miss, fd is the temporary
+ * file the decode is recorded into through writer, or -1 once it was put in
+ * place or given up.
+ */
+struct vmpt_cache {
+    char *path, *tmp;
+    struct vmpt_cache_header header;
+
+    int hit;
+    struct vmpt_trace entry;
+
+    int fd;
+    struct vmpt_writer writer;
+};
+
+/* Record a callback in @record. */
+static inline void record_event(struct vmpt_bin_record *record,
+        enum cache_event event, uint64_t cr3, uint32_t nr, uint64_t vmcs_base,
+        uint64_t tsc)
+{
+    record->cr3 = cr3;
+    record->vmcs_base = vmcs_base;
+    record->tsc = tsc;
+    record->nr = nr;
+    record->reserved = (uint32_t) event;
+}
+
+/* Record a callback for --cache. */
+static void cache_record(struct vmpt_context *ctx, enum cache_event event,
+        uint64_t cr3, uint32_t nr, uint64_t vmcs_base, uint64_t tsc)
+{
+    struct vmpt_bin_record record;
+
+    record_event(&record, event, cr3, nr, vmcs_base, tsc);
+    writer_put(&ctx->cache->writer, (const char *) &record, sizeof(record));
+    ctx->cache->header.nrecords += 1;
+}
+
+static void context_pip(struct vmpt_decoder *dec,
+        const struct pt_packet_pip *pip)
+{
+    struct vmpt_context *ctx;
+
+    ctx = dec->priv;
+    if (ctx->cache)
+        cache_record(ctx, cev_pip, pip->cr3, pip->nr, 0ull, 0ull);
+    if (ctx->format->pip)
+        ctx->format->pip(ctx, pip);
+}
+
+static void context_vmcs(struct vmpt_decoder *dec,
+        const struct pt_packet_vmcs *vmcs)
+{
+    struct vmpt_context *ctx;
+
+    ctx = dec->priv;
+    if (ctx->cache)
+        cache_record(ctx, cev_vmcs, 0ull, 0u, vmcs->base, 0ull);
+    if (ctx->format->vmcs)
+        ctx->format->vmcs(ctx, vmcs);
+}
+
+static void context_bundle(struct vmpt_decoder *dec,
+        const struct vmpt_bundle *bundle)
+{
+    struct vmpt_context *ctx;
+
+    ctx = dec->priv;
+    if (ctx->cache)
+        cache_record(ctx, cev_bundle, bundle->cr3, bundle->nr,
+                bundle->vmcs_base, bundle->tsc);
+    if (ctx->format->bundle)
+        ctx->format->bundle(ctx, bundle);
+}
+
+static void context_psb(struct vmpt_decoder *dec, uint64_t offset)
+{
+    struct vmpt_context *ctx;
+
+    ctx = dec->priv;
+    if (ctx->checkpoint)
+        checkpoint_psb(ctx, offset);
+    if (ctx->format->psb)
+        ctx->format->psb(ctx, offset);
+}
+
+/* Set up @ctx to write @format to @out.
+ *
+ * The decoder only calls back for what @format wants to see.
+ */
+static void vmpt_context_init(struct vmpt_context *ctx,
+        const struct bundle_format *format, struct vmpt_writer *out,
+        int compact)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->format = format;
+    ctx->out = out;
+    ctx->compact = compact;
+
+    ctx->callbacks.pip = format->pip ? context_pip : NULL;
+    ctx->callbacks.vmcs = format->vmcs ? context_vmcs : NULL;
+    ctx->callbacks.bundle = format->bundle ? context_bundle : NULL;
+    ctx->callbacks.psb = format->psb ? context_psb : NULL;
+
+    vmpt_decoder_init(&ctx->dec, &ctx->callbacks, ctx);
+    ctx->dec.diag = stderr;
+}
+
+/* Keep the state at every PSB in @ckpt for a --checkpoint. */
+static void vmpt_context_checkpoint(struct vmpt_context *ctx,
+        struct vmpt_checkpoint *ckpt)
+{
+    ctx->checkpoint = ckpt;
+    ctx->callbacks.psb = context_psb;
+}
+
+/* Record every pip, vmcs and bundle callback of @ctx in @cache. */
+static void vmpt_context_cache(struct vmpt_context *ctx,
+        struct vmpt_cache *cache)
+{
+    ctx->cache = cache;
+    ctx->callbacks.pip = context_pip;
+    ctx->callbacks.vmcs = context_vmcs;
+    ctx->callbacks.bundle = context_bundle;
+}
+
+/* Make the callbacks recorded in [@begin, @end) to @ctx's output format. */
+static void vmpt_context_replay(struct vmpt_context *ctx,
+        const struct vmpt_bin_record *begin,
+        const struct vmpt_bin_record *end)
+{
+    const struct bundle_format *format;
+    const struct vmpt_bin_record *record;
+
+    format = ctx->format;
+    for (record = begin; record < end; ++record) {
+        switch (record->reserved) {
+        case cev_pip:
+            if (format->pip) {
+                struct pt_packet_pip pip;
+
+                memset(&pip, 0, sizeof(pip));
+                pip.cr3 = record->cr3;
+                pip.nr = record->nr;
+
+                format->pip(ctx, &pip);
+            }
+            break;
+
+        case cev_vmcs:
+            if (format->vmcs) {
+                struct pt_packet_vmcs vmcs;
+
+                vmcs.base = record->vmcs_base;
+
+                format->vmcs(ctx, &vmcs);
+            }
+            break;
+
+        case cev_bundle:
+            if (format->bundle) {
+                struct vmpt_bundle bundle;
+
+                memset(&bundle, 0, sizeof(bundle));
+                bundle.cr3 = record->cr3;
+                bundle.nr = record->nr;
+                bundle.vmcs_base = record->vmcs_base;
+                bundle.tsc = record->tsc;
+
+                format->bundle(ctx, &bundle);
+            }
+            break;
+        }
+    }
+}
+
+/* Forget the bundle state of @ctx before we skip part of the trace.
+ *
+ * A bundle we are in the middle of is dropped.
+ */
+static void vmpt_context_gap(struct vmpt_context *ctx)
+{
+    if (ctx->format->gap)
+        ctx->format->gap(ctx);
+
+    if (ctx->dec.got_pip)
+        ctx->dec.stats.dropped += 1;
+
+    ctx->dec.got_pip = 0;
+    ctx->dec.got_pad = 0;
+    ctx->dec.got_vmcs = 0;
+    ctx->dec.pad_cnt = 0;
+    ctx->dec.got_tsc = 0;
+}
+
+/* Account for a bundle @ctx did not complete when the trace ended. */
+static void vmpt_context_finish(struct vmpt_context *ctx)
+{
+    vmpt_decoder_finish(&ctx->dec);
+}
+
+static void json_begin(struct vmpt_context *ctx)
+{
+    if (ctx->compact)
+        writer_str(ctx->out, "\"bundle\":[\n");
+    else
+        writer_str(ctx->out, "\"bundle\": [\n");
+}
+
+static void json_end(struct vmpt_context *ctx)
+{
+    writer_str(ctx->out, "]\n");
+}
+
+static void json_pip(struct vmpt_context *ctx,
+        const struct pt_packet_pip *pip)
+{
+    struct vmpt_writer *out;
+
+    out = ctx->out;
+    if (ctx->compact) {
+        writer_str(out, "{\"packet\":[{\"id\":\"PIP\",\"payload\":");
+        writer_hex(out, pip->cr3);
+        writer_str(out, ",\"nr\":");
+        writer_dec(out, pip->nr);
+        writer_str(out, "},");
+    } else {
+        writer_str(out, "\t{\n"
+                "\t\t\"packet\": [\n"
+                "\t\t\t{\n\t\t\t\t\"id\": \"PIP\","
+                "\n\t\t\t\t\"payload\": ");
+        writer_hex(out, pip->cr3);
+        writer_str(out, ",\n\t\t\t\t\"nr\": ");
+        writer_dec(out, pip->nr);
+        writer_str(out, "\n\t\t\t},\n");
+    }
+}
+
+static void json_vmcs(struct vmpt_context *ctx,
+        const struct pt_packet_vmcs *vmcs)
+{
+    struct vmpt_writer *out;
+
+    out = ctx->out;
+    if (ctx->compact) {
+        writer_str(out, "{\"id\":\"VMCS\",\"payload\":");
+        writer_hex(out, vmcs->base);
+        writer_str(out, "},");
+    } else {
+        writer_str(out, "\t\t\t{\n\t\t\t\t\"id\": \"VMCS\","
+                "\n\t\t\t\t\"payload\": ");
+        writer_hex(out, vmcs->base);
+        writer_str(out, "\n\t\t\t},\n");
+    }
+}
+
+static void json_bundle(struct vmpt_context *ctx,
+        const struct vmpt_bundle *bundle)
+{
+    struct vmpt_writer *out;
+
+    out = ctx->out;
+    if (ctx->compact) {
+        writer_str(out, "{\"id\":\"TSC\",\"payload\":");
+        writer_hex(out, bundle->tsc);
+        writer_str(out, "}]},\n");
+    } else {
+        writer_str(out, "\t\t\t{\n\t\t\t\t\"id\": \"TSC\","
+                "\n\t\t\t\t\"payload\": ");
+        writer_hex(out, bundle->tsc);
+        writer_str(out, "\n\t\t\t}\n\t\t]\n\t},\n");
+    }
+}
+
+static const struct bundle_format json_format = {
+    "bundles.json",
+    json_begin,
+    json_end,
+    json_pip,
+    json_vmcs,
+    json_bundle,
+    NULL,
+    NULL,
+    NULL,
+    1
+};
+
+static void bin_begin(struct vmpt_context *ctx)
+{
+    struct vmpt_bin_header header;
+
+    vmpt_bin_header_init(&header);
+    writer_put(ctx->out, (const char *) &header, sizeof(header));
+}
+
+static void bin_bundle(struct vmpt_context *ctx,
+        const struct vmpt_bundle *bundle)
+{
+    struct vmpt_bin_record record;
+
+    record.cr3 = bundle->cr3;
+    record.vmcs_base = bundle->vmcs_base;
+    record.tsc = bundle->tsc;
+    record.nr = bundle->nr;
+    record.reserved = 0;
+
+    writer_put(ctx->out, (const char *) &record, sizeof(record));
+}
+
+static const struct bundle_format bin_format = {
+    "bundles.bin",
+    bin_begin,
+    NULL,
+    NULL,
+    NULL,
+    bin_bundle,
+    NULL,
+    NULL,
+    NULL,
+    1
+};
+
+/* The number of sub-buckets per power of two in an aggregation histogram.
+ *
+ * Like an HDR histogram, values are bucketed by their highest set bit and
+ * the AGGR_SUB_BITS bits below it, so a bucket is within 1/AGGR_SUBBUCKETS
+ * of the values in it.
+ */
+#define AGGR_SUB_BITS 3
+#define AGGR_SUBBUCKETS (1 << AGGR_SUB_BITS)
+#define AGGR_BUCKETS ((64 - AGGR_SUB_BITS + 1) * AGGR_SUBBUCKETS)
+
+/* The initial capacity of the VMCS table; a power of two. */
+static const size_t aggr_capacity = 64;
+
+/* The residency of one VMCS. */
+struct aggr_vm {
+    /* The VMCS base address and whether this slot is used. */
+    uint64_t vmcs_base;
+    int used;
+
+    /* The TSC ticks the VMCS held the cpu and the number of slices. */
+    uint64_t residency, slices;
+
+    /* The shortest and longest slice. */
+    uint64_t min, max;
+
+    /* The slice lengths. */
+    uint64_t histogram[AGGR_BUCKETS];
+
+    /* For --sample: the residency at the end of the last sampled segment,
+     * and the sums over the sampled segments of the squared residency in
+     * the segment and of its product with the segment's time.
+     */
+    uint64_t mark;
+    double sum_yy, sum_xy;
+};
+
+/* The state of --aggregate. */
+struct aggregate {
+    /* An open-addressing hash table of VMCSs with linear probing. */
+    struct aggr_vm *vms;
+    size_t capacity, nvms;
+
+    /* The VMCS holding the cpu and the TSC its slice started at. */
+    struct aggr_vm *current;
+    uint64_t start;
+
+    /* The number of switches and of slices that went backwards in time. */
+    uint64_t switches, backwards;
+
+    /* For --sample: the sums over the sampled segments of the time we could
+     * attribute to a VMCS in the segment and of its square.
+     */
+    double sum_x, sum_xx;
+
+    /* Non-zero if we ran out of memory. */
+    int error;
+};
+
+static inline size_t aggr_bucket(uint64_t value)
+{
+    int shift;
+
+    if (value < AGGR_SUBBUCKETS)
+        return (size_t) value;
+
+    shift = 63 - __builtin_clzll(value) - AGGR_SUB_BITS;
+    return (size_t) (shift + 1) * AGGR_SUBBUCKETS +
+        (size_t) ((value >> shift) & (AGGR_SUBBUCKETS - 1));
+}
+
+/* The smallest value in @bucket. */
+static inline uint64_t aggr_bucket_value(size_t bucket)
+{
+    size_t shift;
+
+    if (bucket < AGGR_SUBBUCKETS)
+        return (uint64_t) bucket;
+
+    shift = bucket / AGGR_SUBBUCKETS - 1;
+    return ((uint64_t) AGGR_SUBBUCKETS + bucket % AGGR_SUBBUCKETS) << shift;
+}
+
+static inline size_t aggr_hash(uint64_t vmcs_base, size_t capacity)
+{
+    /* VMCS bases are page aligned; mix the page number. */
+    return (size_t) (((vmcs_base >> 12) * 0x9e3779b97f4a7c15ull) >> 32) &
+        (capacity - 1);
+}
+
+static struct aggr_vm *aggr_slot(struct aggr_vm *vms, size_t capacity,
+        uint64_t vmcs_base)
+{
+    size_t idx;
+
+    for (idx = aggr_hash(vmcs_base, capacity);;
+            idx = (idx + 1) & (capacity - 1)) {
+        if (!vms[idx].used || vms[idx].vmcs_base == vmcs_base)
+            return &vms[idx];
+    }
+}
+
+/* Double the table once it is three quarters full. */
+static int aggr_grow(struct aggregate *aggr)
+{
+    struct aggr_vm *vms;
+    size_t capacity, idx;
+    uint64_t current;
+
+    capacity = aggr->capacity ? aggr->capacity * 2 : aggr_capacity;
+    vms = calloc(capacity, sizeof(*vms));
+    if (!vms)
+        return -pte_nomem;
+
+    current = aggr->current ? aggr->current->vmcs_base : 0ull;
+    for (idx = 0; idx < aggr->capacity; ++idx)
+        if (aggr->vms[idx].used)
+            *aggr_slot(vms, capacity, aggr->vms[idx].vmcs_base) =
+                aggr->vms[idx];
+
+    if (aggr->current)
+        aggr->current = aggr_slot(vms, capacity, current);
+
+    free(aggr->vms);
+    aggr->vms = vms;
+    aggr->capacity = capacity;
+
+    return 0;
+}
+
+static struct aggr_vm *aggr_lookup(struct aggregate *aggr,
+        uint64_t vmcs_base)
+{
+    struct aggr_vm *vm;
+
+    if (aggr->capacity * 3 <= (aggr->nvms + 1) * 4 && aggr_grow(aggr) < 0)
+        return NULL;
+
+    vm = aggr_slot(aggr->vms, aggr->capacity, vmcs_base);
+    if (!vm->used) {
+        vm->used = 1;
+        vm->vmcs_base = vmcs_base;
+        vm->min = UINT64_MAX;
+        aggr->nvms += 1;
+    }
+
+    return vm;
+}
+
+/* End the current slice at @tsc. */
+static void aggr_slice(struct aggregate *aggr, uint64_t tsc)
+{
+    struct aggr_vm *vm;
+    uint64_t length;
+
+    vm = aggr->current;
+    if (!vm)
+        return;
+
+    if (tsc < aggr->start) {
+        aggr->backwards += 1;
+        return;
+    }
+
+    length = tsc - aggr->start;
+    vm->residency += length;
+    vm->slices += 1;
+    vm->histogram[aggr_bucket(length)] += 1;
+    if (length < vm->min)
+        vm->min = length;
+    if (vm->max < length)
+        vm->max = length;
+}
+
+static void aggr_begin(struct vmpt_context *ctx)
+{
+    ctx->priv = calloc(1, sizeof(struct aggregate));
+}
+
+/* A bundle switches the cpu to its VMCS at its TSC. */
+static void aggr_bundle(struct vmpt_context *ctx,
+        const struct vmpt_bundle *bundle)
+{
+    struct aggregate *aggr;
+    struct aggr_vm *vm;
+
+    aggr = ctx->priv;
+    if (!aggr || aggr->error)
+        return;
+
+    if (aggr->current && aggr->current->vmcs_base == bundle->vmcs_base)
+        return;
+
+    aggr_slice(aggr, bundle->tsc);
+
+    vm = aggr_lookup(aggr, bundle->vmcs_base);
+    if (!vm) {
+        aggr->error = -pte_nomem;
+        return;
+    }
+
+    if (aggr->current)
+        aggr->switches += 1;
+
+    aggr->current = vm;
+    aggr->start = bundle->tsc;
+}
+
+/* End the slice and the sampled segment before a gap in the trace.
+ *
+ * We cannot tell who held the cpu in the gap, so the next slice starts with
+ * the next bundle.
+ */
+static void aggr_gap(struct vmpt_context *ctx)
+{
+    struct aggregate *aggr;
+    struct aggr_vm *vm;
+    uint64_t time;
+    size_t idx;
+
+    aggr = ctx->priv;
+    if (!aggr || aggr->error)
+        return;
+
+    if (ctx->dec.got_tsc)
+        aggr_slice(aggr, ctx->dec.last_tsc);
+    aggr->current = NULL;
+
+    time = 0ull;
+    for (idx = 0; idx < aggr->capacity; ++idx)
+        if (aggr->vms[idx].used)
+            time += aggr->vms[idx].residency - aggr->vms[idx].mark;
+
+    for (idx = 0; idx < aggr->capacity; ++idx) {
+        double residency;
+
+        vm = &aggr->vms[idx];
+        if (!vm->used || vm->residency == vm->mark)
+            continue;
+
+        residency = (double) (vm->residency - vm->mark);
+        vm->sum_yy += residency * residency;
+        vm->sum_xy += residency * (double) time;
+        vm->mark = vm->residency;
+    }
+
+    aggr->sum_x += (double) time;
+    aggr->sum_xx += (double) time * (double) time;
+}
+
+/* The z-score of the two-sided 95% confidence interval. */
+static const double aggr_z95 = 1.96;
+
+/* What --sample estimates for one VMCS. */
+struct aggr_estimate {
+    /* The residency in the whole trace and its share of the time, each with
+     * the half width of its 95% confidence interval.
+     */
+    double residency, residency_error;
+    double share, share_error;
+};
+
+/* Estimate the residency of @vm for --sample as seen by @ctx.
+ *
+ * We treat the evenly spread segments like a simple random sample of n of
+ * the N segments.  With y the residency and x the time we could attribute
+ * in each sampled segment, the share is the ratio of the sums of y and x,
+ * with a variance of (1 - n/N) s_d^2 / (n mean_x^2) for d = y - share * x.
+ *
+ * A segment's time before its first bundle cannot be attributed, so we get
+ * the residency from the share and the span of the trace.  If we do not
+ * know the span, we estimate the residency as N/n times the sum of the y,
+ * with a variance of N^2 (1 - n/N) s_y^2 / n, which comes out low.
+ */
+static void aggr_estimate(const struct vmpt_context *ctx,
+        const struct aggregate *aggr, const struct aggr_vm *vm,
+        struct aggr_estimate *est)
+{
+    double n, fpc, sum_y, var_y, var_d, mean_x;
+
+    memset(est, 0, sizeof(*est));
+    if (!ctx->sampled)
+        return;
+
+    n = (double) ctx->sampled;
+    fpc = 1.0 - n / (double) ctx->segments;
+    sum_y = (double) vm->residency;
+    if (aggr->sum_x > 0.0)
+        est->share = sum_y / aggr->sum_x;
+
+    mean_x = aggr->sum_x / n;
+    var_d = (vm->sum_yy - 2.0 * est->share * vm->sum_xy +
+            est->share * est->share * aggr->sum_xx) / (n - 1.0);
+    if (1.0 < n && 0.0 < var_d && 0.0 < mean_x)
+        est->share_error = aggr_z95 * sqrt(fpc * var_d / n) / mean_x;
+
+    if (ctx->span) {
+        est->residency = est->share * (double) ctx->span;
+        est->residency_error = est->share_error * (double) ctx->span;
+        return;
+    }
+
+    est->residency = sum_y * (double) ctx->segments / n;
+    var_y = (vm->sum_yy - sum_y * sum_y / n) / (n - 1.0);
+    if (1.0 < n && 0.0 < var_y)
+        est->residency_error = aggr_z95 * (double) ctx->segments *
+            sqrt(fpc * var_y / n);
+}
+
+/* Scale the @count of @sampled of @segments PSB segments to all of them. */
+static uint64_t aggr_scale(uint64_t count, uint64_t segments,
+        uint64_t sampled)
+{
+    if (!sampled)
+        return 0ull;
+
+    return (uint64_t) ((double) count * (double) segments /
+            (double) sampled + 0.5);
+}
+
+/* The smallest value at or above the @permille-th slice of @vm. */
+static uint64_t aggr_percentile(const struct aggr_vm *vm, uint64_t permille)
+{
+    uint64_t rank, seen;
+    size_t bucket;
+
+    rank = (vm->slices * permille + 999) / 1000;
+    seen = 0ull;
+    for (bucket = 0; bucket < AGGR_BUCKETS; ++bucket) {
+        seen += vm->histogram[bucket];
+        if (rank <= seen && vm->histogram[bucket])
+            return aggr_bucket_value(bucket);
+    }
+
+    return vm->max;
+}
+
+static int aggr_compare(const void *lhs, const void *rhs)
+{
+    const struct aggr_vm *left, *right;
+
+    left = *(const struct aggr_vm * const *) lhs;
+    right = *(const struct aggr_vm * const *) rhs;
+    if (left->residency != right->residency)
+        return left->residency < right->residency ? 1 : -1;
+
+    return left->vmcs_base < right->vmcs_base ? -1 :
+        left->vmcs_base > right->vmcs_base;
+}
+
+/* Write the residency of @vm.
+ *
+ * For --sample, the residency and the number of slices are scaled to the
+ * whole trace, and we add the share of the time and the error bounds.  The
+ * slice lengths are those of the sampled slices.
+ */
+static void aggr_write_vm(struct vmpt_context *ctx,
+        const struct aggregate *aggr, const struct aggr_vm *vm)
+{
+    struct vmpt_writer *out;
+    size_t bucket;
+    int first;
+
+    out = ctx->out;
+    writer_str(out, "\t{\"vmcs\": \"");
+    writer_hex(out, vm->vmcs_base);
+    writer_str(out, "\", \"residency\": ");
+    if (ctx->sample) {
+        struct aggr_estimate est;
+
+        aggr_estimate(ctx, aggr, vm, &est);
+        writer_dec(out, (uint64_t) (est.residency + 0.5));
+        writer_str(out, ", \"residency_error\": ");
+        writer_dec(out, (uint64_t) (est.residency_error + 0.5));
+        writer_str(out, ", \"share\": ");
+        writer_fixed(out, est.share);
+        writer_str(out, ", \"share_error\": ");
+        writer_fixed(out, est.share_error);
+        writer_str(out, ", \"slices\": ");
+        writer_dec(out, aggr_scale(vm->slices, ctx->segments, ctx->sampled));
+    } else {
+        writer_dec(out, vm->residency);
+        writer_str(out, ", \"slices\": ");
+        writer_dec(out, vm->slices);
+    }
+    writer_str(out, ", \"min\": ");
+    writer_dec(out, vm->slices ? vm->min : 0ull);
+    writer_str(out, ", \"max\": ");
+    writer_dec(out, vm->max);
+    writer_str(out, ", \"p50\": ");
+    writer_dec(out, aggr_percentile(vm, 500));
+    writer_str(out, ", \"p90\": ");
+    writer_dec(out, aggr_percentile(vm, 900));
+    writer_str(out, ", \"p99\": ");
+    writer_dec(out, aggr_percentile(vm, 990));
+    writer_str(out, ",\n\t \"histogram\": [");
+
+    first = 1;
+    for (bucket = 0; bucket < AGGR_BUCKETS; ++bucket) {
+        if (!vm->histogram[bucket])
+            continue;
+
+        if (!first)
+            writer_str(out, ", ");
+        first = 0;
+
+        writer_str(out, "[");
+        writer_dec(out, aggr_bucket_value(bucket));
+        writer_str(out, ", ");
+        writer_dec(out, vm->histogram[bucket]);
+        writer_str(out, "]");
+    }
+
+    writer_str(out, "]}");
+}
+
+/* Write the residency of each VMCS, the longest first. */
+static void aggr_end(struct vmpt_context *ctx)
+{
+    struct aggregate *aggr;
+    struct aggr_vm **sorted;
+    struct vmpt_writer *out;
+    size_t idx, nvms;
+
+    aggr = ctx->priv;
+    ctx->priv = NULL;
+    if (!aggr || aggr->error) {
+        ctx->error = -pte_nomem;
+        goto out;
+    }
+
+    /* The last slice lasts as far as we can tell. */
+    if (ctx->dec.got_tsc)
+        aggr_slice(aggr, ctx->dec.last_tsc);
+
+    sorted = malloc((aggr->nvms ? aggr->nvms : 1) * sizeof(*sorted));
+    if (!sorted) {
+        ctx->error = -pte_nomem;
+        goto out;
+    }
+
+    nvms = 0;
+    for (idx = 0; idx < aggr->capacity; ++idx)
+        if (aggr->vms[idx].used)
+            sorted[nvms++] = &aggr->vms[idx];
+
+    qsort(sorted, nvms, sizeof(*sorted), aggr_compare);
+
+    out = ctx->out;
+    writer_str(out, "{\"switches\": ");
+    if (ctx->sample) {
+        writer_dec(out, aggr_scale(aggr->switches, ctx->segments,
+                    ctx->sampled));
+        writer_str(out, ", \"backwards\": ");
+        writer_dec(out, aggr_scale(aggr->backwards, ctx->segments,
+                    ctx->sampled));
+        writer_str(out, ",\n\"sample\": {\"segments\": ");
+        writer_dec(out, ctx->segments);
+        writer_str(out, ", \"sampled\": ");
+        writer_dec(out, ctx->sampled);
+        writer_str(out, ", \"span\": ");
+        writer_dec(out, ctx->span);
+        writer_str(out, ", \"confidence\": 0.95}");
+    } else {
+        writer_dec(out, aggr->switches);
+        writer_str(out, ", \"backwards\": ");
+        writer_dec(out, aggr->backwards);
+    }
+    writer_str(out, ",\n\"vms\": [\n");
+    for (idx = 0; idx < nvms; ++idx) {
+        aggr_write_vm(ctx, aggr, sorted[idx]);
+        if (idx + 1 < nvms)
+            writer_str(out, ",");
+        writer_str(out, "\n");
+    }
+    writer_str(out, "]}\n");
+
+    free(sorted);
+
+out:
+    if (aggr)
+        free(aggr->vms);
+    free(aggr);
+}
+
+static const struct bundle_format aggr_format = {
+    "aggregate.json",
+    aggr_begin,
+    aggr_end,
+    NULL,
+    NULL,
+    aggr_bundle,
+    NULL,
+    aggr_gap,
+    NULL,
+    0
+};
+
+/* Perfetto trace output.
+ *
+ * A Perfetto trace is a sequence of TracePacket protobuf messages, each
+ * written as field 1 of the Trace message.  We write a track per VMCS and a
+ * slice on it for each stretch of time that VMCS held the cpu, named by the
+ * CR3 it ran with.  A slice lasts from the bundle that switches to its VMCS
+ * and CR3 to the next bundle that switches away.
+ *
+ * To keep the trace small, the tracks and the CR3 names are interned as
+ * small ids, and event timestamps use a clock private to our packet
+ * sequence whose timestamps are deltas from the previous one.  The clock
+ * counts TSC ticks as nanoseconds; TSCs that went backwards are taken to
+ * be the last TSC we saw.
+ */
+
+/* The TracePacket fields we use. */
+#define PFT_PACKET 1
+#define PFT_TIMESTAMP 8
+#define PFT_CLOCK_SNAPSHOT 6
+#define PFT_SEQUENCE_ID 10
+#define PFT_TRACK_EVENT 11
+#define PFT_INTERNED_DATA 12
+#define PFT_SEQUENCE_FLAGS 13
+#define PFT_PACKET_DEFAULTS 59
+#define PFT_TRACK_DESCRIPTOR 60
+
+/* The fields of the nested messages. */
+#define PFT_CLOCK 1
+#define PFT_CLOCK_ID 1
+#define PFT_CLOCK_TIMESTAMP 2
+#define PFT_CLOCK_INCREMENTAL 3
+#define PFT_CLOCK_UNIT_NS 4
+#define PFT_DEFAULTS_CLOCK_ID 58
+#define PFT_EVENT_TYPE 9
+#define PFT_EVENT_NAME_IID 10
+#define PFT_EVENT_TRACK 11
+#define PFT_INTERNED_NAMES 2
+#define PFT_NAME_IID 1
+#define PFT_NAME 2
+#define PFT_TRACK_UUID 1
+#define PFT_TRACK_NAME 2
+
+/* Our sequence, its incremental clock and the clock it is relative to. */
+#define PFT_SEQUENCE 1
+#define PFT_TSC_CLOCK 64
+#define PFT_BOOTTIME_CLOCK 6
+
+enum {
+    /* TracePacket sequence flags. */
+    pf_state_cleared = 1,
+    pf_needs_state = 2,
+
+    /* TrackEvent types. */
+    pf_slice_begin = 1,
+    pf_slice_end = 2
+};
+
+/* A protobuf message we put together before writing it. */
+struct pb_buf {
+    uint8_t data[128];
+    size_t len;
+
+    /* Non-zero if the message did not fit. */
+    int overflow;
+};
+
+static void pb_put(struct pb_buf *buf, const void *data, size_t len)
+{
+    if (sizeof(buf->data) - buf->len < len) {
+        buf->overflow = 1;
+        return;
+    }
+
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+/* Encode @value as a protobuf varint into @out; returns its length. */
+static size_t pb_encode(uint8_t *out, uint64_t value)
+{
+    size_t len;
+
+    for (len = 0; 0x80 <= value; ++len, value >>= 7)
+        out[len] = (uint8_t) (value | 0x80);
+    out[len++] = (uint8_t) value;
+
+    return len;
+}
+
+static void pb_varint(struct pb_buf *buf, uint64_t value)
+{
+    uint8_t bytes[10];
+
+    pb_put(buf, bytes, pb_encode(bytes, value));
+}
+
+static void pb_uint(struct pb_buf *buf, uint32_t field, uint64_t value)
+{
+    pb_varint(buf, (uint64_t) field << 3);
+    pb_varint(buf, value);
+}
+
+static void pb_bytes(struct pb_buf *buf, uint32_t field, const void *data,
+        size_t len)
+{
+    pb_varint(buf, ((uint64_t) field << 3) | 2);
+    pb_varint(buf, len);
+    pb_put(buf, data, len);
+}
+
+static void pb_message(struct pb_buf *buf, uint32_t field,
+        const struct pb_buf *msg)
+{
+    if (msg->overflow)
+        buf->overflow = 1;
+
+    pb_bytes(buf, field, msg->data, msg->len);
+}
+
+/* An open-addressing table handing out small ids for 64-bit keys. */
+struct intern_table {
+    struct intern_slot {
+        uint64_t key;
+
+        /* The key's id - zero if the slot is free. */
+        uint64_t id;
+    } *slots;
+    size_t capacity, count;
+};
+
+/* The initial capacity of an intern table; a power of two. */
+static const size_t intern_capacity = 64;
+
+static struct intern_slot *intern_slot(struct intern_slot *slots,
+        size_t capacity, uint64_t key)
+{
+    size_t idx;
+
+    for (idx = (size_t) ((key * 0x9e3779b97f4a7c15ull) >> 32) &
+                (capacity - 1);; idx = (idx + 1) & (capacity - 1)) {
+        if (!slots[idx].id || slots[idx].key == key)
+            return &slots[idx];
+    }
+}
+
+/* Intern @key into @table and give its id in @id.
+ *
+ * Returns one if @key is new, zero if it is not, and a negative pt_error_code
+ * otherwise.
+ */
+static int intern(struct intern_table *table, uint64_t key, uint64_t *id)
+{
+    struct intern_slot *slot;
+
+    if (table->capacity * 3 <= (table->count + 1) * 4) {
+        struct intern_slot *slots;
+        size_t capacity, idx;
+
+        capacity = table->capacity ? table->capacity * 2 : intern_capacity;
+        slots = calloc(capacity, sizeof(*slots));
+        if (!slots)
+            return -pte_nomem;
+
+        for (idx = 0; idx < table->capacity; ++idx)
+            if (table->slots[idx].id)
+                *intern_slot(slots, capacity, table->slots[idx].key) =
+                    table->slots[idx];
+
+        free(table->slots);
+        table->slots = slots;
+        table->capacity = capacity;
+    }
+
+    slot = intern_slot(table->slots, table->capacity, key);
+    if (slot->id) {
+        *id = slot->id;
+        return 0;
+    }
+
+    slot->key = key;
+    slot->id = ++table->count;
+    *id = slot->id;
+
+    return 1;
+}
+
+/* The state of --format=perfetto. */
+struct perfetto {
+    /* The VMCS tracks and the CR3 event names. */
+    struct intern_table tracks, names;
+
+    /* The slice we are in - its track is zero if we are in none. */
+    uint64_t track, vmcs_base, cr3;
+
+    /* The value of our incremental clock. */
+    uint64_t clock;
+
+    /* Non-zero if we ran out of memory or a packet did not fit. */
+    int error;
+};
+
+/* Write @packet as the next TracePacket. */
+static void perfetto_packet(struct vmpt_context *ctx,
+        const struct pb_buf *packet)
+{
+    struct perfetto *pf;
+    uint8_t head[11];
+    size_t len;
+
+    pf = ctx->priv;
+    if (packet->overflow) {
+        pf->error = -pte_internal;
+        return;
+    }
+
+    head[0] = (uint8_t) ((PFT_PACKET << 3) | 2);
+    len = 1 + pb_encode(head + 1, packet->len);
+
+    writer_put(ctx->out, (const char *) head, len);
+    writer_put(ctx->out, (const char *) packet->data, packet->len);
+}
+
+/* Start our sequence and set up its clock. */
+static void perfetto_begin(struct vmpt_context *ctx)
+{
+    struct pb_buf packet, defaults, snapshot, clock;
+
+    ctx->priv = calloc(1, sizeof(struct perfetto));
+    if (!ctx->priv)
+        return;
+
+    memset(&defaults, 0, sizeof(defaults));
+    pb_uint(&defaults, PFT_DEFAULTS_CLOCK_ID, PFT_TSC_CLOCK);
+
+    /* Our clock starts at zero, as does the one it is mapped to. */
+    memset(&snapshot, 0, sizeof(snapshot));
+    memset(&clock, 0, sizeof(clock));
+    pb_uint(&clock, PFT_CLOCK_ID, PFT_TSC_CLOCK);
+    pb_uint(&clock, PFT_CLOCK_TIMESTAMP, 0ull);
+    pb_uint(&clock, PFT_CLOCK_INCREMENTAL, 1ull);
+    pb_uint(&clock, PFT_CLOCK_UNIT_NS, 1ull);
+    pb_message(&snapshot, PFT_CLOCK, &clock);
+
+    memset(&clock, 0, sizeof(clock));
+    pb_uint(&clock, PFT_CLOCK_ID, PFT_BOOTTIME_CLOCK);
+    pb_uint(&clock, PFT_CLOCK_TIMESTAMP, 0ull);
+    pb_message(&snapshot, PFT_CLOCK, &clock);
+
+    memset(&packet, 0, sizeof(packet));
+    pb_uint(&packet, PFT_SEQUENCE_ID, PFT_SEQUENCE);
+    pb_uint(&packet, PFT_SEQUENCE_FLAGS, pf_state_cleared);
+    pb_message(&packet, PFT_PACKET_DEFAULTS, &defaults);
+    pb_message(&packet, PFT_CLOCK_SNAPSHOT, &snapshot);
+    perfetto_packet(ctx, &packet);
+}
+
+/* Write a slice event of @type at @tsc on @pf's current track.
+ *
+ * A @name is interned with the event if @interned is non-zero.
+ */
+static void perfetto_event(struct vmpt_context *ctx, struct perfetto *pf,
+        uint64_t tsc, int type, uint64_t name, int interned)
+{
+    struct pb_buf packet, event;
+
+    /* Timestamps must not go backwards. */
+    if (tsc < pf->clock)
+        tsc = pf->clock;
+
+    memset(&event, 0, sizeof(event));
+    pb_uint(&event, PFT_EVENT_TYPE, (uint64_t) type);
+    pb_uint(&event, PFT_EVENT_TRACK, pf->track);
+    if (name)
+        pb_uint(&event, PFT_EVENT_NAME_IID, name);
+
+    memset(&packet, 0, sizeof(packet));
+    pb_uint(&packet, PFT_TIMESTAMP, tsc - pf->clock);
+    pb_uint(&packet, PFT_SEQUENCE_ID, PFT_SEQUENCE);
+    pb_uint(&packet, PFT_SEQUENCE_FLAGS, pf_needs_state);
+    pb_message(&packet, PFT_TRACK_EVENT, &event);
+    if (interned) {
+        struct pb_buf interned_data, event_name;
+        char str[32];
+        int len;
+
+        len = snprintf(str, sizeof(str), "cr3 %" PRIx64, pf->cr3);
+
+        memset(&event_name, 0, sizeof(event_name));
+        pb_uint(&event_name, PFT_NAME_IID, name);
+        pb_bytes(&event_name, PFT_NAME, str, (size_t) len);
+
+        memset(&interned_data, 0, sizeof(interned_data));
+        pb_message(&interned_data, PFT_INTERNED_NAMES, &event_name);
+        pb_message(&packet, PFT_INTERNED_DATA, &interned_data);
+    }
+
+    perfetto_packet(ctx, &packet);
+    pf->clock = tsc;
+}
+
+/* End the slice we are in at @tsc. */
+static void perfetto_end_slice(struct vmpt_context *ctx, struct perfetto *pf,
+        uint64_t tsc)
+{
+    if (!pf->track)
+        return;
+
+    perfetto_event(ctx, pf, tsc, pf_slice_end, 0ull, 0);
+    pf->track = 0ull;
+}
+
+/* A bundle with another VMCS or CR3 starts a new slice at its TSC. */
+static void perfetto_bundle(struct vmpt_context *ctx,
+        const struct vmpt_bundle *bundle)
+{
+    struct perfetto *pf;
+    uint64_t track, name;
+    int new_track, new_name;
+
+    pf = ctx->priv;
+    if (!pf || pf->error)
+        return;
+
+    if (pf->track && pf->vmcs_base == bundle->vmcs_base &&
+            pf->cr3 == bundle->cr3)
+        return;
+
+    perfetto_end_slice(ctx, pf, bundle->tsc);
+
+    new_track = intern(&pf->tracks, bundle->vmcs_base, &track);
+    new_name = intern(&pf->names, bundle->cr3, &name);
+    if (new_track < 0 || new_name < 0) {
+        pf->error = -pte_nomem;
+        return;
+    }
+
+    if (new_track) {
+        struct pb_buf packet, descriptor;
+        char str[32];
+        int len;
+
+        len = snprintf(str, sizeof(str), "vmcs %" PRIx64,
+                bundle->vmcs_base);
+
+        memset(&descriptor, 0, sizeof(descriptor));
+        pb_uint(&descriptor, PFT_TRACK_UUID, track);
+        pb_bytes(&descriptor, PFT_TRACK_NAME, str, (size_t) len);
+
+        memset(&packet, 0, sizeof(packet));
+        pb_message(&packet, PFT_TRACK_DESCRIPTOR, &descriptor);
+        perfetto_packet(ctx, &packet);
+    }
+
+    pf->track = track;
+    pf->vmcs_base = bundle->vmcs_base;
+    pf->cr3 = bundle->cr3;
+    perfetto_event(ctx, pf, bundle->tsc, pf_slice_begin, name, new_name);
+}
+
+/* The last slice lasts as far as we can tell. */
+static void perfetto_gap(struct vmpt_context *ctx)
+{
+    struct perfetto *pf;
+
+    pf = ctx->priv;
+    if (!pf || pf->error)
+        return;
+
+    perfetto_end_slice(ctx, pf, ctx->dec.got_tsc ? ctx->dec.last_tsc :
+            pf->clock);
+}
+
+static void perfetto_end(struct vmpt_context *ctx)
+{
+    struct perfetto *pf;
+
+    perfetto_gap(ctx);
+
+    pf = ctx->priv;
+    ctx->priv = NULL;
+    if (!pf || pf->error)
+        ctx->error = pf ? pf->error : -pte_nomem;
+
+    if (pf) {
+        free(pf->tracks.slots);
+        free(pf->names.slots);
+    }
+    free(pf);
+}
+
+static const struct bundle_format perfetto_format = {
+    "bundles.pftrace",
+    perfetto_begin,
+    perfetto_end,
+    NULL,
+    NULL,
+    perfetto_bundle,
+    NULL,
+    perfetto_gap,
+    NULL,
+    0
+};
+
+/* The state of --format=packed; see vmpt-bin.h for the format. */
+struct packed {
+    /* The ids of the VMCS bases and cr3s we wrote. */
+    struct intern_table vmcs_ids, cr3_ids;
+
+    /* The previous bundle's. */
+    uint64_t vmcs_base, cr3, tsc;
+
+    /* Non-zero if we ran out of memory. */
+    int error;
+};
+
+static void packed_begin(struct vmpt_context *ctx)
+{
+    struct vmpt_bin_header header;
+
+    ctx->priv = calloc(1, sizeof(struct packed));
+
+    vmpt_pack_header_init(&header);
+    writer_put(ctx->out, (const char *) &header, sizeof(header));
+}
+
+/* Put @value into @record as @table's id for it or, if it is new, as
+ * itself with @new_flag set in @flags.
+ *
+ * Returns the bytes we put, zero if we ran out of memory.
+ */
+static size_t packed_value(uint8_t *record, struct intern_table *table,
+        uint64_t value, uint8_t *flags, uint8_t new_flag)
+{
+    uint64_t id;
+    int errcode;
+
+    errcode = intern(table, value, &id);
+    if (errcode < 0)
+        return 0;
+
+    if (errcode) {
+        *flags |= new_flag;
+        return pb_encode(record, value);
+    }
+
+    return pb_encode(record, id);
+}
+
+static void packed_bundle(struct vmpt_context *ctx,
+        const struct vmpt_bundle *bundle)
+{
+    struct packed *pk;
+    uint8_t record[1 + 3 * 10];
+    uint64_t delta;
+    size_t len, put;
+    uint8_t flags;
+    int first;
+
+    pk = ctx->priv;
+    if (!pk || pk->error)
+        return;
+
+    first = !pk->vmcs_ids.count;
+    flags = bundle->nr ? vpf_nr : 0;
+    len = 1;
+
+    if (!first && bundle->vmcs_base == pk->vmcs_base)
+        flags |= vpf_same_vmcs;
+    else {
+        put = packed_value(record + len, &pk->vmcs_ids, bundle->vmcs_base,
+                &flags, vpf_new_vmcs);
+        if (!put)
+            goto nomem;
+
+        len += put;
+    }
+
+    if (!first && bundle->cr3 == pk->cr3)
+        flags |= vpf_same_cr3;
+    else {
+        put = packed_value(record + len, &pk->cr3_ids, bundle->cr3,
+                &flags, vpf_new_cr3);
+        if (!put)
+            goto nomem;
+
+        len += put;
+    }
+
+    if (bundle->tsc < pk->tsc) {
+        flags |= vpf_tsc_back;
+        delta = pk->tsc - bundle->tsc;
+    } else
+        delta = bundle->tsc - pk->tsc;
+
+    len += pb_encode(record + len, delta);
+    record[0] = flags;
+
+    writer_put(ctx->out, (const char *) record, len);
+
+    pk->vmcs_base = bundle->vmcs_base;
+    pk->cr3 = bundle->cr3;
+    pk->tsc = bundle->tsc;
+    return;
+
+nomem:
+    pk->error = -pte_nomem;
+}
+
+static void packed_end(struct vmpt_context *ctx)
+{
+    struct packed *pk;
+
+    pk = ctx->priv;
+    ctx->priv = NULL;
+    if (!pk || pk->error)
+        ctx->error = pk ? pk->error : -pte_nomem;
+
+    if (pk) {
+        free(pk->vmcs_ids.slots);
+        free(pk->cr3_ids.slots);
+    }
+    free(pk);
+}
+
+static const struct bundle_format packed_format = {
+    "bundles.vpk",
+    packed_begin,
+    packed_end,
+    NULL,
+    NULL,
+    packed_bundle,
+    NULL,
+    NULL,
+    NULL,
+    0
+};
+
+/* A flight recorder for --ring.
+ *
+ * We keep the most recent bundles in a ring of binary bundle records that
+ * is allocated up front, so memory stays the same however long we run.
+ * The ring is written out in the --format=bin layout on SIGUSR1, when a
+ * VMCS holds the cpu for longer than the --trigger-hold ticks, and at the
+ * end.  The end's dump goes to the output; the others go to
+ * <output>.<n> for the n-th of them, or to ring.bin.<n> if the output is
+ * not a file.
+ */
+struct flight_ring {
+    struct vmpt_bin_record *records;
+    size_t capacity;
+
+    /* The number of bundles we saw; the newest is at (count - 1) modulo
+     * capacity.
+     */
+    uint64_t count;
+
+    /* Only keep bundles up to this many TSC ticks older than the newest
+     * one - zero to keep all that fit.
+     */
+    uint64_t ticks;
+
+    /* Dump when a VMCS holds the cpu for longer than this many TSC ticks -
+     * zero for never.
+     */
+    uint64_t trigger;
+
+    /* The VMCS holding the cpu and the TSC it got it at, and whether we
+     * dumped the ring for holding it too long.
+     */
+    uint64_t vmcs_base, start;
+    int holding, fired;
+
+    /* Where the dumps go and how many we wrote. */
+    const char *path;
+    unsigned int ndumps;
+};
+
+/* Set by SIGUSR1 to ask for a dump. */
+static volatile sig_atomic_t ring_request;
+
+static void ring_signal(int signum)
+{
+    (void) signum;
+
+    ring_request = 1;
+}
+
+/* Write @len bytes from @buf to @fd.
+ *
+ * Returns zero on success and -1 otherwise.
+ */
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *pos;
+
+    for (pos = buf; len;) {
+        ssize_t written;
+
+        written = write(fd, pos, len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        pos += written;
+        len -= (size_t) written;
+    }
+
+    return 0;
+}
+
+/* The oldest record in @ring to dump and the number of records from it. */
+static size_t ring_span(const struct flight_ring *ring, uint64_t *first)
+{
+    uint64_t newest, idx;
+    size_t n;
+
+    n = ring->count < ring->capacity ? (size_t) ring->count : ring->capacity;
+    *first = ring->count - n;
+    if (!n || !ring->ticks)
+        return n;
+
+    /* Bundles are in TSC order but for TSCs that went backwards. */
+    newest = ring->records[(ring->count - 1) % ring->capacity].tsc;
+    for (idx = *first; idx < ring->count; ++idx) {
+        uint64_t tsc;
+
+        tsc = ring->records[idx % ring->capacity].tsc;
+        if (tsc <= newest && newest - tsc <= ring->ticks)
+            break;
+    }
+
+    n -= (size_t) (idx - *first);
+    *first = idx;
+
+    return n;
+}
+
+/* Write the records of @ring oldest first to @fd.
+ *
+ * Returns the number of records on success and -1 otherwise.
+ */
+static int64_t ring_write(const struct flight_ring *ring, int fd)
+{
+    struct vmpt_bin_header header;
+    uint64_t first;
+    size_t n, begin, len;
+
+    n = ring_span(ring, &first);
+
+    vmpt_bin_header_init(&header);
+    if (write_all(fd, &header, sizeof(header)) < 0)
+        return -1;
+
+    begin = (size_t) (first % ring->capacity);
+    len = ring->capacity - begin < n ? ring->capacity - begin : n;
+    if (write_all(fd, &ring->records[begin], len * sizeof(*ring->records)) <
+            0 || write_all(fd, ring->records,
+                (n - len) * sizeof(*ring->records)) < 0)
+        return -1;
+
+    return (int64_t) n;
+}
+
+/* Dump @ring to the next <path>.<n> because of @why. */
+static void ring_dump(struct flight_ring *ring, const char *why)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    int64_t nrecords;
+    int fd, len;
+
+    ring->ndumps += 1;
+    len = snprintf(path, sizeof(path), "%s.%u", ring->path, ring->ndumps);
+    if (len < 0 || sizeof(path) <= (size_t) len ||
+            sizeof(tmp) <= (size_t) snprintf(tmp, sizeof(tmp), "%s.tmp",
+                path)) {
+        fprintf(stderr, "ring: dump path too long.\n");
+        return;
+    }
+
+    /* Readers never see a partial dump. */
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "ring: failed to open %s: %d.\n", tmp, errno);
+        return;
+    }
+
+    nrecords = ring_write(ring, fd);
+    if (close(fd) < 0 || nrecords < 0 || rename(tmp, path) < 0) {
+        fprintf(stderr, "ring: failed to write %s: %d.\n", path, errno);
+        (void) unlink(tmp);
+        return;
+    }
+
+    fprintf(stderr, "ring: wrote %" PRId64 " bundles to %s (%s).\n",
+            nrecords, path, why);
+}
+
+/* Dump the ring if SIGUSR1 asked for it. */
+static void ring_poll(struct vmpt_context *ctx)
+{
+    if (!ring_request)
+        return;
+
+    ring_request = 0;
+    ring_dump(ctx->priv, "SIGUSR1");
+}
+
+static void ring_bundle(struct vmpt_context *ctx,
+        const struct vmpt_bundle *bundle)
+{
+    struct flight_ring *ring;
+    struct vmpt_bin_record *record;
+
+    ring = ctx->priv;
+    record = &ring->records[ring->count % ring->capacity];
+    record->cr3 = bundle->cr3;
+    record->vmcs_base = bundle->vmcs_base;
+    record->tsc = bundle->tsc;
+    record->nr = bundle->nr;
+    record->reserved = 0;
+    ring->count += 1;
+
+    /* The VMCS holds the cpu until this bundle, whether it is still in it
+     * or another VMCS took over.
+     */
+    if (ring->holding && ring->trigger && !ring->fired &&
+            ring->start < bundle->tsc &&
+            ring->trigger < bundle->tsc - ring->start) {
+        char why[64];
+
+        snprintf(why, sizeof(why), "vmcs %" PRIx64 " held the cpu for %"
+                PRIu64 " ticks", ring->vmcs_base, bundle->tsc - ring->start);
+        ring->fired = 1;
+        ring_dump(ring, why);
+    }
+
+    if (!ring->holding || ring->vmcs_base != bundle->vmcs_base) {
+        ring->vmcs_base = bundle->vmcs_base;
+        ring->start = bundle->tsc;
+        ring->holding = 1;
+        ring->fired = 0;
+    }
+
+    ring_poll(ctx);
+}
+
+static void ring_psb(struct vmpt_context *ctx, uint64_t offset)
+{
+    (void) offset;
+
+    ring_poll(ctx);
+}
+
+/* We cannot tell who held the cpu in a gap. */
+static void ring_gap(struct vmpt_context *ctx)
+{
+    struct flight_ring *ring;
+
+    ring = ctx->priv;
+    ring->holding = 0;
+}
+
+/* The last dump goes to the output. */
+static void ring_end(struct vmpt_context *ctx)
+{
+    struct flight_ring *ring;
+    struct vmpt_bin_header header;
+    uint64_t first;
+
+    ring = ctx->priv;
+    (void) ring_span(ring, &first);
+
+    vmpt_bin_header_init(&header);
+    writer_put(ctx->out, (const char *) &header, sizeof(header));
+
+    for (; first < ring->count; ++first)
+        writer_put(ctx->out,
+                (const char *) &ring->records[first % ring->capacity],
+                sizeof(*ring->records));
+}
+
+static const struct bundle_format ring_format = {
+    "ring.bin",
+    NULL,
+    ring_end,
+    NULL,
+    NULL,
+    ring_bundle,
+    ring_psb,
+    ring_gap,
+    ring_poll,
+    0
+};
+
+static const uint8_t psb_pattern[16] = {
+    0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82,
+    0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82
+};
+
+/* Find the first or, if @last is non-zero, the last PSB in @config's buffer.
+ *
+ * Like a decoder that is not synced, we do not look for the first PSB at the
+ * very start of the buffer.
+ *
+ * Returns zero and its offset in @offset on success, -pte_eos if there is no
+ * PSB, and a negative pt_error_code otherwise.
+ */
+static int find_psb(uint64_t *offset, const struct pt_config *config,
+        int last)
+{
+    struct pt_packet_decoder *decoder;
+    int errcode;
+
+    decoder = pt_pkt_alloc_decoder(config);
+    if (!decoder)
+        return -pte_nomem;
+
+    if (last)
+        errcode = pt_pkt_sync_backward(decoder);
+    else {
+        errcode = pt_pkt_sync_set(decoder, 0ull);
+        if (errcode >= 0)
+            errcode = pt_pkt_sync_forward(decoder);
+    }
+
+    if (errcode >= 0)
+        errcode = pt_pkt_get_sync_offset(decoder, offset);
+
+    pt_pkt_free_decoder(decoder);
+    return errcode;
+}
+
+static int read_window(uint8_t *buffer, size_t size, int fd, uint64_t pos,
+        const char *prog)
+{
+    ssize_t got;
+    size_t done;
+
+    for (done = 0; done < size; done += got) {
+        errno = 0;
+        got = pread(fd, buffer + done, size - done, pos + done);
+        if (got <= 0) {
+            fprintf(stderr, "%s: failed to read trace at 0x%" PRIx64
+                    ": %d.\n", prog, pos + done, errno);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Decode the window of trace in @config.
+ *
+ * If @more is non-zero, more trace follows the window.  We then cut the
+ * window at the last PSB it contains or, if there is none, where the decoder
+ * stopped in front of the partial packet at its end.  The offset at which the
+ * next window should start is returned in @next; the rest of this window has
+ * not been decoded.
+ *
+ * @synced says whether the window starts at a packet boundary.  It is updated
+ * for the next window.  If the decoder lost sync at the end of a window
+ * without a PSB, the next window has to search for a PSB.  It starts in front
+ * of the last bytes of this one, which may hold the start of a PSB.  A window
+ * we are not synced in is not decoded unless it is the last one: the next one
+ * starts at its first PSB.  If it has none, there is nothing to decode yet;
+ * this is only reported if the whole trace has no PSB, like in a decode of
+ * all of it.
+ */
+static int dump_window(struct vmpt_context *ctx, struct pt_config *config,
+        int more, int *synced, uint64_t *next)
+{
+    uint64_t size, limit, stop, keep;
+    int errcode;
+
+    size = (uint64_t) (config->end - config->begin);
+
+    /* The part of a window we carry over while searching for a PSB. */
+    keep = size < sizeof(psb_pattern) ? 0ull : size - sizeof(psb_pattern);
+
+    if (!*synced) {
+        errcode = find_psb(&limit, config, 0);
+        if (errcode == -pte_eos &&
+                (more || ctx->dec.stats.packets[ppt_psb])) {
+            *next = more ? keep : size;
+            ctx->dec.stats.bytes += *next;
+            return 0;
+        }
+
+        if (!errcode && more) {
+            *next = limit;
+            *synced = 1;
+            ctx->dec.stats.bytes += limit;
+            return 0;
+        }
+    }
+
+    limit = 0ull;
+    if (more) {
+        errcode = find_psb(&limit, config, 1);
+        if (errcode < 0)
+            limit = 0ull;
+    }
+
+    if (limit)
+        config->end = config->begin + limit;
+
+    stop = 0ull;
+    errcode = vmpt_decode(&ctx->dec, config, *synced, limit ? NULL : &stop);
+
+    if (limit)
+        *synced = 1;
+    else {
+        *synced = !errcode;
+        limit = *synced ? stop : keep;
+
+        /* The rest is decoded again with the next window. */
+        if (more)
+            ctx->dec.stats.bytes -= size - limit;
+    }
+
+    *next = limit;
+    return errcode;
+}
+
+/* The size of a chunk of decompressed trace and the number of chunks the
+ * decompressor may run ahead of the decoder.
+ */
+static const size_t inflate_chunk_size = 1024 * 1024;
+#define INFLATE_DEPTH 4
+
+/* The size of the compressed trace we read at once. */
+static const size_t inflate_read_size = 256 * 1024;
+
+/* A chunk of decompressed trace. */
+struct inflate_chunk {
+    uint8_t *buf;
+
+    /* The number of bytes in the chunk - zero at the end of the trace. */
+    size_t len;
+};
+
+/* A compressed trace decompressed on its own thread.
+ *
+ * The decompressor fills a ring of chunks that the decoder drains in order,
+ * like the output ring in struct vmpt_writer.
+ */
+struct inflate {
+    /* The compressed trace and the codec (enum writer_codec). */
+    int fd, codec;
+    uint64_t pos, end;
+
+    /* The ring of chunks, the decompressor's and the decoder's position in
+     * it, and the number of filled and free chunks.
+     */
+    struct inflate_chunk chunks[INFLATE_DEPTH];
+    size_t head, tail;
+    sem_t filled, free;
+    pthread_t thread;
+
+    /* A negative pt_error_code if decompression failed, and whether it
+     * failed because the trace ended in the middle of a frame.
+     */
+    int error, truncated;
+
+    /* The decoder's chunk and how much of it was consumed - the chunk is
+     * NULL if the decoder does not hold one.
+     */
+    struct inflate_chunk *current;
+    size_t consumed;
+};
+
+/* The magic numbers at the start of zstd and lz4 frames. */
+static const uint8_t zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+static const uint8_t lz4_magic[] = { 0x04, 0x22, 0x4d, 0x18 };
+
+/* The codec (enum writer_codec) the trace in @fd is compressed with.
+ *
+ * We look at the start of the file, whatever range of it we decode.
+ */
+static int input_codec(int fd)
+{
+    uint8_t magic[4];
+
+    if (pread(fd, magic, sizeof(magic), 0) != (ssize_t) sizeof(magic))
+        return wc_none;
+
+    if (!memcmp(magic, zstd_magic, sizeof(magic)))
+        return wc_zstd;
+
+    if (!memcmp(magic, lz4_magic, sizeof(magic)))
+        return wc_lz4;
+
+    return wc_none;
+}
+
+#if defined(HAVE_ZSTD) || defined(HAVE_LZ4)
+/* Read the next block of compressed trace into @buf of @size bytes. */
+static ssize_t inflate_read(struct inflate *inf, uint8_t *buf, size_t size)
+{
+    ssize_t got;
+
+    if (inf->end - inf->pos < size)
+        size = (size_t) (inf->end - inf->pos);
+
+    if (!size)
+        return 0;
+
+    do {
+        got = pread(inf->fd, buf, size, (off_t) inf->pos);
+    } while (got < 0 && errno == EINTR);
+
+    if (got <= 0)
+        return -pte_bad_file;
+
+    inf->pos += (uint64_t) got;
+    return got;
+}
+#endif /* defined(HAVE_ZSTD) || defined(HAVE_LZ4) */
+
+/* Hand the chunk we filled with @len bytes to the decoder and wait for the
+ * next one.
+ */
+static struct inflate_chunk *inflate_push(struct inflate *inf, size_t len)
+{
+    inf->chunks[inf->head % INFLATE_DEPTH].len = len;
+    inf->head += 1;
+    sem_post(&inf->filled);
+
+    if (!len)
+        return NULL;
+
+    while (sem_wait(&inf->free) && errno == EINTR)
+        ;
+
+    return &inf->chunks[inf->head % INFLATE_DEPTH];
+}
+
+#ifdef HAVE_ZSTD
+static int inflate_zstd(struct inflate *inf, uint8_t *ibuf, size_t isize)
+{
+    struct inflate_chunk *chunk;
+    ZSTD_DCtx *dctx;
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    int errcode, full, partial;
+
+    dctx = ZSTD_createDCtx();
+    if (!dctx)
+        return -pte_nomem;
+
+    chunk = &inf->chunks[inf->head % INFLATE_DEPTH];
+    out.dst = chunk->buf;
+    out.size = inflate_chunk_size;
+    out.pos = 0;
+
+    in.src = ibuf;
+    in.size = 0;
+    in.pos = 0;
+
+    /* A full chunk may leave output behind that we have to collect before
+     * we can give up on running out of input.  A call that makes progress
+     * returns zero at the end of a frame, so we know whether the trace ends
+     * in the middle of one.
+     */
+    errcode = 0;
+    partial = 0;
+    for (full = 0;;) {
+        size_t status, ipos, opos;
+
+        if (in.pos == in.size && !full) {
+            ssize_t got;
+
+            got = inflate_read(inf, ibuf, isize);
+            if (!got && partial) {
+                inf->truncated = 1;
+                got = -pte_bad_file;
+            }
+
+            if (got <= 0) {
+                errcode = (int) got;
+                break;
+            }
+
+            in.size = (size_t) got;
+            in.pos = 0;
+        }
+
+        ipos = in.pos;
+        opos = out.pos;
+        status = ZSTD_decompressStream(dctx, &out, &in);
+        if (ZSTD_isError(status)) {
+            errcode = -pte_bad_file;
+            break;
+        }
+
+        if (in.pos != ipos || out.pos != opos)
+            partial = status != 0;
+
+        full = out.pos == out.size;
+        if (full) {
+            chunk = inflate_push(inf, out.pos);
+            out.dst = chunk->buf;
+            out.pos = 0;
+        }
+    }
+
+    if (out.pos)
+        (void) inflate_push(inf, out.pos);
+
+    ZSTD_freeDCtx(dctx);
+    return errcode;
+}
+#endif /* HAVE_ZSTD */
+
+#ifdef HAVE_LZ4
+static int inflate_lz4(struct inflate *inf, uint8_t *ibuf, size_t isize)
+{
+    LZ4F_decompressionContext_t dctx;
+    struct inflate_chunk *chunk;
+    int errcode, full, partial;
+    size_t ipos, ilen, opos;
+
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+        return -pte_nomem;
+
+    chunk = &inf->chunks[inf->head % INFLATE_DEPTH];
+    opos = 0;
+    ipos = ilen = 0;
+
+    /* Like for zstd, we track whether we are in the middle of a frame. */
+    errcode = 0;
+    partial = 0;
+    for (full = 0;;) {
+        size_t osize, consumed, status;
+
+        if (ipos == ilen && !full) {
+            ssize_t got;
+
+            got = inflate_read(inf, ibuf, isize);
+            if (!got && partial) {
+                inf->truncated = 1;
+                got = -pte_bad_file;
+            }
+
+            if (got <= 0) {
+                errcode = (int) got;
+                break;
+            }
+
+            ilen = (size_t) got;
+            ipos = 0;
+        }
+
+        osize = inflate_chunk_size - opos;
+        consumed = ilen - ipos;
+        status = LZ4F_decompress(dctx, chunk->buf + opos, &osize,
+                ibuf + ipos, &consumed, NULL);
+        if (LZ4F_isError(status)) {
+            errcode = -pte_bad_file;
+            break;
+        }
+
+        if (consumed || osize)
+            partial = status != 0;
+
+        ipos += consumed;
+        opos += osize;
+        full = opos == inflate_chunk_size;
+        if (full) {
+            chunk = inflate_push(inf, opos);
+            opos = 0;
+        }
+    }
+
+    if (opos)
+        (void) inflate_push(inf, opos);
+
+    LZ4F_freeDecompressionContext(dctx);
+    return errcode;
+}
+#endif /* HAVE_LZ4 */
+
+static void *inflate_thread(void *arg)
+{
+    struct inflate *inf;
+    uint8_t *ibuf;
+    int errcode;
+
+    inf = arg;
+
+    errcode = -pte_nomem;
+    ibuf = malloc(inflate_read_size);
+    if (ibuf) {
+        switch (inf->codec) {
+#ifdef HAVE_ZSTD
+        case wc_zstd:
+            errcode = inflate_zstd(inf, ibuf, inflate_read_size);
+            break;
+#endif
+
+#ifdef HAVE_LZ4
+        case wc_lz4:
+            errcode = inflate_lz4(inf, ibuf, inflate_read_size);
+            break;
+#endif
+
+        default:
+            errcode = -pte_not_supported;
+            break;
+        }
+    }
+
+    free(ibuf);
+
+    /* The decoder reads the error once it sees the end. */
+    inf->error = errcode;
+    (void) inflate_push(inf, 0);
+
+    return NULL;
+}
+
+/* Decompress [@begin, @end) of @fd, which is compressed with @codec. */
+static int inflate_start(struct inflate *inf, int fd, int codec,
+        uint64_t begin, uint64_t end)
+{
+    size_t idx;
+    int errcode;
+
+    memset(inf, 0, sizeof(*inf));
+    inf->fd = fd;
+    inf->codec = codec;
+    inf->pos = begin;
+    inf->end = end;
+
+    for (idx = 0; idx < INFLATE_DEPTH; ++idx) {
+        inf->chunks[idx].buf = malloc(inflate_chunk_size);
+        if (!inf->chunks[idx].buf)
+            goto err;
+    }
+
+    /* The decompressor is filling the first chunk. */
+    sem_init(&inf->filled, 0, 0);
+    sem_init(&inf->free, 0, (unsigned int) INFLATE_DEPTH - 1);
+
+    errcode = pthread_create(&inf->thread, NULL, inflate_thread, inf);
+    if (errcode) {
+        sem_destroy(&inf->filled);
+        sem_destroy(&inf->free);
+        goto err;
+    }
+
+    return 0;
+
+err:
+    for (idx = 0; idx < INFLATE_DEPTH; ++idx)
+        free(inf->chunks[idx].buf);
+
+    return -pte_nomem;
+}
+
+/* Release the decoder's chunk, if it holds one. */
+static void inflate_release(struct inflate *inf)
+{
+    if (!inf->current)
+        return;
+
+    inf->current = NULL;
+    inf->consumed = 0;
+    inf->tail += 1;
+    sem_post(&inf->free);
+}
+
+/* Make sure the decoder holds a chunk with data; NULL at the end. */
+static struct inflate_chunk *inflate_current(struct inflate *inf)
+{
+    struct inflate_chunk *chunk;
+
+    chunk = inf->current;
+    if (chunk && inf->consumed < chunk->len)
+        return chunk;
+
+    /* The end of the trace stays with us. */
+    if (chunk && !chunk->len)
+        return NULL;
+
+    inflate_release(inf);
+
+    while (sem_wait(&inf->filled) && errno == EINTR)
+        ;
+
+    chunk = &inf->chunks[inf->tail % INFLATE_DEPTH];
+    inf->current = chunk;
+    inf->consumed = 0;
+
+    return chunk->len ? chunk : NULL;
+}
+
+/* Stop the decompressor, which may be waiting for a free chunk. */
+static void inflate_stop(struct inflate *inf)
+{
+    size_t idx;
+
+    /* Hand back chunks until we see the end. */
+    while (inflate_current(inf))
+        inf->consumed = inf->current->len;
+
+    pthread_join(inf->thread, NULL);
+
+    sem_destroy(&inf->filled);
+    sem_destroy(&inf->free);
+    for (idx = 0; idx < INFLATE_DEPTH; ++idx)
+        free(inf->chunks[idx].buf);
+}
+
+/* Where dump_stream() reads the trace from. */
+struct trace_source {
+    /* The [pos, end) range of the trace file we still have to read. */
+    int fd;
+    uint64_t pos, end;
+
+    /* The decompressor for a compressed trace - NULL otherwise. */
+    struct inflate *inflate;
+
+    const char *prog;
+};
+
+/* Read up to @size bytes of trace into @buffer.
+ *
+ * Returns the number of bytes read, which is less than @size only at the end
+ * of the trace, or a negative pt_error_code.
+ */
+static int64_t source_read(struct trace_source *src, uint8_t *buffer,
+        size_t size)
+{
+    struct inflate_chunk *chunk;
+    size_t done;
+
+    if (!src->inflate) {
+        if (src->end - src->pos < size)
+            size = (size_t) (src->end - src->pos);
+
+        if (read_window(buffer, size, src->fd, src->pos, src->prog) < 0)
+            return -pte_bad_file;
+
+        src->pos += size;
+        return (int64_t) size;
+    }
+
+    for (done = 0; done < size; ) {
+        size_t n;
+
+        chunk = inflate_current(src->inflate);
+        if (!chunk)
+            break;
+
+        n = chunk->len - src->inflate->consumed;
+        if (size - done < n)
+            n = size - done;
+
+        memcpy(buffer + done, chunk->buf + src->inflate->consumed, n);
+        src->inflate->consumed += n;
+        done += n;
+    }
+
+    if (done < size && src->inflate->error < 0) {
+        if (src->inflate->truncated)
+            fprintf(stderr, "%s: failed to decompress trace: it ends in "
+                    "the middle of a frame.\n", src->prog);
+        else
+            fprintf(stderr, "%s: failed to decompress trace: %s.\n",
+                    src->prog, pt_errstr(pt_errcode(src->inflate->error)));
+        return src->inflate->error;
+    }
+
+    return (int64_t) done;
+}
+
+/* Whether more trace follows what we have read so far. */
+static int source_more(struct trace_source *src)
+{
+    if (!src->inflate)
+        return src->pos < src->end;
+
+    return inflate_current(src->inflate) != NULL;
+}
+
+/* Decode [@begin, @end) of @fd in windows of @options->window bytes.
+ *
+ * The part of each window that dump_window() did not decode is carried over
+ * to the front of the next window, so no packet is split and all but the
+ * first window start at a PSB.  The bundle state carries over from one window
+ * to the next.  If @synced is non-zero, @begin is at a PSB and @ctx is in
+ * the bundle state at it, so the first window also starts there.
+ *
+ * If the trace is compressed with @codec, it is decompressed on another
+ * thread while we decode and fed into the windows as it comes in.
+ */
+static int dump_stream(struct vmpt_context *ctx, struct pt_config *config,
+        int fd, int codec, uint64_t begin, uint64_t end, int synced,
+        const struct vmpt_options *options, const char *prog)
+{
+    struct trace_source src;
+    struct inflate inflate;
+    size_t window, carry;
+    uint8_t *buffer;
+    uint64_t base;
+    int errcode;
+
+    window = options->window ? options->window : default_window;
+    buffer = malloc(window);
+    if (!buffer) {
+        fprintf(stderr, "%s: failed to allocate %zu byte window.\n",
+                prog, window);
+        return -pte_nomem;
+    }
+
+    (void) posix_fadvise(fd, (off_t) begin, (off_t) (end - begin),
+            POSIX_FADV_SEQUENTIAL);
+
+    memset(&src, 0, sizeof(src));
+    src.fd = fd;
+    src.pos = begin;
+    src.end = end;
+    src.prog = prog;
+
+    if (codec) {
+        errcode = inflate_start(&inflate, fd, codec, begin, end);
+        if (errcode < 0) {
+            fprintf(stderr, "%s: failed to start decompression.\n", prog);
+            free(buffer);
+            return errcode;
+        }
+
+        src.inflate = &inflate;
+    }
+
+    errcode = 0;
+    base = begin;
+    carry = 0;
+    for (;;) {
+        uint64_t next;
+        int64_t got;
+        size_t size;
+        int more;
+
+        got = source_read(&src, buffer + carry, window - carry);
+        if (got < 0) {
+            errcode = (int) got;
+            break;
+        }
+
+        size = carry + (size_t) got;
+        more = source_more(&src);
+
+        config->begin = buffer;
+        config->end = buffer + size;
+        ctx->dec.base = base;
+
+        errcode = dump_window(ctx, config, more, &synced, &next);
+        if (errcode < 0 && errcode != -pte_eos)
+            break;
+
+        if (!more)
+            break;
+
+        carry = size - (size_t) next;
+        memmove(buffer, buffer + next, carry);
+        base += next;
+    }
+
+    if (codec)
+        inflate_stop(&inflate);
+
+    free(buffer);
+    return errcode;
+}
+
+/* A trace opened for decoding by open_trace(). */
+struct trace_input {
+    /* The trace file and the [begin, end) range to decode if it is decoded
+     * in windows, or -1 if it was loaded into tb.
+     */
+    int fd;
+    uint64_t begin, end;
+
+    /* The codec (enum writer_codec) the trace is compressed with. */
+    int codec;
+
+    struct vmpt_trace tb;
+};
+
+/* Open @arg and, unless it is decoded in windows, load it into @config.
+ *
+ * The first @skip bytes of the trace are left out.  Compressed traces are
+ * always decoded in windows.
+ */
+static int open_trace(struct trace_input *in, struct pt_config *config,
+        char *arg, uint64_t skip, const struct vmpt_options *options,
+        const char *prog)
+{
+    struct stat st;
+    int errcode;
+
+    memset(in, 0, sizeof(*in));
+
+    in->fd = open_file(&in->begin, &in->end, arg, prog);
+    if (in->fd < 0)
+        return -pte_bad_file;
+
+    in->codec = input_codec(in->fd);
+    if (in->codec) {
+        errcode = -pte_bad_file;
+        if (!writer_has_codec(in->codec))
+            fprintf(stderr, "%s: %s is compressed; built without support for "
+                    "its codec.\n", prog, arg);
+        else if (fstat(in->fd, &st) < 0 || in->begin || skip ||
+                in->end != (uint64_t) st.st_size)
+            fprintf(stderr, "%s: %s is compressed; ranges are not "
+                    "supported.\n", prog, arg);
+        else if (options->prefilter || options->jobs > 1)
+            fprintf(stderr, "%s: %s is compressed; --prefilter and -j need "
+                    "an uncompressed trace.\n", prog, arg);
+        else
+            return 0;
+
+        goto err;
+    }
+
+    if (in->end - in->begin < skip) {
+        fprintf(stderr, "%s: %s is shorter than %" PRIu64 " bytes.\n", prog,
+                arg, skip);
+        errcode = -pte_bad_file;
+        goto err;
+    }
+
+    in->begin += skip;
+    if (options->window)
+        return 0;
+
+    errcode = load_range(&in->tb, in->fd, in->begin, in->end, options, arg,
+            prog);
+    if (errcode < 0) {
+        errcode = -pte_bad_file;
+        goto err;
+    }
+
+    close(in->fd);
+    in->fd = -1;
+
+    config->begin = in->tb.begin;
+    config->end = in->tb.begin + in->tb.size;
+
+    return 0;
+
+err:
+    close(in->fd);
+    in->fd = -1;
+    return errcode;
+}
+
+static void close_trace(struct trace_input *in)
+{
+    if (in->fd >= 0)
+        close(in->fd);
+
+    vmpt_trace_unload(&in->tb);
+    in->fd = -1;
+}
+
+/* How the prefilter scans the trace. */
+enum prefilter_mode {
+    pfm_off,
+
+    /* Use the best scan the cpu supports. */
+    pfm_auto,
+
+    pfm_scalar,
+    pfm_avx2,
+    pfm_avx512
+};
+
+/* Classes of packets the prefilter looks for.
+ *
+ * A class is a set of opcode bytes.  The scan does not know packet
+ * boundaries, so a class may show up in other packets' payloads; but every
+ * packet of the class shows up.
+ */
+enum prefilter_class {
+    pfc_pip = 1 << 0,
+    pfc_vmcs = 1 << 1,
+    pfc_tsc = 1 << 2,
+    pfc_pad = 1 << 3
+};
+
+/* A PSB segment and the classes of packets it may contain. */
+struct prefilter_segment {
+    uint64_t begin;
+    uint32_t classes;
+};
+
+/* The result of a prefilter scan. */
+struct prefilter {
+    const uint8_t *begin;
+    uint64_t size;
+
+    /* The segments in trace order; the first one starts at offset zero. */
+    struct prefilter_segment *segments;
+    size_t nsegments, capacity;
+
+    /* The offset following the last PSB we found. */
+    uint64_t psb_end;
+};
+
+static int prefilter_add(struct prefilter *pf, uint64_t begin)
+{
+    if (pf->nsegments == pf->capacity) {
+        struct prefilter_segment *segments;
+        size_t capacity;
+
+        capacity = pf->capacity ? pf->capacity * 2 : 1024;
+        segments = realloc(pf->segments, capacity * sizeof(*segments));
+        if (!segments)
+            return -pte_nomem;
+
+        pf->segments = segments;
+        pf->capacity = capacity;
+    }
+
+    pf->segments[pf->nsegments].begin = begin;
+    pf->segments[pf->nsegments].classes = 0;
+    pf->nsegments += 1;
+
+    return 0;
+}
+
+static inline uint32_t prefilter_classes(uint64_t pip, uint64_t vmcs,
+        uint64_t tsc, uint64_t pad)
+{
+    return (pip ? pfc_pip : 0) | (vmcs ? pfc_vmcs : 0) |
+        (tsc ? pfc_tsc : 0) | (pad ? pfc_pad : 0);
+}
+
+/* Account the candidate masks of the 64 bytes at @offset.
+ *
+ * Bit i of each mask stands for the byte at @offset + i.  The @psb mask has
+ * candidate PSB starts that still need to be checked.
+ */
+static int prefilter_block(struct prefilter *pf, uint64_t offset,
+        uint64_t pip, uint64_t vmcs, uint64_t tsc, uint64_t pad,
+        uint64_t psb)
+{
+    while (psb) {
+        uint64_t begin, below;
+        int bit, errcode;
+
+        bit = __builtin_ctzll(psb);
+        psb &= psb - 1;
+
+        begin = offset + (uint64_t) bit;
+        if (begin < pf->psb_end || pf->size < begin + sizeof(psb_pattern) ||
+                memcmp(pf->begin + begin, psb_pattern, sizeof(psb_pattern)))
+            continue;
+
+        /* What comes before the PSB belongs to the previous segment. */
+        below = (1ull << bit) - 1ull;
+        pf->segments[pf->nsegments - 1].classes |=
+            prefilter_classes(pip & below, vmcs & below, tsc & below,
+                    pad & below);
+
+        pip &= ~below;
+        vmcs &= ~below;
+        tsc &= ~below;
+        pad &= ~below;
+
+        errcode = prefilter_add(pf, begin);
+        if (errcode < 0)
+            return errcode;
+
+        pf->psb_end = begin + sizeof(psb_pattern);
+    }
+
+    pf->segments[pf->nsegments - 1].classes |=
+        prefilter_classes(pip, vmcs, tsc, pad);
+
+    return 0;
+}
+
+/* Scan @size bytes at @offset, which may be less than a full block. */
+static int prefilter_scan_scalar(struct prefilter *pf, uint64_t offset,
+        uint64_t size)
+{
+    for (; offset < size; offset += 64) {
+        uint64_t pip, vmcs, tsc, pad, psb, idx, end;
+        const uint8_t *pos;
+        int errcode;
+
+        pip = vmcs = tsc = pad = psb = 0ull;
+        pos = pf->begin + offset;
+
+        end = size - offset < 64 ? size - offset : 64;
+        for (idx = 0; idx < end; ++idx) {
+            uint64_t bit;
+
+            bit = 1ull << idx;
+            switch (pos[idx]) {
+            case 0x00:
+                pad |= bit;
+                break;
+
+            case 0x19:
+                tsc |= bit;
+                break;
+
+            case 0x02:
+                if (offset + idx + 1 >= size)
+                    break;
+
+                switch (pos[idx + 1]) {
+                case 0x43:
+                    pip |= bit;
+                    break;
+
+                case 0xc8:
+                    vmcs |= bit;
+                    break;
+
+                case 0x82:
+                    psb |= bit;
+                    break;
+                }
+                break;
+            }
+        }
+
+        errcode = prefilter_block(pf, offset, pip, vmcs, tsc, pad, psb);
+        if (errcode < 0)
+            return errcode;
+    }
+
+    return 0;
+}
+
+#if defined(VMPT_X86)
+static inline uint64_t avx2_mask(__m256i lo, __m256i hi, __m256i value)
+        __attribute__((target("avx2")));
+
+static inline uint64_t avx2_mask(__m256i lo, __m256i hi, __m256i value)
+{
+    uint32_t mlo, mhi;
+
+    mlo = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, value));
+    mhi = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, value));
+
+    return ((uint64_t) mhi << 32) | mlo;
+}
+
+/* Scan full blocks; returns the offset at which the scan stopped.
+ *
+ * We look one byte ahead for extended opcodes, so we need one byte beyond
+ * each block.
+ */
+__attribute__((target("avx2")))
+static int prefilter_scan_avx2(struct prefilter *pf, uint64_t *offset)
+{
+    __m256i c00, c02, c19, c43, cc8, c82;
+    uint64_t pos;
+
+    c00 = _mm256_setzero_si256();
+    c02 = _mm256_set1_epi8(0x02);
+    c19 = _mm256_set1_epi8(0x19);
+    c43 = _mm256_set1_epi8(0x43);
+    cc8 = _mm256_set1_epi8((char) 0xc8);
+    c82 = _mm256_set1_epi8((char) 0x82);
+
+    for (pos = *offset; pos + 65 <= pf->size; pos += 64) {
+        __m256i lo, hi, nlo, nhi;
+        uint64_t ext, pip, vmcs, tsc, pad, psb;
+        const uint8_t *block;
+        int errcode;
+
+        block = pf->begin + pos;
+        lo = _mm256_loadu_si256((const __m256i *) block);
+        hi = _mm256_loadu_si256((const __m256i *) (block + 32));
+        nlo = _mm256_loadu_si256((const __m256i *) (block + 1));
+        nhi = _mm256_loadu_si256((const __m256i *) (block + 33));
+
+        pad = avx2_mask(lo, hi, c00);
+        tsc = avx2_mask(lo, hi, c19);
+        ext = avx2_mask(lo, hi, c02);
+
+        pip = vmcs = psb = 0ull;
+        if (ext) {
+            pip = ext & avx2_mask(nlo, nhi, c43);
+            vmcs = ext & avx2_mask(nlo, nhi, cc8);
+            psb = ext & avx2_mask(nlo, nhi, c82);
+        }
+
+        errcode = prefilter_block(pf, pos, pip, vmcs, tsc, pad, psb);
+        if (errcode < 0)
+            return errcode;
+    }
+
+    *offset = pos;
+    return 0;
+}
+
+__attribute__((target("avx512bw")))
+static int prefilter_scan_avx512(struct prefilter *pf, uint64_t *offset)
+{
+    __m512i c00, c02, c19, c43, cc8, c82;
+    uint64_t pos;
+
+    c00 = _mm512_setzero_si512();
+    c02 = _mm512_set1_epi8(0x02);
+    c19 = _mm512_set1_epi8(0x19);
+    c43 = _mm512_set1_epi8(0x43);
+    cc8 = _mm512_set1_epi8((char) 0xc8);
+    c82 = _mm512_set1_epi8((char) 0x82);
+
+    for (pos = *offset; pos + 65 <= pf->size; pos += 64) {
+        uint64_t ext, pip, vmcs, tsc, pad, psb;
+        const uint8_t *block;
+        __m512i cur, next;
+        int errcode;
+
+        block = pf->begin + pos;
+        cur = _mm512_loadu_si512((const void *) block);
+        next = _mm512_loadu_si512((const void *) (block + 1));
+
+        pad = _mm512_cmpeq_epi8_mask(cur, c00);
+        tsc = _mm512_cmpeq_epi8_mask(cur, c19);
+        ext = _mm512_cmpeq_epi8_mask(cur, c02);
+
+        pip = vmcs = psb = 0ull;
+        if (ext) {
+            pip = _mm512_mask_cmpeq_epi8_mask(ext, next, c43);
+            vmcs = _mm512_mask_cmpeq_epi8_mask(ext, next, cc8);
+            psb = _mm512_mask_cmpeq_epi8_mask(ext, next, c82);
+        }
+
+        errcode = prefilter_block(pf, pos, pip, vmcs, tsc, pad, psb);
+        if (errcode < 0)
+            return errcode;
+    }
+
+    *offset = pos;
+    return 0;
+}
+#endif /* defined(VMPT_X86) */
+
+/* Whether we can scan with @mode (enum prefilter_mode) on this cpu. */
+static int prefilter_supported(int mode)
+{
+    switch (mode) {
+#if defined(VMPT_X86)
+    case pfm_avx512:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx512bw");
+
+    case pfm_avx2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#else
+    case pfm_avx512:
+    case pfm_avx2:
+        return 0;
+#endif
+
+    default:
+        return 1;
+    }
+}
+
+static int prefilter_scan(struct prefilter *pf, const struct pt_config *config,
+        int mode)
+{
+    uint64_t offset;
+    int errcode;
+
+    memset(pf, 0, sizeof(*pf));
+    pf->begin = config->begin;
+    pf->size = (uint64_t) (config->end - config->begin);
+
+    errcode = prefilter_add(pf, 0ull);
+    if (errcode < 0)
+        return errcode;
+
+    if (mode == pfm_auto) {
+        if (prefilter_supported(pfm_avx512))
+            mode = pfm_avx512;
+        else if (prefilter_supported(pfm_avx2))
+            mode = pfm_avx2;
+    }
+
+    errcode = 0;
+    offset = 0ull;
+    switch (mode) {
+#if defined(VMPT_X86)
+    case pfm_avx512:
+        errcode = prefilter_scan_avx512(pf, &offset);
+        break;
+
+    case pfm_avx2:
+        errcode = prefilter_scan_avx2(pf, &offset);
+        break;
+#endif
+
+    default:
+        break;
+    }
+
+    if (errcode >= 0)
+        errcode = prefilter_scan_scalar(pf, offset, pf->size);
+
+    if (errcode < 0)
+        free(pf->segments);
+
+    return errcode;
+}
+
+/* The classes of packets that can change @ctx's bundle state.
+ *
+ * Without a PIP, only a PIP can start a bundle.  With a PIP, we need eight
+ * PADs before a VMCS is taken, and a VMCS before a TSC can end the bundle.
+ * Once we have seen the PADs, further PADs make no difference.
+ */
+static uint32_t prefilter_live(const struct vmpt_context *ctx)
+{
+    if (!ctx->dec.got_pip)
+        return pfc_pip;
+
+    if (!ctx->dec.got_pad)
+        return pfc_pad;
+
+    if (!ctx->dec.got_vmcs)
+        return pfc_vmcs;
+
+    return pfc_vmcs | pfc_tsc;
+}
+
+/* Decode the [@begin, @end) PSB segment of the trace in @config. */
+static int dump_segment(struct vmpt_context *ctx,
+        const struct pt_config *config, uint64_t begin, uint64_t end)
+{
+    struct pt_packet_decoder *decoder;
+    struct pt_config sconfig;
+    int errcode;
+
+    sconfig = *config;
+    sconfig.end = sconfig.begin + end;
+
+    decoder = pt_pkt_alloc_decoder(&sconfig);
+    if (!decoder)
+        return diag("failed to allocate decoder", begin, -pte_nomem);
+
+    errcode = pt_pkt_sync_set(decoder, begin);
+    if (errcode < 0) {
+        errcode = diag("sync error", begin, errcode);
+        goto out;
+    }
+
+    for (;;) {
+        errcode = vmpt_decode_packets(&ctx->dec, decoder);
+        if (!errcode)
+            break;
+
+        /* We reached the next segment if we cannot resync. */
+        errcode = vmpt_resync(&ctx->dec, decoder);
+        if (errcode < 0) {
+            if (errcode == -pte_eos)
+                errcode = 0;
+            break;
+        }
+    }
+
+out:
+    pt_pkt_free_decoder(decoder);
+    return errcode;
+}
+
+/* Find the offset in @config's buffer at which vmpt_decode() starts.
+ *
+ * Returns zero on success and a negative pt_error_code otherwise.
+ */
+static int decode_start(uint64_t *start, const struct pt_config *config)
+{
+    struct pt_packet_decoder *decoder;
+    int errcode;
+
+    decoder = pt_pkt_alloc_decoder(config);
+    if (!decoder)
+        return diag("failed to allocate decoder", 0ull, 0);
+
+    errcode = pt_pkt_sync_set(decoder, 0ull);
+    if (errcode >= 0)
+        errcode = pt_pkt_sync_forward(decoder);
+    if (errcode >= 0)
+        errcode = pt_pkt_get_sync_offset(decoder, start);
+
+    pt_pkt_free_decoder(decoder);
+
+    if (errcode < 0)
+        return diag("sync error", 0ull, errcode);
+
+    return 0;
+}
+
+/* Decode the trace in @config skipping PSB segments that cannot matter.
+ *
+ * A vectorized scan finds the PSBs and, for each PSB segment, which classes
+ * of interesting packets it may contain.  We decode a segment only if it may
+ * contain a packet that can change the bundle state we are in; all other
+ * packets would be dropped by vmpt_decode_packet().  The output is the same
+ * as with vmpt_decode().
+ */
+static int dump_prefilter(struct vmpt_context *ctx,
+        const struct pt_config *config, int mode)
+{
+    struct prefilter pf;
+    size_t idx, last;
+    uint64_t start;
+    int errcode;
+
+    errcode = decode_start(&start, config);
+    if (errcode < 0)
+        return errcode;
+
+    errcode = prefilter_scan(&pf, config, mode);
+    if (errcode < 0)
+        return diag("prefilter error", 0ull, errcode);
+
+    ctx->dec.stats.bytes += pf.size;
+
+    /* The last segment with a TSC holds the TSC we end with, e.g. the end of
+     * the last --aggregate slice, so we always decode it.
+     */
+    for (last = pf.nsegments; last; --last)
+        if (pf.segments[last - 1].classes & pfc_tsc)
+            break;
+
+    for (idx = 0; idx < pf.nsegments; ++idx) {
+        uint64_t begin, end;
+        uint32_t live;
+
+        begin = pf.segments[idx].begin;
+        end = idx + 1 < pf.nsegments ? pf.segments[idx + 1].begin : pf.size;
+        if (end <= start)
+            continue;
+
+        if (begin < start)
+            begin = start;
+
+        live = prefilter_live(ctx);
+        if (idx + 1 == last)
+            live |= pfc_tsc;
+
+        if (!(pf.segments[idx].classes & live))
+            continue;
+
+        errcode = dump_segment(ctx, config, begin, end);
+        if (errcode < 0)
+            break;
+    }
+
+    free(pf.segments);
+    return errcode;
+}
+
+/* The number of PSB segments at either end of the trace in which we look
+ * for the first and the last TSC for --sample.
+ */
+static const size_t sample_tsc_segments = 16;
+
+/* Find the first and the last TSC in [@begin, @end) of @config's buffer.
+ *
+ * Returns zero on success, -pte_eos if there is none, and a negative
+ * pt_error_code otherwise.
+ */
+static int segment_tsc(uint64_t *first, uint64_t *last,
+        const struct pt_config *config, uint64_t begin, uint64_t end)
+{
+    struct pt_packet_decoder *decoder;
+    struct pt_config sconfig;
+    int errcode, found;
+
+    sconfig = *config;
+    sconfig.end = sconfig.begin + end;
+
+    decoder = pt_pkt_alloc_decoder(&sconfig);
+    if (!decoder)
+        return -pte_nomem;
+
+    found = 0;
+    errcode = pt_pkt_sync_set(decoder, begin);
+    while (errcode >= 0) {
+        struct pt_packet packet;
+
+        errcode = pt_pkt_next(decoder, &packet, sizeof(packet));
+        if (errcode < 0 || packet.type != ppt_tsc)
+            continue;
+
+        if (!found)
+            *first = packet.payload.tsc.tsc;
+        *last = packet.payload.tsc.tsc;
+        found = 1;
+    }
+
+    pt_pkt_free_decoder(decoder);
+
+    /* A damaged segment still gives us the TSCs before the damage. */
+    if (found)
+        return 0;
+
+    return errcode == -pte_eos ? -pte_eos : errcode;
+}
+
+/* The TSC ticks from the first to the last TSC in @config's buffer from
+ * @start on, which is in @pf's segment @first, or zero if we cannot find
+ * them near enough to the ends.
+ */
+static uint64_t sample_span(const struct prefilter *pf, size_t first,
+        uint64_t start, const struct pt_config *config)
+{
+    uint64_t begin, end, tsc_first, tsc_last, unused;
+    size_t idx, count;
+    int errcode;
+
+    errcode = -pte_eos;
+    tsc_first = tsc_last = 0ull;
+    for (idx = first, count = 0; idx < pf->nsegments && errcode < 0 &&
+            count < sample_tsc_segments; ++idx, ++count) {
+        begin = pf->segments[idx].begin < start ? start :
+            pf->segments[idx].begin;
+        end = idx + 1 < pf->nsegments ? pf->segments[idx + 1].begin :
+            pf->size;
+        errcode = segment_tsc(&tsc_first, &unused, config, begin, end);
+    }
+
+    if (errcode < 0)
+        return 0ull;
+
+    errcode = -pte_eos;
+    for (idx = pf->nsegments, count = 0; first < idx && errcode < 0 &&
+            count < sample_tsc_segments; --idx, ++count) {
+        begin = pf->segments[idx - 1].begin < start ? start :
+            pf->segments[idx - 1].begin;
+        end = idx < pf->nsegments ? pf->segments[idx].begin : pf->size;
+        errcode = segment_tsc(&unused, &tsc_last, config, begin, end);
+    }
+
+    return tsc_first < tsc_last ? tsc_last - tsc_first : 0ull;
+}
+
+/* Decode every @stride-th PSB segment of the trace in @config.
+ *
+ * The prefilter scan finds the PSBs, and we pick segments spread evenly
+ * over the trace.  Before each gap between the segments we decode, the
+ * output format gets to end what it has seen and the bundle state is reset;
+ * so a sampled segment without a PIP cannot change the output and we skip
+ * it.  With a @stride of one, there are no gaps and the output is the same
+ * as with vmpt_decode().
+ */
+static int dump_sample(struct vmpt_context *ctx,
+        const struct pt_config *config, uint64_t stride, int mode)
+{
+    struct prefilter pf;
+    uint64_t start, first, segments, idx;
+    int errcode;
+
+    errcode = decode_start(&start, config);
+    if (errcode < 0)
+        return errcode;
+
+    errcode = prefilter_scan(&pf, config, mode ? mode : pfm_auto);
+    if (errcode < 0)
+        return diag("prefilter error", 0ull, errcode);
+
+    ctx->dec.stats.bytes += pf.size;
+
+    /* Skip what vmpt_decode() would skip. */
+    for (first = 0; first + 1 < pf.nsegments &&
+            pf.segments[first + 1].begin <= start; ++first)
+        ;
+
+    /* We start half a stride in. */
+    segments = pf.nsegments - first;
+    idx = (stride - 1) / 2;
+    if (segments <= idx)
+        idx = (segments - 1) / 2;
+
+    ctx->sample = stride;
+    ctx->segments = segments;
+    ctx->sampled = 0ull;
+    ctx->span = sample_span(&pf, (size_t) first, start, config);
+    for (; idx < segments; idx += stride) {
+        const struct prefilter_segment *seg;
+        uint64_t begin, end;
+
+        seg = &pf.segments[first + idx];
+        begin = seg->begin < start ? start : seg->begin;
+        end = first + idx + 1 < pf.nsegments ?
+            pf.segments[first + idx + 1].begin : pf.size;
+        if (seg->classes & prefilter_live(ctx)) {
+            errcode = dump_segment(ctx, config, begin, end);
+            if (errcode < 0)
+                break;
+        }
+
+        ctx->sampled += 1;
+
+        /* The next segment we decode may follow on directly. */
+        if (stride > 1 || segments <= idx + stride)
+            vmpt_context_gap(ctx);
+    }
+
+    free(pf.segments);
+    return errcode;
+}
+
+/* A packet kept for the bundle state machine during parallel decode. */
+struct segment_packet {
+    uint64_t offset;
+    struct pt_packet packet;
+};
+
+/* A PSB segment of the trace, decoded by one of the workers. */
+struct segment {
+    /* The packets vmpt_decode_packet() cares about, in trace order. */
+    struct segment_packet *packets;
+    size_t npackets, capacity;
+
+    /* The packet, error and resync counts - the stitcher counts the rest.
+     * The decoder is only used for those.
+     */
+    struct vmpt_decoder dec;
+
+    /* The errors for the stitcher to report, in trace order. */
+    struct vmpt_error *errors;
+    size_t nerrors, error_capacity;
+
+    /* Non-zero once a worker decoded the segment, and a negative
+     * pt_error_code if it failed to, e.g. for lack of memory.  The stitcher
+     * fails the decode then.
+     */
+    int done, error;
+
+    /* If segments are formatted in parallel, the callbacks the stitcher
+     * made for the segment and their formatted output.  A packet makes at
+     * most one callback, so the records fit into one allocation of
+     * npackets.
+     */
+    struct vmpt_bin_record *records;
+    size_t nrecords;
+    struct vmpt_writer out;
+
+    /* Non-zero once a formatter formatted the segment. */
+    int formatted;
+};
+
+/* The state shared by the workers and the stitcher in parallel decode. */
+struct parallel_decode {
+    const struct pt_config *config;
+
+    /* The segments and the bytes of trace per segment. */
+    struct segment *segments;
+    size_t nsegments;
+    uint64_t segment_size;
+
+    /* The maximal number of decoded segments whose output is not written
+     * yet.
+     */
+    size_t inflight;
+
+    /* The output format if segments are formatted in parallel - NULL if
+     * the stitcher formats them - and whether its JSON is compact.
+     */
+    const struct bundle_format *format;
+    int compact;
+
+    /* The segment the stitcher records the callbacks of. */
+    struct segment *stitching;
+
+    /* Protects the fields below and signals segment progress. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* The next segment to decode, the number of stitched segments, the
+     * next segment to format and the number of segments whose output is
+     * written.
+     */
+    size_t next, stitched, formatting, written;
+
+    /* Non-zero once the stitcher is done and the formatters may stop. */
+    int stop;
+
+    /* The number of workers that started; it gives each worker its cpu. */
+    size_t nstarted;
+
+    const struct vmpt_options *options;
+};
+
+/* Find the first PSB at or after @offset.
+ *
+ * The first segment starts where a sequential decode would start, i.e. at
+ * the first PSB pt_pkt_sync_forward() finds.
+ *
+ * Returns the PSB's offset or the size of the trace if there is none.
+ */
+static uint64_t segment_begin(struct pt_packet_decoder *decoder,
+        const struct pt_config *config, uint64_t offset)
+{
+    uint64_t size, sync;
+    int errcode;
+
+    size = (uint64_t) (config->end - config->begin);
+    if (size <= offset)
+        return size;
+
+    /* The forward sync skips the PSB at the current position. */
+    errcode = pt_pkt_sync_set(decoder, offset ? offset - 1 : 0ull);
+    if (errcode >= 0)
+        errcode = pt_pkt_sync_forward(decoder);
+    if (errcode >= 0)
+        errcode = pt_pkt_get_sync_offset(decoder, &sync);
+    if (errcode < 0)
+        return size;
+
+    return sync;
+}
+
+static int segment_add(struct segment *seg, uint64_t offset,
+        const struct pt_packet *packet)
+{
+    struct segment_packet *sp;
+
+    if (seg->npackets == seg->capacity) {
+        size_t capacity;
+
+        capacity = seg->capacity ? seg->capacity * 2 : 1024;
+        sp = realloc(seg->packets, capacity * sizeof(*sp));
+        if (!sp)
+            return -pte_nomem;
+
+        seg->packets = sp;
+        seg->capacity = capacity;
+    }
+
+    sp = &seg->packets[seg->npackets++];
+    sp->offset = offset;
+    sp->packet = *packet;
+
+    return 0;
+}
+
+/* Keep the error @seg just resynced after for the stitcher.
+ *
+ * It has been counted already, so we do not worry if we cannot keep it.
+ */
+static void segment_error(struct segment *seg)
+{
+    if (seg->nerrors == seg->error_capacity) {
+        struct vmpt_error *errors;
+        size_t capacity;
+
+        capacity = seg->error_capacity ? seg->error_capacity * 2 : 16;
+        errors = realloc(seg->errors, capacity * sizeof(*errors));
+        if (!errors)
+            return;
+
+        seg->errors = errors;
+        seg->error_capacity = capacity;
+    }
+
+    seg->errors[seg->nerrors++] = seg->dec.error;
+}
+
+/* Collect the packets vmpt_decode_packet() cares about like
+ * vmpt_decode_packets().
+ */
+static int collect_packets(struct pt_packet_decoder *decoder,
+        struct segment *seg)
+{
+    uint64_t offset;
+    int errcode;
+
+    offset = 0ull;
+    for (;;) {
+        struct pt_packet packet;
+
+        errcode = pt_pkt_get_offset(decoder, &offset);
+        if (errcode < 0)
+            return vmpt_decoder_error(&seg->dec, "error getting offset",
+                    offset, errcode);
+
+        errcode = pt_pkt_next(decoder, &packet, sizeof(packet));
+        if (errcode < 0) {
+            if (errcode == -pte_eos)
+                return 0;
+
+            return vmpt_decoder_error(&seg->dec, "error decoding packet",
+                    offset, errcode);
+        }
+
+        vmpt_stats_packet(&seg->dec.stats, packet.type);
+
+        switch (packet.type) {
+        case ppt_pip:
+        case ppt_pad:
+        case ppt_vmcs:
+        case ppt_tsc:
+            errcode = segment_add(seg, offset, &packet);
+            if (errcode < 0)
+                return vmpt_decoder_error(&seg->dec,
+                        "error collecting packet", offset, errcode);
+            break;
+
+        default:
+            break;
+        }
+    }
+}
+
+/* Decode the [@begin, @end) PSB segment of the trace into @seg.
+ *
+ * This mirrors vmpt_decode() except that we do not report running out of
+ * trace when resyncing; the next PSB starts the next segment.
+ */
+static int decode_segment(struct segment *seg, const struct pt_config *config,
+        uint64_t begin, uint64_t end)
+{
+    struct pt_packet_decoder *decoder;
+    struct pt_config sconfig;
+    int errcode;
+
+    if (end <= begin)
+        return 0;
+
+    sconfig = *config;
+    sconfig.end = sconfig.begin + end;
+
+    decoder = pt_pkt_alloc_decoder(&sconfig);
+    if (!decoder)
+        return -pte_nomem;
+
+    errcode = pt_pkt_sync_set(decoder, begin);
+    if (errcode < 0) {
+        errcode = diag("sync error", begin, errcode);
+        goto out;
+    }
+
+    for (;;) {
+        errcode = collect_packets(decoder, seg);
+        if (!errcode || errcode == -pte_nomem)
+            break;
+
+        errcode = vmpt_resync(&seg->dec, decoder);
+        segment_error(seg);
+        if (errcode < 0) {
+            if (errcode == -pte_eos)
+                errcode = 0;
+            break;
+        }
+    }
+
+out:
+    pt_pkt_free_decoder(decoder);
+    return errcode;
+}
+
+static void *decode_worker(void *arg)
+{
+    struct pt_packet_decoder *decoder;
+    struct parallel_decode *pd;
+
+    pd = arg;
+
+    pthread_mutex_lock(&pd->lock);
+    pin_worker(pd->options, pd->nstarted++);
+    pthread_mutex_unlock(&pd->lock);
+
+    /* We only use this one for finding segment boundaries. */
+    decoder = pt_pkt_alloc_decoder(pd->config);
+
+    for (;;) {
+        uint64_t begin, end;
+        size_t idx;
+        int errcode;
+
+        pthread_mutex_lock(&pd->lock);
+        while (pd->next < pd->nsegments &&
+                pd->written + pd->inflight <= pd->next)
+            pthread_cond_wait(&pd->cond, &pd->lock);
+        idx = pd->next++;
+        pthread_mutex_unlock(&pd->lock);
+
+        if (pd->nsegments <= idx)
+            break;
+
+        errcode = -pte_nomem;
+        if (decoder) {
+            begin = segment_begin(decoder, pd->config,
+                    idx * pd->segment_size);
+            end = segment_begin(decoder, pd->config,
+                    (idx + 1) * pd->segment_size);
+
+            errcode = decode_segment(&pd->segments[idx], pd->config, begin,
+                    end);
+        }
+
+        pthread_mutex_lock(&pd->lock);
+        pd->segments[idx].error = errcode < 0 ? errcode : 0;
+        pd->segments[idx].done = 1;
+        pthread_cond_broadcast(&pd->cond);
+        pthread_mutex_unlock(&pd->lock);
+    }
+
+    if (decoder)
+        pt_pkt_free_decoder(decoder);
+
+    return NULL;
+}
+
+/* Record a callback of the stitcher for the segment it is stitching. */
+static void stitch_record(struct vmpt_decoder *dec, enum cache_event event,
+        uint64_t cr3, uint32_t nr, uint64_t vmcs_base, uint64_t tsc)
+{
+    struct parallel_decode *pd;
+    struct segment *seg;
+
+    pd = dec->priv;
+    seg = pd->stitching;
+    if (seg->nrecords < seg->npackets)
+        record_event(&seg->records[seg->nrecords++], event, cr3, nr,
+                vmcs_base, tsc);
+}
+
+static void stitch_pip(struct vmpt_decoder *dec,
+        const struct pt_packet_pip *pip)
+{
+    stitch_record(dec, cev_pip, pip->cr3, pip->nr, 0ull, 0ull);
+}
+
+static void stitch_vmcs(struct vmpt_decoder *dec,
+        const struct pt_packet_vmcs *vmcs)
+{
+    stitch_record(dec, cev_vmcs, 0ull, 0u, vmcs->base, 0ull);
+}
+
+static void stitch_bundle(struct vmpt_decoder *dec,
+        const struct vmpt_bundle *bundle)
+{
+    stitch_record(dec, cev_bundle, bundle->cr3, bundle->nr,
+            bundle->vmcs_base, bundle->tsc);
+}
+
+static const struct vmpt_callbacks stitch_callbacks = {
+    stitch_pip,
+    stitch_vmcs,
+    stitch_bundle,
+    NULL
+};
+
+/* Format stitched segments into their own output until the stitcher is
+ * done.
+ */
+static void *format_worker(void *arg)
+{
+    struct parallel_decode *pd;
+
+    pd = arg;
+
+    pthread_mutex_lock(&pd->lock);
+    pin_worker(pd->options, pd->nstarted++);
+
+    for (;;) {
+        struct vmpt_context fctx;
+        struct segment *seg;
+
+        while (pd->formatting == pd->stitched && !pd->stop)
+            pthread_cond_wait(&pd->cond, &pd->lock);
+        if (pd->formatting == pd->stitched)
+            break;
+
+        seg = &pd->segments[pd->formatting++];
+        pthread_mutex_unlock(&pd->lock);
+
+        if (writer_init_memory(&seg->out, segment_output) < 0)
+            seg->out.error = ENOMEM;
+        else {
+            vmpt_context_init(&fctx, pd->format, &seg->out, pd->compact);
+            vmpt_context_replay(&fctx, seg->records,
+                    seg->records + seg->nrecords);
+        }
+
+        free(seg->records);
+        seg->records = NULL;
+
+        pthread_mutex_lock(&pd->lock);
+        seg->formatted = 1;
+        pthread_cond_broadcast(&pd->cond);
+    }
+
+    pthread_mutex_unlock(&pd->lock);
+    return NULL;
+}
+
+/* Write the output of formatted segments in order while we wait for @seg to
+ * be decoded or, if @seg is NULL, until the output of all stitched segments
+ * is written.  Call with @pd->lock held.
+ *
+ * Returns zero on success, a negative pt_error_code if a segment could not
+ * be formatted.
+ */
+static int parallel_wait(struct vmpt_context *ctx, struct parallel_decode *pd,
+        const struct segment *seg)
+{
+    for (;;) {
+        struct segment *done;
+        int errcode;
+
+        if (pd->written < pd->stitched &&
+                pd->segments[pd->written].formatted) {
+            done = &pd->segments[pd->written];
+            pthread_mutex_unlock(&pd->lock);
+
+            errcode = 0;
+            if (done->out.error)
+                errcode = -pte_nomem;
+            else
+                writer_append(ctx->out, done->out.buf, done->out.len);
+            (void) writer_fini(&done->out);
+
+            pthread_mutex_lock(&pd->lock);
+            pd->written += 1;
+            pthread_cond_broadcast(&pd->cond);
+
+            if (errcode < 0)
+                return errcode;
+
+            continue;
+        }
+
+        if (seg ? seg->done : pd->written == pd->stitched)
+            return 0;
+
+        pthread_cond_wait(&pd->cond, &pd->lock);
+    }
+}
+
+/* Decode the trace in @config on @options->jobs threads.
+ *
+ * We split the trace into segments that start at a PSB.  Workers decode
+ * segments and keep the few packets vmpt_decode_packet() cares about.  We
+ * feed those to vmpt_decode_packet() in trace order as segments complete, so
+ * a bundle that crosses a segment boundary is put together just like in a
+ * sequential decode.
+ *
+ * Formats without state are formatted in parallel, too: the stitcher only
+ * records the callbacks of each segment, a pool of formatters formats the
+ * segments on their own, and we write their output in trace order.
+ */
+static int dump_parallel(struct vmpt_context *ctx,
+        const struct pt_config *config, const struct vmpt_options *options,
+        const char *prog)
+{
+    struct parallel_decode pd;
+    pthread_t *workers;
+    uint64_t size;
+    size_t idx;
+    int errcode, status, nworkers, nformatters;
+
+    memset(&pd, 0, sizeof(pd));
+    pd.config = config;
+    pd.options = options;
+
+    size = (uint64_t) (config->end - config->begin);
+    ctx->dec.stats.bytes += size;
+
+    pd.segment_size = size / ((uint64_t) options->jobs * segments_per_job);
+    if (pd.segment_size < min_segment)
+        pd.segment_size = min_segment;
+
+    pd.nsegments = (size_t) ((size + pd.segment_size - 1) / pd.segment_size);
+    pd.inflight = (size_t) options->jobs * segments_per_job;
+
+    pd.segments = calloc(pd.nsegments, sizeof(*pd.segments));
+    workers = calloc((size_t) options->jobs * 2, sizeof(*workers));
+    if (!pd.segments || !workers) {
+        fprintf(stderr, "%s: failed to allocate memory.\n", prog);
+        free(pd.segments);
+        free(workers);
+        return -pte_nomem;
+    }
+
+    /* The segments count into their own statistics quietly; we report their
+     * errors as we stitch them.
+     */
+    for (idx = 0; idx < pd.nsegments; ++idx) {
+        vmpt_decoder_init(&pd.segments[idx].dec, NULL, NULL);
+        pd.segments[idx].dec.base = ctx->dec.base;
+    }
+
+    pthread_mutex_init(&pd.lock, NULL);
+    pthread_cond_init(&pd.cond, NULL);
+
+    for (nworkers = 0; nworkers < options->jobs; ++nworkers) {
+        errcode = pthread_create(&workers[nworkers], NULL, decode_worker,
+                &pd);
+        if (errcode) {
+            fprintf(stderr, "%s: failed to create worker: %d.\n", prog,
+                    errcode);
+            break;
+        }
+    }
+
+    /* Without formatters, we format as we stitch. */
+    nformatters = 0;
+    if (nworkers && ctx->format->stateless) {
+        pd.format = ctx->format;
+        pd.compact = ctx->compact;
+
+        for (; nformatters < options->jobs; ++nformatters) {
+            errcode = pthread_create(&workers[nworkers + nformatters], NULL,
+                    format_worker, &pd);
+            if (errcode)
+                break;
+        }
+
+        if (!nformatters)
+            pd.format = NULL;
+        else {
+            ctx->dec.callbacks = &stitch_callbacks;
+            ctx->dec.priv = &pd;
+        }
+    }
+
+    errcode = nworkers ? 0 : -pte_internal;
+    for (idx = 0; nworkers && idx < pd.nsegments; ++idx) {
+        struct segment *seg;
+        size_t pkt;
+
+        seg = &pd.segments[idx];
+
+        pthread_mutex_lock(&pd.lock);
+        errcode = parallel_wait(ctx, &pd, seg);
+        pthread_mutex_unlock(&pd.lock);
+
+        if (!errcode)
+            errcode = seg->error;
+
+        if (!errcode && pd.format && seg->npackets) {
+            seg->records = malloc(seg->npackets * sizeof(*seg->records));
+            if (!seg->records)
+                errcode = -pte_nomem;
+        }
+
+        pd.stitching = seg;
+        for (pkt = 0; pkt < seg->npackets && !errcode; ++pkt)
+            errcode = vmpt_decode_packet(&ctx->dec, seg->packets[pkt].offset,
+                    &seg->packets[pkt].packet);
+
+        /* The cache wants the same records in the same order. */
+        if (ctx->cache && seg->nrecords) {
+            writer_append(&ctx->cache->writer, (const char *) seg->records,
+                    seg->nrecords * sizeof(*seg->records));
+            ctx->cache->header.nrecords += seg->nrecords;
+        }
+
+        vmpt_stats_add(&ctx->dec.stats, &seg->dec.stats);
+        for (pkt = 0; pkt < seg->nerrors; ++pkt)
+            vmpt_decoder_report(&ctx->dec, &seg->errors[pkt]);
+
+        free(seg->packets);
+        seg->packets = NULL;
+
+        free(seg->errors);
+        seg->errors = NULL;
+
+        pthread_mutex_lock(&pd.lock);
+        pd.stitched = idx + 1;
+        if (!pd.format)
+            pd.written = pd.stitched;
+        pthread_cond_broadcast(&pd.cond);
+        pthread_mutex_unlock(&pd.lock);
+
+        if (errcode < 0)
+            break;
+    }
+
+    ctx->dec.callbacks = &ctx->callbacks;
+    ctx->dec.priv = ctx;
+
+    /* Write what is left, and let the workers run out of segments if we
+     * stopped early.
+     */
+    pthread_mutex_lock(&pd.lock);
+    pd.stop = 1;
+    pthread_cond_broadcast(&pd.cond);
+    status = parallel_wait(ctx, &pd, NULL);
+    if (status < 0 && !errcode)
+        errcode = status;
+    pd.next = pd.nsegments;
+    pthread_cond_broadcast(&pd.cond);
+    pthread_mutex_unlock(&pd.lock);
+
+    if (errcode == -pte_nomem)
+        fprintf(stderr, "%s: failed to allocate memory.\n", prog);
+
+    nworkers += nformatters;
+    while (nworkers--)
+        pthread_join(workers[nworkers], NULL);
+
+    for (idx = 0; idx < pd.nsegments; ++idx) {
+        free(pd.segments[idx].packets);
+        free(pd.segments[idx].errors);
+        free(pd.segments[idx].records);
+        if (pd.segments[idx].out.buf)
+            (void) writer_fini(&pd.segments[idx].out);
+    }
+
+    pthread_cond_destroy(&pd.cond);
+    pthread_mutex_destroy(&pd.lock);
+    free(pd.segments);
+    free(workers);
+
+    return errcode;
+}
+
+/* The number of bundles passed from a trace decoder to the merge at once. */
+#define BUNDLE_CHUNK_SIZE 1024
+
+/* The number of chunks a trace decoder may run ahead of the merge. */
+static const size_t max_chunks = 16;
+
+/* A chunk of bundles from one trace in TSC order. */
+struct bundle_chunk {
+    struct bundle_chunk *next;
+
+    size_t nbundles;
+    struct vmpt_bundle bundles[BUNDLE_CHUNK_SIZE];
+};
+
+/* One of several traces decoded in parallel and merged in TSC order. */
+struct trace_stream {
+    char *ptfile;
+    const struct vmpt_options *options;
+    const char *prog;
+
+    /* The stream's number, which picks the cpu of its decoder. */
+    size_t worker;
+
+    /* The decoder - its format queues bundles for the merge. */
+    struct vmpt_context ctx;
+
+    /* The chunk the decoder is filling. */
+    struct bundle_chunk *fill;
+
+    /* Protects the fields below and signals queue changes. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* The queue of complete chunks. */
+    struct bundle_chunk *head, *tail;
+    size_t nchunks;
+
+    /* Non-zero once the decoder is done, and its status. */
+    int done, errcode;
+
+    /* The chunk the merge is reading and the position in it. */
+    struct bundle_chunk *current;
+    size_t pos;
+};
+
+static int stream_push(struct trace_stream *stream)
+{
+    struct bundle_chunk *chunk;
+
+    chunk = stream->fill;
+    stream->fill = NULL;
+    if (!chunk || !chunk->nbundles) {
+        free(chunk);
+        return 0;
+    }
+
+    pthread_mutex_lock(&stream->lock);
+    while (max_chunks <= stream->nchunks)
+        pthread_cond_wait(&stream->cond, &stream->lock);
+
+    chunk->next = NULL;
+    if (stream->tail)
+        stream->tail->next = chunk;
+    else
+        stream->head = chunk;
+    stream->tail = chunk;
+    stream->nchunks += 1;
+
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+
+    return 0;
+}
+
+static void stream_bundle(struct vmpt_context *ctx,
+        const struct vmpt_bundle *bundle)
+{
+    struct trace_stream *stream;
+    struct bundle_chunk *chunk;
+
+    stream = ctx->priv;
+    chunk = stream->fill;
+    if (!chunk) {
+        chunk = malloc(sizeof(*chunk));
+        if (!chunk) {
+            stream->errcode = -pte_nomem;
+            return;
+        }
+
+        chunk->nbundles = 0;
+        stream->fill = chunk;
+    }
+
+    chunk->bundles[chunk->nbundles++] = *bundle;
+    if (chunk->nbundles == BUNDLE_CHUNK_SIZE)
+        (void) stream_push(stream);
+}
+
+static const struct bundle_format stream_format = {
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    stream_bundle,
+    NULL,
+    NULL,
+    NULL,
+    0
+};
+
+static void *stream_worker(void *arg)
+{
+    struct trace_stream *stream;
+    struct trace_input in;
+    struct pt_config config;
+    int errcode;
+
+    stream = arg;
+
+    /* The trace is loaded on the decoder's node. */
+    pin_worker(stream->options, stream->worker);
+
+    memset(&config, 0, sizeof(config));
+    pt_config_init(&config);
+
+    errcode = pt_cpu_errata(&config.errata, &config.cpu);
+    if (errcode < 0)
+        diag("failed to determine errata", 0ull, errcode);
+
+    errcode = open_trace(&in, &config, stream->ptfile, 0ull, stream->options,
+            stream->prog);
+    if (errcode >= 0) {
+        if (in.fd >= 0)
+            errcode = dump_stream(&stream->ctx, &config, in.fd, in.codec,
+                    in.begin, in.end, 0, stream->options, stream->prog);
+        else if (stream->options->prefilter)
+            errcode = dump_prefilter(&stream->ctx, &config,
+                    stream->options->prefilter);
+        else
+            errcode = vmpt_decode(&stream->ctx.dec, &config, 0, NULL);
+
+        close_trace(&in);
+    }
+
+    vmpt_context_finish(&stream->ctx);
+    (void) stream_push(stream);
+
+    pthread_mutex_lock(&stream->lock);
+    if (!stream->errcode)
+        stream->errcode = errcode;
+    stream->done = 1;
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+
+    return NULL;
+}
+
+/* Get the next bundle of @stream for the merge.
+ *
+ * Blocks until the decoder produced more bundles or finished.  Returns NULL
+ * at the end of the stream.
+ */
+static const struct vmpt_bundle *stream_peek(struct trace_stream *stream)
+{
+    struct bundle_chunk *chunk;
+
+    chunk = stream->current;
+    if (chunk && stream->pos < chunk->nbundles)
+        return &chunk->bundles[stream->pos];
+
+    free(chunk);
+    stream->current = NULL;
+    stream->pos = 0;
+
+    pthread_mutex_lock(&stream->lock);
+    while (!stream->head && !stream->done)
+        pthread_cond_wait(&stream->cond, &stream->lock);
+
+    chunk = stream->head;
+    if (chunk) {
+        stream->head = chunk->next;
+        if (!stream->head)
+            stream->tail = NULL;
+        stream->nchunks -= 1;
+        pthread_cond_broadcast(&stream->cond);
+    }
+    pthread_mutex_unlock(&stream->lock);
+
+    if (!chunk)
+        return NULL;
+
+    stream->current = chunk;
+    return &chunk->bundles[0];
+}
+
+/* Order streams by their next bundle's TSC and by position on a tie. */
+static int stream_before(struct trace_stream **heap, size_t lhs, size_t rhs)
+{
+    const struct vmpt_bundle *left, *right;
+
+    left = &heap[lhs]->current->bundles[heap[lhs]->pos];
+    right = &heap[rhs]->current->bundles[heap[rhs]->pos];
+    if (left->tsc != right->tsc)
+        return left->tsc < right->tsc;
+
+    return heap[lhs] < heap[rhs];
+}
+
+static void heap_down(struct trace_stream **heap, size_t size, size_t idx)
+{
+    for (;;) {
+        struct trace_stream *tmp;
+        size_t child;
+
+        child = 2 * idx + 1;
+        if (size <= child)
+            break;
+
+        if (child + 1 < size && stream_before(heap, child + 1, child))
+            child += 1;
+
+        if (!stream_before(heap, child, idx))
+            break;
+
+        tmp = heap[idx];
+        heap[idx] = heap[child];
+        heap[child] = tmp;
+        idx = child;
+    }
+}
+
+/* Hand a complete bundle to @ctx's output format. */
+static void emit_bundle(struct vmpt_context *ctx,
+        const struct vmpt_bundle *bundle)
+{
+    const struct bundle_format *format;
+
+    /* The callbacks the decoder would have made. */
+    if (ctx->cache) {
+        cache_record(ctx, cev_pip, bundle->cr3, bundle->nr, 0ull, 0ull);
+        cache_record(ctx, cev_vmcs, 0ull, 0u, bundle->vmcs_base, 0ull);
+        cache_record(ctx, cev_bundle, bundle->cr3, bundle->nr,
+                bundle->vmcs_base, bundle->tsc);
+    }
+
+    format = ctx->format;
+    if (format->pip) {
+        struct pt_packet_pip pip;
+
+        memset(&pip, 0, sizeof(pip));
+        pip.cr3 = bundle->cr3;
+        pip.nr = bundle->nr;
+
+        format->pip(ctx, &pip);
+    }
+
+    if (format->vmcs) {
+        struct pt_packet_vmcs vmcs;
+
+        vmcs.base = bundle->vmcs_base;
+
+        format->vmcs(ctx, &vmcs);
+    }
+
+    format->bundle(ctx, bundle);
+}
+
+/* Decode @ntraces traces on one thread each and merge their bundles.
+ *
+ * Each trace - e.g. the AUX stream of one cpu - has its own decoder.  The
+ * decoders queue complete bundles in chunks and we merge the queues in TSC
+ * order with a binary heap.  The queues are bounded, so we never hold more
+ * than a few chunks per trace in memory.
+ */
+static int dump_merge(struct vmpt_context *ctx, char **ptfiles,
+        int ntraces, const struct vmpt_options *options, const char *prog)
+{
+    struct trace_stream *streams, **heap;
+    pthread_t *workers;
+    size_t size;
+    int errcode, idx, nworkers;
+
+    streams = calloc((size_t) ntraces, sizeof(*streams));
+    heap = calloc((size_t) ntraces, sizeof(*heap));
+    workers = calloc((size_t) ntraces, sizeof(*workers));
+    if (!streams || !heap || !workers) {
+        fprintf(stderr, "%s: failed to allocate memory.\n", prog);
+        free(streams);
+        free(heap);
+        free(workers);
+        return -pte_nomem;
+    }
+
+    for (idx = 0; idx < ntraces; ++idx) {
+        struct trace_stream *stream;
+
+        stream = &streams[idx];
+        stream->ptfile = ptfiles[idx];
+        stream->options = options;
+        stream->prog = prog;
+        stream->worker = (size_t) idx;
+
+        vmpt_context_init(&stream->ctx, &stream_format, NULL, 0);
+        stream->ctx.priv = stream;
+
+        pthread_mutex_init(&stream->lock, NULL);
+        pthread_cond_init(&stream->cond, NULL);
+    }
+
+    errcode = 0;
+    for (nworkers = 0; nworkers < ntraces; ++nworkers) {
+        errcode = pthread_create(&workers[nworkers], NULL, stream_worker,
+                &streams[nworkers]);
+        if (errcode) {
+            fprintf(stderr, "%s: failed to create worker: %d.\n", prog,
+                    errcode);
+            errcode = -pte_internal;
+            break;
+        }
+    }
+
+    /* Let the streams we could not start end right away. */
+    for (idx = nworkers; idx < ntraces; ++idx)
+        streams[idx].done = 1;
+
+    size = 0;
+    for (idx = 0; idx < ntraces; ++idx)
+        if (stream_peek(&streams[idx]))
+            heap[size++] = &streams[idx];
+
+    for (idx = (int) size / 2; idx > 0; --idx)
+        heap_down(heap, size, (size_t) idx - 1);
+
+    while (size) {
+        struct trace_stream *stream;
+
+        stream = heap[0];
+        emit_bundle(ctx, &stream->current->bundles[stream->pos]);
+
+        stream->pos += 1;
+        if (!stream_peek(stream))
+            heap[0] = heap[--size];
+
+        heap_down(heap, size, 0);
+    }
+
+    for (idx = 0; idx < nworkers; ++idx)
+        pthread_join(workers[idx], NULL);
+
+    for (idx = 0; idx < ntraces; ++idx) {
+        struct trace_stream *stream;
+
+        stream = &streams[idx];
+        if (stream->errcode < 0 && stream->errcode != -pte_eos) {
+            fprintf(stderr, "%s: failed to decode %s: %s.\n", prog,
+                    stream->ptfile,
+                    pt_errstr(pt_errcode(stream->errcode)));
+            if (!errcode)
+                errcode = stream->errcode;
+        }
+
+        vmpt_stats_add(&ctx->dec.stats, &stream->ctx.dec.stats);
+
+        free(stream->fill);
+        free(stream->current);
+        while (stream->head) {
+            struct bundle_chunk *chunk;
+
+            chunk = stream->head;
+            stream->head = chunk->next;
+            free(chunk);
+        }
+
+        pthread_cond_destroy(&stream->cond);
+        pthread_mutex_destroy(&stream->lock);
+    }
+
+    free(streams);
+    free(heap);
+    free(workers);
+
+    return errcode;
+}
+
+static int compare_names(const void *lhs, const void *rhs)
+{
+    return strcmp(*(char * const *) lhs, *(char * const *) rhs);
+}
+
+/* Collect the regular files in directory @path in name order.
+ *
+ * Returns the number of files on success, a negative value otherwise.
+ */
+static int list_traces(char ***ptfiles, const char *path, const char *prog)
+{
+    struct dirent *entry;
+    char **names;
+    size_t size;
+    int nfiles;
+    DIR *dir;
+
+    errno = 0;
+    dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr, "%s: failed to open %s: %d.\n", prog, path, errno);
+        return -1;
+    }
+
+    names = NULL;
+    nfiles = 0;
+    size = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat st;
+        char *name;
+
+        if (entry->d_name[0] == '.')
+            continue;
+
+        name = malloc(strlen(path) + strlen(entry->d_name) + 2);
+        if (!name)
+            break;
+
+        sprintf(name, "%s/%s", path, entry->d_name);
+        if (stat(name, &st) < 0 || !S_ISREG(st.st_mode)) {
+            free(name);
+            continue;
+        }
+
+        if ((size_t) nfiles == size) {
+            char **grown;
+
+            size = size ? size * 2 : 16;
+            grown = realloc(names, size * sizeof(*names));
+            if (!grown) {
+                free(name);
+                break;
+            }
+
+            names = grown;
+        }
+
+        names[nfiles++] = name;
+    }
+
+    closedir(dir);
+
+    if (entry) {
+        fprintf(stderr, "%s: failed to allocate memory.\n", prog);
+        while (nfiles--)
+            free(names[nfiles]);
+        free(names);
+        return -1;
+    }
+
+    if (!nfiles) {
+        fprintf(stderr, "%s: no traces in %s.\n", prog, path);
+        free(names);
+        return -1;
+    }
+
+    qsort(names, (size_t) nfiles, sizeof(*names), compare_names);
+
+    *ptfiles = names;
+    return nfiles;
+}
+
+/* The path of @ptfile's PSB index - free() it when done. */
+static char *index_path(const char *ptfile, const char *suffix)
+{
+    size_t size;
+    char *path;
+
+    size = strlen(ptfile) + strlen(suffix) + 1;
+    path = malloc(size);
+    if (path)
+        snprintf(path, size, "%s%s", ptfile, suffix);
+
+    return path;
+}
+
+/* The 64-bit FNV-1a hash of the @size bytes at @key. */
+static uint64_t fnv1a(const void *key, size_t size)
+{
+    const uint8_t *byte;
+    uint64_t hash;
+
+    hash = 0xcbf29ce484222325ull;
+    for (byte = key; size; ++byte, --size)
+        hash = (hash ^ *byte) * 0x100000001b3ull;
+
+    return hash;
+}
+
+/* The path of the file for @key in the --cache directory @dir, named after
+ * the key's hash with @suffix - free() it when done.
+ */
+static char *cache_path(const char *dir, const void *key, size_t size,
+        const char *suffix)
+{
+    size_t length;
+    char *path;
+
+    length = strlen(dir) + 18 + strlen(suffix);
+    path = malloc(length);
+    if (path)
+        snprintf(path, length, "%s/%016" PRIx64 "%s", dir, fnv1a(key, size),
+                suffix);
+
+    return path;
+}
+
+/* The path of the PSB index of @ptfile, which @st describes, with @suffix.
+ *
+ * It is next to the trace or, with --cache, in the cache, named after the
+ * trace's device and inode.  free() it when done.
+ */
+static char *index_file(const char *ptfile, const struct stat *st,
+        const struct vmpt_options *options, const char *suffix)
+{
+    uint64_t id[2];
+
+    if (!options->cache)
+        return index_path(ptfile, suffix);
+
+    id[0] = (uint64_t) st->st_dev;
+    id[1] = (uint64_t) st->st_ino;
+
+    return cache_path(options->cache, id, sizeof(id), suffix);
+}
+
+/* The entry for the PSB segment we are in while building an index. */
+struct index_segment {
+    struct vmpt_idx_entry entry;
+
+    /* Whether we saw a PSB yet, i.e. whether @entry is valid. */
+    int valid;
+};
+
+/* Write the entry for the segment in @ctx, if any. */
+static void index_flush(struct vmpt_context *ctx)
+{
+    struct index_segment *segment;
+
+    segment = ctx->priv;
+    if (segment->valid)
+        writer_put(ctx->out, (const char *) &segment->entry,
+                sizeof(segment->entry));
+}
+
+/* Record the bundle state at the PSB at @offset. */
+static void index_psb(struct vmpt_context *ctx, uint64_t offset)
+{
+    struct index_segment *segment;
+
+    index_flush(ctx);
+
+    segment = ctx->priv;
+    vmpt_context_save(ctx, offset, &segment->entry);
+    segment->valid = 1;
+}
+
+/* Widen the TSC span of the segment @bundle is in. */
+static void index_bundle(struct vmpt_context *ctx,
+        const struct vmpt_bundle *bundle)
+{
+    struct index_segment *segment;
+
+    segment = ctx->priv;
+    if (!segment->valid)
+        return;
+
+    if (bundle->tsc < segment->entry.tsc_min)
+        segment->entry.tsc_min = bundle->tsc;
+    if (segment->entry.tsc_max < bundle->tsc)
+        segment->entry.tsc_max = bundle->tsc;
+}
+
+static const struct bundle_format index_format = {
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    index_bundle,
+    index_psb,
+    NULL,
+    NULL,
+    0
+};
+
+/* Build the PSB index of the trace in @fd, which was opened for @ptfile.
+ *
+ * We decode the whole trace like vmpt_decode() and record the bundle state
+ * at each PSB and the TSCs of the bundles up to the next.  The index is written to a temporary file first, so a reader
+ * never sees a partial index.
+ */
+static int index_build(const struct pt_config *base, int fd,
+        const struct stat *st, const char *ptfile,
+        const struct vmpt_options *options, const char *prog)
+{
+    struct vmpt_idx_header header;
+    struct index_segment segment;
+    struct vmpt_writer writer;
+    struct vmpt_context ctx;
+    struct vmpt_trace tb;
+    struct pt_config config;
+    char *path, *tmp;
+    int errcode, out;
+
+    if (!st->st_size) {
+        fprintf(stderr, "%s: %s is empty.\n", prog, ptfile);
+        return -pte_bad_file;
+    }
+
+    path = index_file(ptfile, st, options, ".idx");
+    tmp = index_file(ptfile, st, options, ".idx.tmp");
+    if (!path || !tmp) {
+        fprintf(stderr, "%s: failed to allocate memory.\n", prog);
+        errcode = -pte_nomem;
+        goto out_path;
+    }
+
+    errcode = load_range(&tb, fd, 0ull, (uint64_t) st->st_size, options,
+            ptfile, prog);
+    if (errcode < 0) {
+        errcode = -pte_bad_file;
+        goto out_path;
+    }
+
+    errno = 0;
+    out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out < 0) {
+        fprintf(stderr, "%s: failed to open %s: %d.\n", prog, tmp, errno);
+        errcode = -pte_bad_file;
+        goto out_trace;
+    }
+
+    errcode = writer_init(&writer, out, writer_size);
+    if (errcode < 0) {
+        fprintf(stderr, "%s: failed to allocate output buffer.\n", prog);
+        goto out_output;
+    }
+
+    vmpt_idx_header_init(&header, st);
+    writer_put(&writer, (const char *) &header, sizeof(header));
+
+    config = *base;
+    config.begin = tb.begin;
+    config.end = tb.begin + tb.size;
+
+    memset(&segment, 0, sizeof(segment));
+    vmpt_context_init(&ctx, &index_format, &writer, 0);
+    ctx.priv = &segment;
+    errcode = vmpt_decode(&ctx.dec, &config, 0, NULL);
+    if (errcode == -pte_eos)
+        errcode = 0;
+
+    index_flush(&ctx);
+
+    if (writer_fini(&writer) < 0) {
+        fprintf(stderr, "%s: failed to write %s: %d.\n", prog, tmp,
+                writer.error);
+        if (!errcode)
+            errcode = -pte_bad_file;
+    }
+
+out_output:
+    close(out);
+    if (!errcode && rename(tmp, path) < 0) {
+        fprintf(stderr, "%s: failed to rename %s: %d.\n", prog, tmp, errno);
+        errcode = -pte_bad_file;
+    }
+    if (errcode < 0)
+        (void) unlink(tmp);
+
+out_trace:
+    vmpt_trace_unload(&tb);
+
+out_path:
+    free(path);
+    free(tmp);
+    return errcode;
+}
+
+/* Open @ptfile for use with its index.
+ *
+ * The index covers the whole trace; we do not accept a range.
+ */
+static int index_open_trace(struct stat *st, char *ptfile, const char *prog)
+{
+    int fd;
+
+    if (strchr(ptfile, ':')) {
+        fprintf(stderr, "%s: the index covers whole traces; drop the range "
+                "from %s.\n", prog, ptfile);
+        return -1;
+    }
+
+    errno = 0;
+    fd = open(ptfile, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s: failed to open %s: %d.\n", prog, ptfile, errno);
+        return -1;
+    }
+
+    if (fstat(fd, st) < 0 || st->st_size < 0) {
+        fprintf(stderr, "%s: failed to determine size of %s: %d.\n", prog,
+                ptfile, errno);
+        close(fd);
+        return -1;
+    }
+
+    if (input_codec(fd)) {
+        fprintf(stderr, "%s: %s is compressed; the index needs an "
+                "uncompressed trace.\n", prog, ptfile);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Build the PSB index of @ptfile. */
+static int index_trace(const struct pt_config *base, char *ptfile,
+        const struct vmpt_options *options, const char *prog)
+{
+    struct stat st;
+    int errcode, fd;
+
+    fd = index_open_trace(&st, ptfile, prog);
+    if (fd < 0)
+        return -pte_bad_file;
+
+    errcode = index_build(base, fd, &st, ptfile, options, prog);
+    close(fd);
+
+    return errcode;
+}
+
+/* The TSC range we are looking for and where the bundles in it go. */
+struct tsc_range {
+    uint64_t begin, end;
+
+    struct vmpt_context *out;
+
+    /* The pip and vmcs callbacks of the bundle we are in. */
+    struct vmpt_bin_record *records;
+    size_t nrecords, size;
+    int lost;
+};
+
+/* Whether the segment at @entry has bundles in @range. */
+static int index_overlaps(const struct vmpt_idx_entry *entry,
+        const struct tsc_range *range)
+{
+    return entry->tsc_min <= entry->tsc_max &&
+        entry->tsc_min <= range->end && range->begin <= entry->tsc_max;
+}
+
+/* Record a callback of the bundle we are in.
+ *
+ * If we run out of memory, the bundle's lost callbacks are made up from the
+ * bundle, as for a merged stream.
+ */
+static void range_record(struct tsc_range *range, enum cache_event event,
+        uint64_t cr3, uint32_t nr, uint64_t vmcs_base, uint64_t tsc)
+{
+    if (range->lost)
+        return;
+
+    if (range->nrecords == range->size) {
+        struct vmpt_bin_record *records;
+        size_t size;
+
+        size = range->size ? range->size * 2 : 8;
+        records = realloc(range->records, size * sizeof(*records));
+        if (!records) {
+            range->lost = 1;
+            return;
+        }
+
+        range->records = records;
+        range->size = size;
+    }
+
+    record_event(&range->records[range->nrecords++], event, cr3, nr,
+            vmcs_base, tsc);
+}
+
+/* Make the callbacks we recorded to the output if @tsc is in the range.
+ *
+ * For a bundle that did not complete, @tsc is the last TSC we saw.
+ */
+static void range_flush(struct tsc_range *range, uint64_t tsc)
+{
+    struct vmpt_context *out;
+
+    out = range->out;
+    if (!range->lost && range->begin <= tsc && tsc <= range->end) {
+        if (out->cache) {
+            writer_put(&out->cache->writer, (const char *) range->records,
+                    range->nrecords * sizeof(*range->records));
+            out->cache->header.nrecords += range->nrecords;
+        }
+
+        vmpt_context_replay(out, range->records,
+                range->records + range->nrecords);
+    }
+
+    range->nrecords = 0;
+    range->lost = 0;
+}
+
+static void range_pip(struct vmpt_context *ctx,
+        const struct pt_packet_pip *pip)
+{
+    struct tsc_range *range;
+
+    range = ctx->priv;
+    range_flush(range, ctx->dec.last_tsc);
+    range_record(range, cev_pip, pip->cr3, pip->nr, 0ull, 0ull);
+}
+
+static void range_vmcs(struct vmpt_context *ctx,
+        const struct pt_packet_vmcs *vmcs)
+{
+    range_record(ctx->priv, cev_vmcs, 0ull, 0u, vmcs->base, 0ull);
+}
+
+/* Make the callbacks of a bundle in the range to the output, as an unranged
+ * decode would have made them.
+ */
+static void range_bundle(struct vmpt_context *ctx,
+        const struct vmpt_bundle *bundle)
+{
+    struct tsc_range *range;
+
+    range = ctx->priv;
+    if (range->begin <= bundle->tsc && bundle->tsc <= range->end) {
+        range_record(range, cev_bundle, bundle->cr3, bundle->nr,
+                bundle->vmcs_base, bundle->tsc);
+
+        if (range->lost)
+            emit_bundle(range->out, bundle);
+        range_flush(range, bundle->tsc);
+    }
+
+    range->nrecords = 0;
+    range->lost = 0;
+}
+
+static const struct bundle_format range_format = {
+    NULL,
+    NULL,
+    NULL,
+    range_pip,
+    range_vmcs,
+    range_bundle,
+    NULL,
+    NULL,
+    NULL,
+    0
+};
+
+/* Decode the part of @ptfile with bundles in @options' TSC range.
+ *
+ * The PSB index tells us the PSB segments whose TSCs may be in the range and
+ * the bundle state at each of them.  We load only those segments and start
+ * decoding right at their PSBs.  The index is built if it is
+ * missing or stale.
+ */
+static int dump_range(struct vmpt_context *ctx, const struct pt_config *base,
+        char *ptfile, const struct vmpt_options *options, const char *prog)
+{
+    const struct vmpt_idx_entry *first, *last;
+    struct vmpt_idx_entry state;
+    struct vmpt_idx_file index;
+    struct vmpt_context rctx;
+    struct pt_config config;
+    uint64_t begin, end, decoded;
+    struct tsc_range range;
+    struct vmpt_trace tb;
+    struct stat st;
+    int errcode, fd;
+    char *path;
+
+    fd = index_open_trace(&st, ptfile, prog);
+    if (fd < 0)
+        return -pte_bad_file;
+
+    path = index_file(ptfile, &st, options, ".idx");
+    if (!path) {
+        fprintf(stderr, "%s: failed to allocate memory.\n", prog);
+        errcode = -pte_nomem;
+        goto out_trace;
+    }
+
+    errcode = vmpt_idx_open(&index, path, &st);
+    if (errcode < 0) {
+        errcode = index_build(base, fd, &st, ptfile, options, prog);
+        if (errcode < 0)
+            goto out_path;
+
+        errcode = vmpt_idx_open(&index, path, &st);
+        if (errcode < 0) {
+            fprintf(stderr, "%s: failed to open %s: %d.\n", prog, path,
+                    -errcode);
+            errcode = -pte_bad_file;
+            goto out_path;
+        }
+    }
+
+    range.begin = options->tsc_begin;
+    range.end = options->tsc_end;
+    range.out = ctx;
+    range.records = NULL;
+    range.nrecords = 0;
+    range.size = 0;
+    range.lost = 0;
+
+    /* The TSC need not grow from one PSB to the next, so we look at the
+     * TSC span of every segment.  We decode each run of segments with
+     * bundles in the range, starting in the bundle state at its first PSB.
+     * A run goes on through segments without bundles, whose TSCs still
+     * count, e.g. for the end of the last --aggregate slice.  Between two
+     * runs, the trace we skipped is a gap.
+     */
+    errcode = 0;
+    decoded = 0ull;
+    for (first = index.begin; first < index.end; first = last) {
+        if (!index_overlaps(first, &range)) {
+            last = first + 1;
+            continue;
+        }
+
+        for (last = first + 1; last < index.end; ++last) {
+            if (!index_overlaps(last, &range) &&
+                    last->tsc_min <= last->tsc_max)
+                break;
+        }
+
+        begin = first->offset;
+        end = last < index.end ? last->offset : (uint64_t) st.st_size;
+        if (end <= begin)
+            continue;
+
+        if (decoded && decoded != begin)
+            vmpt_context_gap(ctx);
+        decoded = end;
+
+        errcode = load_range(&tb, fd, begin, end, options, ptfile, prog);
+        if (errcode < 0) {
+            errcode = -pte_bad_file;
+            break;
+        }
+
+        config = *base;
+        config.begin = tb.begin;
+        config.end = tb.begin + tb.size;
+
+        vmpt_context_init(&rctx, &range_format, NULL, 0);
+        rctx.priv = &range;
+        vmpt_context_restore(&rctx, first);
+
+        /* The callbacks of a bundle we start in were made before the PSB. */
+        range.nrecords = 0;
+        range.lost = 0;
+        if (rctx.dec.got_pip)
+            range_record(&range, cev_pip, rctx.dec.bundle.cr3,
+                    rctx.dec.bundle.nr, 0ull, 0ull);
+        if (rctx.dec.got_vmcs)
+            range_record(&range, cev_vmcs, 0ull, 0u,
+                    rctx.dec.bundle.vmcs_base, 0ull);
+
+        errcode = vmpt_decode(&rctx.dec, &config, 1, NULL);
+        range_flush(&range, rctx.dec.last_tsc);
+
+        /* Hand the bundle state on, e.g. to the format's end hook. */
+        vmpt_context_save(&rctx, end, &state);
+        vmpt_context_restore(ctx, &state);
+
+        vmpt_stats_add(&ctx->dec.stats, &rctx.dec.stats);
+        ctx->dec.stats.loaded += tb.size;
+
+        vmpt_trace_unload(&tb);
+        if (errcode < 0)
+            break;
+    }
+
+    free(range.records);
+    vmpt_idx_close(&index);
+
+out_path:
+    free(path);
+
+out_trace:
+    close(fd);
+    return errcode;
+}
+
+/* The format of the output we write with @options. */
+static uint32_t checkpoint_format(const struct vmpt_options *options)
+{
+    if (options->format == &bin_format)
+        return ckf_bin;
+
+    return options->compact ? ckf_compact : ckf_json;
+}
+
+/* Read the checkpoint for @ptfile from @options->checkpoint into @ckpt.
+ *
+ * Without --resume, or if there is no checkpoint yet, @ckpt is set up for a
+ * decode from the start of the trace and *@resumed is zero.
+ *
+ * Returns zero on success, a negative error code otherwise.
+ */
+static int checkpoint_open(struct vmpt_checkpoint *ckpt, int *resumed,
+        const char *ptfile, const struct vmpt_options *options,
+        const char *prog)
+{
+    struct vmpt_checkpoint saved;
+    struct stat st;
+    ssize_t got;
+    int fd;
+
+    *resumed = 0;
+
+    if (strchr(ptfile, ':')) {
+        fprintf(stderr, "%s: a checkpoint covers whole traces; drop the "
+                "range from %s.\n", prog, ptfile);
+        return -pte_invalid;
+    }
+
+    errno = 0;
+    if (stat(ptfile, &st) < 0) {
+        fprintf(stderr, "%s: failed to stat %s: %d.\n", prog, ptfile, errno);
+        return -pte_bad_file;
+    }
+
+    memset(ckpt, 0, sizeof(*ckpt));
+    memcpy(ckpt->magic, VMPT_CKPT_MAGIC, sizeof(ckpt->magic));
+    ckpt->version = VMPT_CKPT_VERSION;
+    ckpt->format = checkpoint_format(options);
+    ckpt->trace_dev = (uint64_t) st.st_dev;
+    ckpt->trace_ino = (uint64_t) st.st_ino;
+    ckpt->state.offset = UINT64_MAX;
+
+    if (!options->resume)
+        return 0;
+
+    errno = 0;
+    fd = open(options->checkpoint, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return 0;
+
+        fprintf(stderr, "%s: failed to open %s: %d.\n", prog,
+                options->checkpoint, errno);
+        return -pte_bad_file;
+    }
+
+    got = read(fd, &saved, sizeof(saved));
+    close(fd);
+
+    if (got != (ssize_t) sizeof(saved) ||
+            memcmp(saved.magic, ckpt->magic, sizeof(saved.magic)) ||
+            saved.version != ckpt->version ||
+            saved.state.offset == UINT64_MAX) {
+        fprintf(stderr, "%s: %s is not a checkpoint.\n", prog,
+                options->checkpoint);
+        return -pte_bad_file;
+    }
+
+    if (saved.format != ckpt->format) {
+        fprintf(stderr, "%s: %s was written for another output format.\n",
+                prog, options->checkpoint);
+        return -pte_invalid;
+    }
+
+    if (saved.trace_dev != ckpt->trace_dev ||
+            saved.trace_ino != ckpt->trace_ino ||
+            (uint64_t) st.st_size < saved.trace_size) {
+        fprintf(stderr, "%s: %s is not the trace %s was written for; remove "
+                "the checkpoint to start over.\n", prog, ptfile,
+                options->checkpoint);
+        return -pte_invalid;
+    }
+
+    *ckpt = saved;
+    *resumed = 1;
+    return 0;
+}
+
+/* Open @output for a run with a checkpoint.
+ *
+ * The output must be a regular file.  Unless we @resumed, it is created or
+ * truncated like open_output() does; otherwise it is cut back to the size
+ * recorded in @ckpt and we continue writing from there.
+ *
+ * Returns the file descriptor on success, a negative value otherwise.
+ */
+static int checkpoint_output(const char *output,
+        const struct vmpt_checkpoint *ckpt, int resumed, const char *prog)
+{
+    struct stat st;
+    int fd;
+
+    errno = 0;
+    fd = open(output, O_WRONLY | O_CREAT | (resumed ? 0 : O_TRUNC), 0666);
+    if (fd < 0) {
+        fprintf(stderr, "%s: failed to open %s: %d.\n", prog, output, errno);
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "%s: --checkpoint needs the output to be a regular "
+                "file.\n", prog);
+        goto err;
+    }
+
+    if (!resumed)
+        return fd;
+
+    if ((uint64_t) st.st_size < ckpt->output) {
+        fprintf(stderr, "%s: %s is shorter than the checkpoint says; remove "
+                "the checkpoint to start over.\n", prog, output);
+        goto err;
+    }
+
+    errno = 0;
+    if (ftruncate(fd, (off_t) ckpt->output) < 0 ||
+            lseek(fd, (off_t) ckpt->output, SEEK_SET) < 0) {
+        fprintf(stderr, "%s: failed to truncate %s: %d.\n", prog, output,
+                errno);
+        goto err;
+    }
+
+    return fd;
+
+err:
+    close(fd);
+    return -1;
+}
+
+/* Write @ckpt to @path after we decoded @trace_size bytes of the trace.
+ *
+ * Like the index, the checkpoint is written next to @path and renamed into
+ * place, so an interrupted run leaves the previous checkpoint intact.
+ */
+static int checkpoint_save(struct vmpt_checkpoint *ckpt, const char *path,
+        uint64_t trace_size, const char *prog)
+{
+    ssize_t written;
+    char *tmp;
+    int fd, errcode;
+
+    if (ckpt->state.offset == UINT64_MAX) {
+        fprintf(stderr, "%s: no PSB in the trace; not writing %s.\n", prog,
+                path);
+        return 0;
+    }
+
+    ckpt->trace_size = trace_size;
+
+    tmp = index_path(path, ".tmp");
+    if (!tmp) {
+        fprintf(stderr, "%s: failed to allocate memory.\n", prog);
+        return -pte_nomem;
+    }
+
+    errno = 0;
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "%s: failed to open %s: %d.\n", prog, tmp, errno);
+        errcode = -pte_bad_file;
+        goto out;
+    }
+
+    errcode = 0;
+    written = write(fd, ckpt, sizeof(*ckpt));
+    if (written != (ssize_t) sizeof(*ckpt) || fsync(fd) < 0) {
+        fprintf(stderr, "%s: failed to write %s: %d.\n", prog, tmp, errno);
+        errcode = -pte_bad_file;
+    }
+
+    close(fd);
+    if (!errcode && rename(tmp, path) < 0) {
+        fprintf(stderr, "%s: failed to rename %s: %d.\n", prog, tmp, errno);
+        errcode = -pte_bad_file;
+    }
+    if (errcode < 0)
+        (void) unlink(tmp);
+
+out:
+    free(tmp);
+    return errcode;
+}
+
+/* Look up the --cache entry for decoding @ptfile with @config and @options.
+ *
+ * On a hit, the entry is loaded and @cache->hit is set.  On a miss, we start
+ * a new entry in a temporary file; vmpt_context_cache() has the decode
+ * recorded into it and cache_save() puts it in place.  Entries that do not
+ * match their key, e.g. after a hash collision, count as a miss and are
+ * replaced.
+ *
+ * Returns zero on success, a negative error code otherwise.
+ */
+static int cache_open(struct vmpt_cache *cache, const char *ptfile,
+        const struct pt_config *config, const struct vmpt_options *options,
+        const char *prog)
+{
+    const struct vmpt_cache_header *header;
+    struct vmpt_cache_key *key;
+    uint64_t begin, end;
+    struct stat st;
+    int errcode, fd;
+    char *arg;
+
+    memset(cache, 0, sizeof(*cache));
+    cache->fd = -1;
+
+    /* Find the file and range like open_trace() will, without cutting the
+     * range off @ptfile.
+     */
+    arg = strdup(ptfile);
+    if (!arg) {
+        fprintf(stderr, "%s: failed to allocate memory.\n", prog);
+        return -pte_nomem;
+    }
+
+    fd = open_file(&begin, &end, arg, prog);
+    if (fd < 0) {
+        free(arg);
+        return -pte_bad_file;
+    }
+
+    errcode = fstat(fd, &st);
+    close(fd);
+    if (errcode < 0) {
+        fprintf(stderr, "%s: failed to stat %s: %d.\n", prog, arg, errno);
+        free(arg);
+        return -pte_bad_file;
+    }
+
+    free(arg);
+
+    key = &cache->header.key;
+    key->trace_dev = (uint64_t) st.st_dev;
+    key->trace_ino = (uint64_t) st.st_ino;
+    key->trace_size = (uint64_t) st.st_size;
+    key->mtime_sec = (uint64_t) st.st_mtim.tv_sec;
+    key->mtime_nsec = (uint64_t) st.st_mtim.tv_nsec;
+    key->begin = begin;
+    key->end = end;
+    if (options->tsc_range) {
+        key->tsc_range = 1;
+        key->tsc_begin = options->tsc_begin;
+        key->tsc_end = options->tsc_end;
+    }
+    key->vendor = (uint32_t) config->cpu.vendor;
+    key->family = config->cpu.family;
+    key->model = config->cpu.model;
+    key->stepping = config->cpu.stepping;
+
+    cache->path = cache_path(options->cache, key, sizeof(*key), ".cache");
+    cache->tmp = cache_path(options->cache, key, sizeof(*key), ".cache.tmp");
+    if (!cache->path || !cache->tmp) {
+        fprintf(stderr, "%s: failed to allocate memory.\n", prog);
+        errcode = -pte_nomem;
+        goto err;
+    }
+
+    fd = open(cache->path, O_RDONLY);
+    if (fd >= 0) {
+        if (fstat(fd, &st) == 0 &&
+                (uint64_t) st.st_size >= sizeof(*header) &&
+                load_range(&cache->entry, fd, 0ull, (uint64_t) st.st_size,
+                    options, cache->path, prog) == 0) {
+            header = (const struct vmpt_cache_header *) cache->entry.begin;
+            if (!memcmp(header->magic, VMPT_CACHE_MAGIC,
+                        sizeof(header->magic)) &&
+                    header->version == VMPT_CACHE_VERSION &&
+                    header->record_size == sizeof(struct vmpt_bin_record) &&
+                    !memcmp(&header->key, key, sizeof(*key)) &&
+                    header->nrecords == (cache->entry.size - sizeof(*header)) /
+                    sizeof(struct vmpt_bin_record) &&
+                    !((cache->entry.size - sizeof(*header)) %
+                        sizeof(struct vmpt_bin_record))) {
+                cache->header = *header;
+                cache->hit = 1;
+                close(fd);
+                return 0;
+            }
+
+            vmpt_trace_unload(&cache->entry);
+        }
+
+        close(fd);
+    }
+
+    errno = 0;
+    cache->fd = open(cache->tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (cache->fd < 0) {
+        fprintf(stderr, "%s: failed to open %s: %d.\n", prog, cache->tmp,
+                errno);
+        errcode = -pte_bad_file;
+        goto err;
+    }
+
+    errcode = writer_init(&cache->writer, cache->fd, writer_size);
+    if (errcode < 0) {
+        fprintf(stderr, "%s: failed to allocate output buffer.\n", prog);
+        close(cache->fd);
+        cache->fd = -1;
+        (void) unlink(cache->tmp);
+        goto err;
+    }
+
+    /* The header goes in once we know the rest. */
+    writer_put(&cache->writer, (const char *) &cache->header,
+            sizeof(cache->header));
+    return 0;
+
+err:
+    free(cache->path);
+    free(cache->tmp);
+    cache->path = cache->tmp = NULL;
+    return errcode;
+}
+
+/* Put the --cache entry @ctx recorded on a miss in place.
+ *
+ * Call it after the decode, with its @status, and before the output format
+ * ends.  A decode that failed is not cached.  Like the index, the entry is
+ * renamed into place, so readers never see a partial entry.
+ */
+static int cache_save(struct vmpt_cache *cache,
+        const struct vmpt_context *ctx, int status, const char *prog)
+{
+    struct vmpt_cache_header *header;
+    int errcode;
+
+    header = &cache->header;
+    memcpy(header->magic, VMPT_CACHE_MAGIC, sizeof(header->magic));
+    header->version = VMPT_CACHE_VERSION;
+    header->record_size = sizeof(struct vmpt_bin_record);
+    header->last_tsc = ctx->dec.last_tsc;
+    header->got_tsc = (uint32_t) ctx->dec.got_tsc;
+    header->got_pip = (uint32_t) ctx->dec.got_pip;
+    header->stats = ctx->dec.stats;
+
+    errcode = 0;
+    errno = 0;
+    if (writer_fini(&cache->writer) < 0 ||
+            pwrite(cache->fd, header, sizeof(*header), 0) !=
+            (ssize_t) sizeof(*header)) {
+        fprintf(stderr, "%s: failed to write %s: %d.\n", prog, cache->tmp,
+                cache->writer.error ? cache->writer.error : errno);
+        errcode = -pte_bad_file;
+    }
+
+    close(cache->fd);
+    cache->fd = -1;
+    if (!errcode && status >= 0 && rename(cache->tmp, cache->path) < 0) {
+        fprintf(stderr, "%s: failed to rename %s: %d.\n", prog, cache->tmp,
+                errno);
+        errcode = -pte_bad_file;
+    }
+    if (errcode < 0 || status < 0)
+        (void) unlink(cache->tmp);
+
+    return errcode;
+}
+
+/* Write the --cache entry @cache to @ctx's output format instead of
+ * decoding, and leave @ctx as the decode would have.
+ */
+static void cache_replay(struct vmpt_context *ctx,
+        const struct vmpt_cache *cache)
+{
+    const struct vmpt_bin_record *records;
+    uint64_t load_ns, loaded;
+
+    records = (const struct vmpt_bin_record *) (cache->entry.begin +
+            sizeof(cache->header));
+    vmpt_context_replay(ctx, records, records + cache->header.nrecords);
+
+    ctx->dec.last_tsc = cache->header.last_tsc;
+    ctx->dec.got_tsc = (int) cache->header.got_tsc;
+    ctx->dec.got_pip = (int) cache->header.got_pip;
+
+    /* What we loaded is this run's. */
+    load_ns = ctx->dec.stats.load_ns;
+    loaded = ctx->dec.stats.loaded;
+    ctx->dec.stats = cache->header.stats;
+    ctx->dec.stats.load_ns = load_ns;
+    ctx->dec.stats.loaded = loaded;
+}
+
+static void cache_close(struct vmpt_cache *cache)
+{
+    if (cache->fd >= 0) {
+        (void) writer_fini(&cache->writer);
+        close(cache->fd);
+        (void) unlink(cache->tmp);
+    }
+
+    vmpt_trace_unload(&cache->entry);
+    free(cache->path);
+    free(cache->tmp);
+    cache->fd = -1;
+    cache->path = cache->tmp = NULL;
+}
+
+/* Set by signals to end live tracing. */
+static volatile sig_atomic_t live_stop;
+
+static void live_signal(int signum)
+{
+    (void) signum;
+
+    live_stop = 1;
+}
+
+static int perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu,
+        int group, unsigned long flags)
+{
+    return (int) syscall(__NR_perf_event_open, attr, pid, cpu, group, flags);
+}
+
+/* Read the first line of sysfs file @path into @buffer. */
+static int read_sysfs(char *buffer, size_t size, const char *path)
+{
+    FILE *file;
+    char *line;
+
+    file = fopen(path, "r");
+    if (!file)
+        return -1;
+
+    line = fgets(buffer, (int) size, file);
+    fclose(file);
+
+    return line ? 0 : -1;
+}
+
+/* Set intel_pt format term @term in @config, e.g. "tsc" - "config:10". */
+static void pmu_set_term(struct perf_event_attr *attr, const char *term)
+{
+    char path[256], value[64];
+    unsigned int bit;
+
+    snprintf(path, sizeof(path),
+            "/sys/bus/event_source/devices/intel_pt/format/%s", term);
+    if (read_sysfs(value, sizeof(value), path) < 0)
+        return;
+
+    if (sscanf(value, "config:%u", &bit) == 1 && bit < 64)
+        attr->config |= 1ull << bit;
+}
+
+/* A live Intel PT session on one cpu. */
+struct live_session {
+    int fd;
+
+    /* The perf user page followed by the data ring. */
+    struct perf_event_mmap_page *page;
+    size_t map_size;
+
+    /* The AUX ring the trace is written to. */
+    uint8_t *aux;
+    size_t aux_size;
+
+    /* Where we copy wrapped-around trace. */
+    uint8_t *staging;
+
+    /* The AUX offset at which a gap follows, e.g. because the kernel had to
+     * drop trace while the ring was full, and whether there is one.
+     */
+    uint64_t gap;
+    int has_gap;
+
+    /* The number of truncated AUX records we have seen. */
+    uint64_t truncated;
+};
+
+static int live_open(struct live_session *session,
+        const struct vmpt_options *options, const char *prog)
+{
+    struct perf_event_attr attr;
+    char value[64];
+    size_t page;
+    void *map;
+
+    memset(session, 0, sizeof(*session));
+    session->fd = -1;
+
+    if (read_sysfs(value, sizeof(value),
+            "/sys/bus/event_source/devices/intel_pt/type") < 0) {
+        fprintf(stderr, "%s: intel_pt is not available.\n", prog);
+        return -pte_not_supported;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = (uint32_t) strtoul(value, NULL, 0);
+    attr.disabled = 1;
+    attr.exclude_hv = 0;
+    attr.exclude_kernel = 0;
+
+    /* We need TSC packets; PIP and VMCS come with kernel tracing. */
+    pmu_set_term(&attr, "pt");
+    pmu_set_term(&attr, "tsc");
+    pmu_set_term(&attr, "branch");
+
+    /* Wake us up each time a quarter of the AUX ring fills up. */
+    attr.aux_watermark = (uint32_t) (options->aux_size / 4);
+
+    errno = 0;
+    session->fd = perf_event_open(&attr, -1, options->live_cpu, -1,
+            PERF_FLAG_FD_CLOEXEC);
+    if (session->fd < 0) {
+        fprintf(stderr, "%s: failed to open intel_pt on cpu %d: %d.\n",
+                prog, options->live_cpu, errno);
+        return -pte_bad_config;
+    }
+
+    page = (size_t) sysconf(_SC_PAGESIZE);
+    session->map_size = (1 + live_data_pages) * page;
+    map = mmap(NULL, session->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            session->fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "%s: failed to map perf buffer: %d.\n", prog, errno);
+        goto err_fd;
+    }
+
+    session->page = map;
+    session->aux_size = (size_t) options->aux_size;
+    session->page->aux_offset = session->map_size;
+    session->page->aux_size = session->aux_size;
+
+    /* Mapping the AUX ring writable makes the kernel stop at our aux_tail
+     * rather than overwrite trace we have not decoded, yet.
+     */
+    map = mmap(NULL, session->aux_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            session->fd, (off_t) session->map_size);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "%s: failed to map AUX buffer: %d.\n", prog, errno);
+        goto err_page;
+    }
+
+    session->aux = map;
+
+    session->staging = malloc(session->aux_size);
+    if (!session->staging) {
+        fprintf(stderr, "%s: failed to allocate memory.\n", prog);
+        goto err_aux;
+    }
+
+    if (ioctl(session->fd, PERF_EVENT_IOC_ENABLE, 0) < 0) {
+        fprintf(stderr, "%s: failed to enable tracing: %d.\n", prog, errno);
+        goto err_staging;
+    }
+
+    return 0;
+
+err_staging:
+    free(session->staging);
+err_aux:
+    munmap(session->aux, session->aux_size);
+err_page:
+    munmap(session->page, session->map_size);
+err_fd:
+    close(session->fd);
+    session->fd = -1;
+    return -pte_bad_config;
+}
+
+static void live_close(struct live_session *session)
+{
+    if (session->fd < 0)
+        return;
+
+    (void) ioctl(session->fd, PERF_EVENT_IOC_DISABLE, 0);
+
+    free(session->staging);
+    munmap(session->aux, session->aux_size);
+    munmap(session->page, session->map_size);
+    close(session->fd);
+
+    session->fd = -1;
+}
+
+/* Consume the data ring and remember where the kernel dropped trace. */
+static void live_read_records(struct live_session *session)
+{
+    struct perf_event_mmap_page *page;
+    uint64_t head, tail, size;
+    uint8_t *data;
+
+    page = session->page;
+    data = (uint8_t *) page + page->data_offset;
+    size = page->data_size;
+
+    head = __atomic_load_n(&page->data_head, __ATOMIC_ACQUIRE);
+    tail = page->data_tail;
+
+    while (tail + sizeof(struct perf_event_header) <= head) {
+        struct perf_event_header header;
+        uint8_t record[64];
+        uint64_t idx;
+        size_t copy;
+
+        for (idx = 0; idx < sizeof(header); ++idx)
+            ((uint8_t *) &header)[idx] = data[(tail + idx) % size];
+
+        if (!header.size || head < tail + header.size)
+            break;
+
+        copy = header.size < sizeof(record) ? header.size : sizeof(record);
+        for (idx = 0; idx < copy; ++idx)
+            record[idx] = data[(tail + idx) % size];
+
+        if (header.type == PERF_RECORD_AUX &&
+                sizeof(header) + 3 * sizeof(uint64_t) <= copy) {
+            uint64_t aux[3];
+
+            /* aux_offset, aux_size, flags */
+            memcpy(aux, record + sizeof(header), sizeof(aux));
+            if (aux[2] & PERF_AUX_FLAG_TRUNCATED) {
+                session->truncated += 1;
+                if (!session->has_gap) {
+                    session->gap = aux[0] + aux[1];
+                    session->has_gap = 1;
+                }
+            }
+        }
+
+        tail += header.size;
+    }
+
+    __atomic_store_n(&page->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+/* Decode the new trace in @session's AUX ring.
+ *
+ * We decode straight out of the ring unless the new trace wraps around, in
+ * which case we copy it into the staging buffer first.  Whatever
+ * dump_window() leaves undecoded stays in the ring until more trace follows.
+ */
+static int live_dump(struct vmpt_context *ctx, struct live_session *session,
+        struct pt_config *config, int *synced, int more)
+{
+    struct perf_event_mmap_page *page;
+    uint64_t head, tail, size, next, begin;
+    int errcode, gap;
+
+    page = session->page;
+    head = __atomic_load_n(&page->aux_head, __ATOMIC_ACQUIRE);
+    tail = page->aux_tail;
+
+    /* Stop in front of a gap and decode up to it as if the trace ended
+     * there.  We resync after the gap.
+     */
+    gap = 0;
+    if (session->has_gap && tail < session->gap && session->gap <= head) {
+        head = session->gap;
+        gap = 1;
+    } else if (session->has_gap && session->gap <= tail)
+        session->has_gap = 0;
+
+    size = head - tail;
+    if (!size)
+        return 0;
+
+    begin = tail % session->aux_size;
+    if (begin + size <= session->aux_size)
+        config->begin = session->aux + begin;
+    else {
+        size_t first;
+
+        first = (size_t) (session->aux_size - begin);
+        memcpy(session->staging, session->aux + begin, first);
+        memcpy(session->staging + first, session->aux,
+                (size_t) size - first);
+        config->begin = session->staging;
+    }
+
+    config->end = config->begin + size;
+
+    errcode = dump_window(ctx, config, more && !gap, synced, &next);
+
+    /* Make room if the ring is full and we could not make progress. */
+    if (gap || (!next && size == session->aux_size)) {
+        next = size;
+        *synced = 0;
+        session->has_gap = 0;
+    }
+
+    __atomic_store_n(&page->aux_tail, tail + next, __ATOMIC_RELEASE);
+
+    if (errcode == -pte_eos)
+        errcode = 0;
+
+    return errcode;
+}
+
+/* Trace @options->live_cpu and decode the trace as it comes in.
+ *
+ * Bundles are written out after every chunk of trace, so they can be
+ * consumed while we are still tracing.
+ */
+static int dump_live(struct vmpt_context *ctx, struct pt_config *config,
+        const struct vmpt_options *options, const char *prog)
+{
+    struct live_session session;
+    struct sigaction action;
+    struct timespec start;
+    int errcode, synced;
+
+    errcode = live_open(&session, options, prog);
+    if (errcode < 0)
+        return errcode;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = live_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    synced = 0;
+    while (!live_stop) {
+        struct pollfd pfd;
+
+        pfd.fd = session.fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        (void) poll(&pfd, 1, 100);
+
+        live_read_records(&session);
+
+        errcode = live_dump(ctx, &session, config, &synced, 1);
+        if (errcode < 0)
+            break;
+
+        (void) writer_flush(ctx->out);
+
+        if (ctx->format->idle)
+            ctx->format->idle(ctx);
+
+        if (options->duration) {
+            struct timespec now;
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if ((uint64_t) (now.tv_sec - start.tv_sec) >= options->duration)
+                break;
+        }
+    }
+
+    /* Decode what is left once tracing stopped. */
+    (void) ioctl(session.fd, PERF_EVENT_IOC_DISABLE, 0);
+    live_read_records(&session);
+    if (errcode >= 0)
+        errcode = live_dump(ctx, &session, config, &synced, 0);
+
+    if (session.truncated)
+        fprintf(stderr, "%s: trace was dropped %" PRIu64 " times.\n", prog,
+                session.truncated);
+
+    live_close(&session);
+    return errcode;
+}
+
+/* The prefix of an output that is a Unix domain socket. */
+static const char unix_prefix[] = "unix:";
+
+/* Open @output for writing.
+ *
+ * @output is "-" for stdout, "unix:<path>" for a stream socket that is
+ * listening at <path>, or a file that is created or truncated.
+ *
+ * Returns the file descriptor on success, a negative value otherwise.
+ */
+static int open_output(const char *output, const char *prog)
+{
+    struct sockaddr_un addr;
+    const char *path;
+    int fd;
+
+    if (strcmp(output, "-") == 0)
+        return STDOUT_FILENO;
+
+    if (strncmp(output, unix_prefix, sizeof(unix_prefix) - 1) != 0) {
+        errno = 0;
+        fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0)
+            fprintf(stderr, "%s: failed to open %s: %d.\n", prog, output,
+                    errno);
+
+        return fd;
+    }
+
+    path = output + sizeof(unix_prefix) - 1;
+    if (!*path || sizeof(addr.sun_path) <= strlen(path)) {
+        fprintf(stderr, "%s: bad socket path: %s.\n", prog, path);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    errno = 0;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "%s: failed to create socket: %d.\n", prog, errno);
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "%s: failed to connect to %s: %d.\n", prog, path,
+                errno);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int main(int argc, char *argv[])
+{
+    struct vmpt_options options;
+    struct vmpt_checkpoint ckpt;
+    struct vmpt_cache cache;
+    struct flight_ring ring;
+    struct vmpt_writer writer;
+    struct vmpt_context ctx;
+    struct trace_input in;
+    struct pt_config config;
+    uint64_t start, load_ns;
+    int errcode, idx, out, ntraces, resumed;
+    char **ptfiles, **dirfiles;
+    char filename[32];
+    struct stat st;
+
+    ptfiles = dirfiles = NULL;
+    ntraces = 0;
+
+    memset(&options, 0, sizeof(options));
+    options.format = &json_format;
+    options.live_cpu = -1;
+    options.aux_size = default_aux_size;
+    options.write_queue = default_write_queue;
+    options.compress_level = -1;
+    memset(&in, 0, sizeof(in));
+    in.fd = -1;
+    memset(&ring, 0, sizeof(ring));
+    memset(&cache, 0, sizeof(cache));
+    cache.fd = -1;
+    memset(&config, 0, sizeof(config));
+    pt_config_init(&config);
+
+    for (idx = 1; idx < argc; ++idx) {
+        if (strncmp(argv[idx], "-", 1) != 0) {
+            ptfiles = &argv[idx];
+            ntraces = argc - idx;
+            for (; idx < argc; ++idx)
+                if (strncmp(argv[idx], "-", 1) == 0)
+                    return usage(argv[0]);
+            break;
+        }
+
+        if (strcmp(argv[idx], "--help") == 0 ||
+                strcmp(argv[idx], "-h") == 0)
+            return help(argv[0]);
+        else if (strcmp(argv[idx], "--no-mmap") == 0)
+            options.no_mmap = 1;
+        else if (strcmp(argv[idx], "--huge-pages") == 0)
+            options.huge_pages = 1;
+        else if (strcmp(argv[idx], "--compact") == 0)
+            options.compact = 1;
+        else if (strcmp(argv[idx], "--stats") == 0 ||
+                strcmp(argv[idx], "--stats=text") == 0)
+            options.stats = stm_text;
+        else if (strcmp(argv[idx], "--stats=json") == 0)
+            options.stats = stm_json;
+        else if (strcmp(argv[idx], "--index") == 0)
+            options.index = 1;
+        else if (strcmp(argv[idx], "--tsc-range") == 0) {
+            options.tsc_end = UINT64_MAX;
+            if (++idx >= argc || parse_range(argv[idx], &options.tsc_begin,
+                        &options.tsc_end) < 0 ||
+                    options.tsc_end < options.tsc_begin) {
+                fprintf(stderr, "%s: --tsc-range: bad range.\n", argv[0]);
+                return -1;
+            }
+
+            options.tsc_range = 1;
+        }
+        else if (strcmp(argv[idx], "--checkpoint") == 0) {
+            if (++idx >= argc) {
+                fprintf(stderr, "%s: --checkpoint: missing file.\n",
+                        argv[0]);
+                return -1;
+            }
+
+            options.checkpoint = argv[idx];
+        } else if (strcmp(argv[idx], "--cache") == 0) {
+            if (++idx >= argc) {
+                fprintf(stderr, "%s: --cache: missing directory.\n",
+                        argv[0]);
+                return -1;
+            }
+
+            options.cache = argv[idx];
+        } else if (strcmp(argv[idx], "--resume") == 0)
+            options.resume = 1;
+        else if (strcmp(argv[idx], "--prefilter") == 0)
+            options.prefilter = pfm_auto;
+        else if (strcmp(argv[idx], "--prefilter=scalar") == 0)
+            options.prefilter = pfm_scalar;
+        else if (strcmp(argv[idx], "--prefilter=avx2") == 0)
+            options.prefilter = pfm_avx2;
+        else if (strcmp(argv[idx], "--prefilter=avx512") == 0)
+            options.prefilter = pfm_avx512;
+        else if (strcmp(argv[idx], "--format=json") == 0)
+            options.format = &json_format;
+        else if (strcmp(argv[idx], "--format=bin") == 0)
+            options.format = &bin_format;
+        else if (strcmp(argv[idx], "--format=perfetto") == 0)
+            options.format = &perfetto_format;
+        else if (strcmp(argv[idx], "--format=packed") == 0)
+            options.format = &packed_format;
+        else if (strcmp(argv[idx], "--aggregate") == 0)
+            options.format = &aggr_format;
+        else if (strncmp(argv[idx], "--compress=", 11) == 0) {
+            if (strcmp(argv[idx] + 11, "zstd") == 0)
+                options.compress = wc_zstd;
+            else if (strcmp(argv[idx] + 11, "lz4") == 0)
+                options.compress = wc_lz4;
+            else
+                return unknown_option_error(argv[idx], argv[0]);
+
+            if (!writer_has_codec(options.compress)) {
+                fprintf(stderr, "%s: built without %s support.\n", argv[0],
+                        argv[idx] + 11);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[idx], "--compress-level") == 0) {
+            char *rest;
+
+            if (++idx >= argc) {
+                fprintf(stderr, "%s: --compress-level: missing level.\n",
+                        argv[0]);
+                return -1;
+            }
+
+            errno = 0;
+            options.compress_level = (int) strtol(argv[idx], &rest, 0);
+            if (errno || *rest || options.compress_level < 0) {
+                fprintf(stderr, "%s: --compress-level: bad level.\n",
+                        argv[0]);
+                return -1;
+            }
+        } else if (strcmp(argv[idx], "-o") == 0 ||
+                strcmp(argv[idx], "--output") == 0) {
+            if (++idx >= argc) {
+                fprintf(stderr, "%s: %s: missing output.\n", argv[0],
+                        argv[idx - 1]);
+                return -1;
+            }
+
+            options.output = argv[idx];
+        }
+        else if (strcmp(argv[idx], "--window") == 0) {
+            if (++idx >= argc || parse_size(argv[idx], &options.window) < 0 ||
+                    options.window < min_window ||
+                    (uint64_t) (size_t) options.window != options.window) {
+                fprintf(stderr, "%s: --window: bad window size.\n",
+                        argv[0]);
+                return -1;
+            }
+        } else if (strcmp(argv[idx], "--live") == 0) {
+            char *rest;
+
+            if (++idx >= argc) {
+                fprintf(stderr, "%s: --live: missing cpu.\n", argv[0]);
+                return -1;
+            }
+
+            errno = 0;
+            options.live_cpu = (int) strtol(argv[idx], &rest, 0);
+            if (errno || *rest || options.live_cpu < 0) {
+                fprintf(stderr, "%s: --live: bad cpu.\n", argv[0]);
+                return -1;
+            }
+        } else if (strcmp(argv[idx], "--aux-size") == 0) {
+            uint64_t page;
+
+            page = (uint64_t) sysconf(_SC_PAGESIZE);
+            if (++idx >= argc ||
+                    parse_size(argv[idx], &options.aux_size) < 0 ||
+                    options.aux_size < page ||
+                    (options.aux_size & (options.aux_size - 1)) ||
+                    (uint64_t) (size_t) options.aux_size != options.aux_size) {
+                fprintf(stderr, "%s: --aux-size: the size must be a power "
+                        "of two multiple of the page size.\n", argv[0]);
+                return -1;
+            }
+        } else if (strcmp(argv[idx], "--duration") == 0) {
+            char *rest;
+
+            if (++idx >= argc) {
+                fprintf(stderr, "%s: --duration: missing seconds.\n",
+                        argv[0]);
+                return -1;
+            }
+
+            errno = 0;
+            options.duration = (unsigned int) strtoul(argv[idx], &rest, 0);
+            if (errno || *rest) {
+                fprintf(stderr, "%s: --duration: bad seconds.\n", argv[0]);
+                return -1;
+            }
+        } else if (strcmp(argv[idx], "--write-queue") == 0) {
+            char *rest;
+
+            if (++idx >= argc) {
+                fprintf(stderr, "%s: --write-queue: missing depth.\n",
+                        argv[0]);
+                return -1;
+            }
+
+            errno = 0;
+            options.write_queue = (int) strtol(argv[idx], &rest, 0);
+            if (errno || *rest || options.write_queue < 0 ||
+                    options.write_queue == 1) {
+                fprintf(stderr, "%s: --write-queue: the depth must be zero "
+                        "or at least two.\n", argv[0]);
+                return -1;
+            }
+        } else if (strcmp(argv[idx], "--cpus") == 0) {
+            cpu_set_t cpus;
+
+            if (++idx >= argc || parse_cpus(argv[idx], &cpus) < 0) {
+                fprintf(stderr, "%s: --cpus: bad cpu list.\n", argv[0]);
+                return -1;
+            }
+
+            /* Everything runs there, not just the workers.  The kernel
+             * leaves out the cpus that are offline.
+             */
+            if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0 ||
+                    sched_getaffinity(0, sizeof(cpus), &cpus) < 0) {
+                fprintf(stderr, "%s: --cpus: %s.\n", argv[0],
+                        strerror(errno));
+                return -1;
+            }
+
+            options.ncpus = cpu_order(options.cpus, &cpus);
+            if (options.ncpus < 0) {
+                fprintf(stderr, "%s: failed to allocate memory.\n",
+                        argv[0]);
+                return -1;
+            }
+        } else if (strcmp(argv[idx], "--ring") == 0 ||
+                strcmp(argv[idx], "--ring-ticks") == 0 ||
+                strcmp(argv[idx], "--trigger-hold") == 0) {
+            uint64_t value;
+            char *rest;
+
+            if (++idx >= argc) {
+                fprintf(stderr, "%s: %s: missing argument.\n", argv[0],
+                        argv[idx - 1]);
+                return -1;
+            }
+
+            errno = 0;
+            value = strtoull(argv[idx], &rest, 0);
+            if (errno || *rest || !value ||
+                    (uint64_t) (size_t) value != value) {
+                fprintf(stderr, "%s: %s: bad number.\n", argv[0],
+                        argv[idx - 1]);
+                return -1;
+            }
+
+            if (strcmp(argv[idx - 1], "--ring") == 0) {
+                options.ring = value;
+                options.format = &ring_format;
+            } else if (strcmp(argv[idx - 1], "--ring-ticks") == 0)
+                options.ring_ticks = value;
+            else
+                options.ring_trigger = value;
+        } else if (strcmp(argv[idx], "--sample") == 0) {
+            char *rest;
+
+            if (++idx >= argc) {
+                fprintf(stderr, "%s: --sample: missing stride.\n", argv[0]);
+                return -1;
+            }
+
+            errno = 0;
+            options.sample = strtoull(argv[idx], &rest, 0);
+            if (errno || *rest || !options.sample) {
+                fprintf(stderr, "%s: --sample: bad stride.\n", argv[0]);
+                return -1;
+            }
+        } else if (strcmp(argv[idx], "-j") == 0 ||
+                strcmp(argv[idx], "--jobs") == 0) {
+            char *rest;
+
+            if (++idx >= argc) {
+                fprintf(stderr, "%s: %s: missing argument.\n", argv[0],
+                        argv[idx - 1]);
+                return -1;
+            }
+
+            errno = 0;
+            options.jobs = (int) strtol(argv[idx], &rest, 0);
+            if (errno || *rest || options.jobs < 1) {
+                fprintf(stderr, "%s: %s: bad number of jobs.\n", argv[0],
+                        argv[idx - 1]);
+                return -1;
+            }
+        } else
+            return unknown_option_error(argv[idx], argv[0]);
+    }
+
+    if (options.live_cpu >= 0) {
+        if (ntraces || options.window || options.jobs > 1 ||
+                options.index) {
+            fprintf(stderr, "%s: --live does not take trace files, --window, "
+                    "-j or --index.\n", argv[0]);
+            return -1;
+        }
+    } else if (!ntraces)
+        return no_file_error(argv[0]);
+
+    if (ntraces == 1 && stat(ptfiles[0], &st) == 0 && S_ISDIR(st.st_mode)) {
+        ntraces = list_traces(&dirfiles, ptfiles[0], argv[0]);
+        if (ntraces < 0)
+            return ntraces;
+
+        ptfiles = dirfiles;
+    }
+
+    if (ntraces > 1 && (options.format == &aggr_format ||
+                options.format == &perfetto_format ||
+                options.format == &ring_format)) {
+        fprintf(stderr, "%s: --aggregate, --format=perfetto and --ring work "
+                "on one cpu's trace at a time.\n", argv[0]);
+        return -1;
+    }
+
+    if ((options.ring_ticks || options.ring_trigger) &&
+            options.format != &ring_format) {
+        fprintf(stderr, "%s: --ring-ticks and --trigger-hold need --ring.\n",
+                argv[0]);
+        return -1;
+    }
+
+    if (ntraces > 1 && options.jobs > 1) {
+        fprintf(stderr, "%s: -j does not apply to several traces.\n",
+                argv[0]);
+        return -1;
+    }
+
+    if (options.prefilter && (options.window || options.jobs > 1 ||
+                options.live_cpu >= 0)) {
+        fprintf(stderr, "%s: --prefilter needs the whole trace in memory; it "
+                "does not work with --window, -j or --live.\n", argv[0]);
+        return -1;
+    }
+
+    if (!prefilter_supported(options.prefilter)) {
+        fprintf(stderr, "%s: --prefilter=%s is not supported on this cpu.\n",
+                argv[0], options.prefilter == pfm_avx2 ? "avx2" : "avx512");
+        return -1;
+    }
+
+    if (options.sample && (ntraces > 1 || options.window ||
+                options.jobs > 1 || options.live_cpu >= 0 ||
+                options.tsc_range || options.checkpoint)) {
+        fprintf(stderr, "%s: --sample needs a single trace in memory; it "
+                "does not work with --window, -j, --live, --tsc-range or "
+                "--checkpoint.\n", argv[0]);
+        return -1;
+    }
+
+    if (options.window && options.jobs > 1) {
+        fprintf(stderr, "%s: --window and -j are mutually exclusive.\n",
+                argv[0]);
+        return -1;
+    }
+
+    if (options.tsc_range && (ntraces != 1 || options.window ||
+                options.jobs > 1 || options.prefilter)) {
+        fprintf(stderr, "%s: --tsc-range takes a single trace; it does not "
+                "work with --window, -j, --prefilter or --live.\n", argv[0]);
+        return -1;
+    }
+
+    if (options.resume && !options.checkpoint) {
+        fprintf(stderr, "%s: --resume needs --checkpoint.\n", argv[0]);
+        return -1;
+    }
+
+    if (options.checkpoint && (ntraces != 1 || options.jobs > 1 ||
+                options.prefilter || options.tsc_range || options.index ||
+                options.compress || options.format == &aggr_format ||
+                options.format == &perfetto_format ||
+                options.format == &packed_format ||
+                options.format == &ring_format ||
+                (options.output && (strcmp(options.output, "-") == 0 ||
+                    strncmp(options.output, unix_prefix,
+                        sizeof(unix_prefix) - 1) == 0)))) {
+        fprintf(stderr, "%s: --checkpoint takes a single trace and writes "
+                "to a file; it does not work with -j, --prefilter, "
+                "--tsc-range, --index, --compress, --aggregate, "
+                "--format=perfetto, --format=packed, --ring or --live.\n",
+                argv[0]);
+        return -1;
+    }
+
+    if (options.cache && !options.index && (ntraces != 1 ||
+                options.sample || options.checkpoint ||
+                options.format == &ring_format)) {
+        fprintf(stderr, "%s: --cache takes a single trace; it does not work "
+                "with --sample, --checkpoint, --ring or --live.\n", argv[0]);
+        return -1;
+    }
+
+    /* Report a reader that went away as a write error rather than dying of
+     * SIGPIPE.
+     */
+    if (options.output && !options.index)
+        signal(SIGPIPE, SIG_IGN);
+
+    errcode = pt_cpu_errata(&config.errata, &config.cpu);
+    if (errcode < 0)
+        diag("failed to determine errata", 0ull, errcode);
+
+    if (options.index) {
+        errcode = 0;
+        for (idx = 0; idx < ntraces && !errcode; ++idx)
+            errcode = index_trace(&config, ptfiles[idx], &options, argv[0]);
+
+        goto out_traces;
+    }
+
+    resumed = 0;
+    if (options.checkpoint) {
+        errcode = checkpoint_open(&ckpt, &resumed, ptfiles[0], &options,
+                argv[0]);
+        if (errcode < 0)
+            goto out_traces;
+    }
+
+    /* With several traces, each trace is loaded by its decoder thread. */
+    start = now_ns();
+    if (options.cache) {
+        errcode = cache_open(&cache, ptfiles[0], &config, &options, argv[0]);
+        if (errcode < 0)
+            goto out_traces;
+    }
+
+    if (ntraces == 1 && !options.tsc_range && !cache.hit) {
+        errcode = open_trace(&in, &config, ptfiles[0],
+                resumed ? ckpt.state.offset : 0ull, &options, argv[0]);
+        if (errcode < 0)
+            goto out_input;
+
+        if (options.checkpoint && in.codec) {
+            fprintf(stderr, "%s: --checkpoint needs an uncompressed "
+                    "trace.\n", argv[0]);
+            errcode = -pte_bad_file;
+            goto out_input;
+        }
+
+        if (options.sample && in.codec) {
+            fprintf(stderr, "%s: --sample needs an uncompressed trace.\n",
+                    argv[0]);
+            errcode = -pte_bad_file;
+            goto out_input;
+        }
+    }
+
+    load_ns = now_ns() - start;
+
+    if (!options.output) {
+        snprintf(filename, sizeof(filename), "%s%s",
+                options.format->filename, codec_suffix[options.compress]);
+        options.output = filename;
+    }
+
+    if (options.ring) {
+        struct sigaction action;
+
+        ring.records = calloc((size_t) options.ring, sizeof(*ring.records));
+        if (!ring.records) {
+            fprintf(stderr, "%s: failed to allocate the ring.\n", argv[0]);
+            errcode = -pte_nomem;
+            goto out_input;
+        }
+
+        ring.capacity = (size_t) options.ring;
+        ring.ticks = options.ring_ticks;
+        ring.trigger = options.ring_trigger;
+        ring.path = strcmp(options.output, "-") == 0 ||
+            strncmp(options.output, unix_prefix,
+                    sizeof(unix_prefix) - 1) == 0 ?
+            ring_format.filename : options.output;
+
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = ring_signal;
+        sigaction(SIGUSR1, &action, NULL);
+    }
+
+    out = options.checkpoint ?
+        checkpoint_output(options.output, &ckpt, resumed, argv[0]) :
+        open_output(options.output, argv[0]);
+    if (out < 0) {
+        errcode = -pte_bad_file;
+        goto out_input;
+    }
+
+    errcode = writer_init(&writer, out, writer_size);
+    if (errcode < 0) {
+        fprintf(stderr, "%s: failed to allocate output buffer.\n", argv[0]);
+        goto out_output;
+    }
+
+    errcode = writer_set_codec(&writer, options.compress,
+            options.compress_level >= 0 ? options.compress_level :
+            (options.compress == wc_zstd ? default_zstd_level :
+             default_lz4_level));
+    if (errcode < 0) {
+        fprintf(stderr, "%s: failed to set up %s compression: %s.\n",
+                argv[0], codec_name[options.compress],
+                pt_errstr(pt_errcode(errcode)));
+        (void) writer_fini(&writer);
+        goto out_output;
+    }
+
+    if (resumed)
+        writer.pos = ckpt.output;
+
+    if (options.write_queue && writer_start(&writer,
+                options.write_queue) < 0)
+        fprintf(stderr, "%s: failed to start writer thread; writing "
+                "synchronously.\n", argv[0]);
+
+    vmpt_context_init(&ctx, options.format, &writer, options.compact);
+    if (options.ring)
+        ctx.priv = &ring;
+    ctx.dec.stats.load_ns = load_ns;
+    ctx.dec.stats.loaded = cache.hit ? cache.entry.size : in.tb.size;
+    ctx.dec.base = in.begin;
+    if (options.checkpoint)
+        vmpt_context_checkpoint(&ctx, &ckpt);
+    if (cache.fd >= 0)
+        vmpt_context_cache(&ctx, &cache);
+
+    /* A resumed output already has its beginning. */
+    start = now_ns();
+    if (resumed)
+        vmpt_context_restore(&ctx, &ckpt.state);
+    else if (ctx.format->begin)
+        ctx.format->begin(&ctx);
+    if (cache.hit) {
+        cache_replay(&ctx, &cache);
+        errcode = 0;
+    } else if (options.live_cpu >= 0)
+        errcode = dump_live(&ctx, &config, &options, argv[0]);
+    else if (ntraces > 1)
+        errcode = dump_merge(&ctx, ptfiles, ntraces, &options, argv[0]);
+    else if (options.tsc_range)
+        errcode = dump_range(&ctx, &config, ptfiles[0], &options, argv[0]);
+    else if (in.fd >= 0)
+        errcode = dump_stream(&ctx, &config, in.fd, in.codec, in.begin,
+                in.end, resumed, &options, argv[0]);
+    else if (options.jobs > 1)
+        errcode = dump_parallel(&ctx, &config, &options, argv[0]);
+    else if (options.sample)
+        errcode = dump_sample(&ctx, &config, options.sample,
+                options.prefilter);
+    else
+        errcode = options.prefilter ?
+            dump_prefilter(&ctx, &config, options.prefilter) :
+            vmpt_decode(&ctx.dec, &config, resumed, NULL);
+    if (cache.fd >= 0) {
+        int status;
+
+        status = cache_save(&cache, &ctx, errcode, argv[0]);
+        if (status < 0 && !errcode)
+            errcode = status;
+    }
+    if (ctx.format->end)
+        ctx.format->end(&ctx);
+    if (ctx.error < 0) {
+        fprintf(stderr, "%s: failed to write %s: %s.\n", argv[0],
+                options.output, pt_errstr(pt_errcode(ctx.error)));
+        if (!errcode)
+            errcode = ctx.error;
+    }
+    vmpt_context_finish(&ctx);
+
+    if (writer_fini(&writer) < 0) {
+        fprintf(stderr, "%s: failed to write %s: %d.\n", argv[0],
+                options.output, writer.error);
+        if (!errcode)
+            errcode = -pte_bad_file;
+    } else if (options.checkpoint) {
+        int status;
+
+        status = checkpoint_save(&ckpt, options.checkpoint, in.end, argv[0]);
+        if (status < 0 && !errcode)
+            errcode = status;
+    }
+
+    /* Waiting for output is accounted for separately. */
+    ctx.dec.stats.decode_ns = now_ns() - start - writer.stall_ns;
+    if (options.stats)
+        stats_print(&ctx.dec.stats, &writer, options.stats);
+
+out_output:
+    close(out);
+
+out_input:
+    free(ring.records);
+    close_trace(&in);
+    cache_close(&cache);
+
+out_traces:
+    if (dirfiles) {
+        for (idx = 0; idx < ntraces; ++idx)
+            free(dirfiles[idx]);
+        free(dirfiles);
+    }
 
     return -errcode;
 }